@@ -10,12 +10,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include "mii.h"
 #include "mii_bank.h"
 
 #include "mii_woz.h"
 #include "mii_disk2.h"
+#include "mii_snapshot.h"
 
 
 enum {
@@ -362,6 +364,44 @@ _mii_disk2_command(
 	return res;
 }
 
+/*
+ * The disk images themselves are not part of the snapshot, but the floppy
+ * bitstreams are, so what the machine 'sees' is restored, including any
+ * track written since. Unchanged tracks are shared with the previous
+ * snapshot, like the memory.
+ */
+static void
+_mii_disk2_snapshot(
+		mii_t * mii,
+		struct mii_slot_t *slot,
+		struct mii_snap_io_t *io)
+{
+	mii_card_disk2_t *c = slot->drv_priv;
+	// all the LSS/controller state, up to the debug bits
+	mii_snap_io_data(io, MII_SNAP_TAG('D','2','C','T'), &c->selected,
+			offsetof(mii_card_disk2_t, debug_last_write) -
+				offsetof(mii_card_disk2_t, selected));
+	for (int i = 0; i < 2; i++) {
+		mii_floppy_t *f = &c->floppy[i];
+		io->id = (slot->id + 1) | ((i + 1) << 8);
+		/* head position, motor, track maps etc, but not the write protect,
+		 * nor the dirty seeds, they are for the UI, and the disk image */
+		mii_snap_io_data(io, MII_SNAP_TAG('D','2','F','S'), &f->bit_timing,
+				offsetof(mii_floppy_t, seed_dirty) -
+					offsetof(mii_floppy_t, bit_timing));
+		mii_snap_io_data(io, MII_SNAP_TAG('D','2','F','T'), f->track_id,
+				offsetof(mii_floppy_t, track_data) -
+					offsetof(mii_floppy_t, track_id));
+		mii_snap_io_pages(io, MII_SNAP_TAG('D','2','F','D'),
+				&f->track_data[0][0], NULL, sizeof(f->track_data));
+		if (!io->save) {	// UI needs to reload the tracks, dirty or not
+			f->seed_dirty++;
+			f->seed_saved++;
+		}
+	}
+	io->id = slot->id + 1;
+}
+
 static mii_slot_drv_t _driver = {
 	.name = "disk2",
 	.desc = "Apple Disk ][",
@@ -369,6 +409,7 @@ static mii_slot_drv_t _driver = {
 	.reset = _mii_disk2_reset,
 	.access = _mii_disk2_access,
 	.command = _mii_disk2_command,
+	.snapshot = _mii_disk2_snapshot,
 };
 MI_DRIVER_REGISTER(_driver);
 
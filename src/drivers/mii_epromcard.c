@@ -21,6 +21,7 @@
 
 #include "mii.h"
 #include "mii_bank.h"
+#include "mii_snapshot.h"
 
 typedef struct mii_card_ee_t {
 	mii_dd_t 	drive[1];
@@ -127,11 +128,23 @@ _mii_ee_command(
 	return res;
 }
 
+static void
+_mii_ee_snapshot(
+		mii_t * mii,
+		struct mii_slot_t *slot,
+		struct mii_snap_io_t *io)
+{
+	mii_card_ee_t *c = slot->drv_priv;
+	mii_snap_io_data(io, MII_SNAP_TAG('E','E','L','T'), &c->latch,
+			sizeof(c->latch));
+}
+
 static mii_slot_drv_t _driver = {
 	.name = "eecard",
 	.desc = "EEPROM 1MB card",
 	.init = _mii_ee_init,
 	.access = _mii_ee_access,
 	.command = _mii_ee_command,
+	.snapshot = _mii_ee_snapshot,
 };
 MI_DRIVER_REGISTER(_driver);
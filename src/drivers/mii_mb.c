@@ -2,10 +2,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "mii.h"
 #include "mockingboard.h"
 #include "mii_audio.h"
+#include "mii_snapshot.h"
+#include "fifo_declare.h"
+
+// samples per render job, and the max a job can hold
+#define MII_MB_JOB_SAMPLES		256
+#define MII_MB_JOB_MAX			1024
+
+/*
+ * The emulation only logs the AY3 register writes; every MII_MB_JOB_SAMPLES
+ * they are handed to the render thread, with the time span to render.
+ */
+typedef struct mii_mb_job_t {
+	mb_clocks_time_t 	ts;			// of the first sample
+	double 				ts_step;	// clocks per sample
+	uint32_t 			count, rate;
+	uint32_t 			event_count;
+	mb_ay3_event_t 		event[MB_AY3_EVENT_MAX];
+} mii_mb_job_t;
+
+DECLARE_FIFO(mii_mb_job_t, mii_mb_job_fifo, 8);
+DEFINE_PTR_FIFO(mii_mb_job_t, mii_mb_job_fifo);
 
 typedef struct mii_mb_t {
 	mii_t *				mii;
@@ -17,8 +40,119 @@ typedef struct mii_mb_t {
 	mii_audio_source_t	source;
 	uint64_t 			flush_cycle_count;
 	uint64_t			last_flush_cycle;
+	double				render_cycle;	// of the next sample to render
+	// render thread
+	struct mb_ay3_synth_t * synth;
+	pthread_t 			thread;
+	sem_t 				wake;
+	sem_t 				done;		// a job was released, if 'waiting'
+	volatile int 		quit, waiting;
+	mii_mb_job_fifo_t	jobs;
+	float				audio[MII_MB_JOB_MAX * 2];
 } mii_mb_t;
 
+static void
+_mii_mb_render(
+		mii_mb_t *mb,
+		const mii_mb_job_t *j)
+{
+	mb_ay3_synth_render(mb->synth, j->event, j->event_count,
+			j->ts, j->ts_step, mb->audio, j->count, j->rate);
+	for (uint i = 0; i < j->count; i++)
+		mii_audio_source_write(&mb->source, mb->audio + (i * 2));
+}
+
+static void *
+_mii_mb_render_thread(
+		void *param)
+{
+	mii_mb_t * mb = param;
+
+	do {
+		while (!mii_mb_job_fifo_isempty(&mb->jobs)) {
+			_mii_mb_render(mb, mii_mb_job_fifo_read_ptr(&mb->jobs));
+			// only release the job once it's done, see _mii_mb_wait()
+			mii_mb_job_fifo_read_offset(&mb->jobs, 1);
+			__sync_synchronize();
+			if (mb->waiting)
+				sem_post(&mb->done);
+		}
+		if (mb->quit)
+			break;
+		sem_wait(&mb->wake);
+	} while (1);
+	return NULL;
+}
+
+/* Block until the render thread has released some jobs, or all of them */
+static void
+_mii_mb_wait(
+		mii_mb_t *mb,
+		bool all)
+{
+	while (sem_trywait(&mb->done) == 0)	// stale posts
+		;
+	mb->waiting = 1;
+	__sync_synchronize();
+	while (all ? !mii_mb_job_fifo_isempty(&mb->jobs) :
+				mii_mb_job_fifo_isfull(&mb->jobs)) {
+		sem_post(&mb->wake);
+		sem_wait(&mb->done);
+	}
+	mb->waiting = 0;
+}
+
+/*
+ * Hand the AY3 events, and the samples due up to now, to the render thread.
+ * Without a driver (headless), or when capturing, render them here instead,
+ * so they are the same from run to run, and the sink's tap only ever runs
+ * on the emulation thread.
+ */
+static void
+_mii_mb_flush(
+		mii_mb_t *mb)
+{
+	mii_t * mii = mb->mii;
+	mii_audio_sink_t * sink = &mii->audio;
+	float clk = mii_audio_clk_per_sample(sink);
+	double due = (mii->cpu.total_cycle - mb->render_cycle) / clk;
+	bool here = !sink->drv || sink->tap;
+
+	// the cycles jumped, start again from here
+	if (due < 0 || due > MII_AUDIO_FREQ / 8) {
+		mb->render_cycle = mii->cpu.total_cycle;
+		due = 0;
+	}
+	// the render thread has to be done with the synth, or with a slot
+	if (here ? !mii_mb_job_fifo_isempty(&mb->jobs) :
+				mii_mb_job_fifo_isfull(&mb->jobs))
+		_mii_mb_wait(mb, here);
+	mii_mb_job_t * j = mii_mb_job_fifo_write_ptr(&mb->jobs);
+	j->event_count = mb_ay3_events(mb->mb, j->event, MB_AY3_EVENT_MAX);
+	j->count = due > MII_MB_JOB_MAX ? MII_MB_JOB_MAX : (uint32_t)due;
+	j->ts = mb->render_cycle * MB_CLOCKS_PHI0_CYCLE;
+	j->ts_step = clk * MB_CLOCKS_PHI0_CYCLE;
+	// follow the sink's rate control, see mii_audio_run()
+	j->rate = MII_AUDIO_FREQ / mii_audio_rate(sink);
+	mb->render_cycle += j->count * clk;
+	if (here) {
+		_mii_mb_render(mb, j);
+		return;
+	}
+	mii_mb_job_fifo_write_offset(&mb->jobs, 1);
+	sem_post(&mb->wake);
+}
+
+/* The VIAs and the AY3s are clocked by PHI0, ie, once per CPU cycle */
+static mb_clock_t
+_mii_mb_clock(
+		mii_t * mii)
+{
+	return (mb_clock_t) {
+		.ref_step = MB_CLOCKS_PHI0_CYCLE,
+		.ts = mii->cpu.total_cycle * MB_CLOCKS_PHI0_CYCLE,
+	};
+}
 
 static uint64_t
 _mii_mb_timer(
@@ -26,10 +160,7 @@ _mii_mb_timer(
 		void * param )
 {
 	mii_mb_t * mb = param;
-	mb_clock_t clock = {
-		.ref_step = MB_CLOCKS_PHI0_CYCLE,
-		.ts = mii->cpu.total_cycle * MB_CLOCKS_14MHZ_CYCLE,
-	};
+	mb_clock_t clock = _mii_mb_clock(mii);
 	uint64_t res = 1 + -mii_timer_get(mii, mb->timer);
 
 	uint32_t irq = mb_io_sync(mb->mb, &clock);
@@ -38,23 +169,7 @@ _mii_mb_timer(
 
 	if ((mii->cpu.total_cycle - mb->last_flush_cycle) >= mb->flush_cycle_count) {
 		mb->last_flush_cycle = mii->cpu.total_cycle;
-
-		static float audio[1224] = {};
-		memset(audio, 0, sizeof(audio));
-		int r = mb_ay3_render(mb->mb, audio, 1024, 2, MII_AUDIO_FREQ);
-		float min = 1e6, max = -1e6;
-		mii_audio_frame_t *f = &mb->source.fifo;
-		for (int i = 0; i < r * 2; i += 2) {
-			mii_audio_sample_t s = (audio[i] + audio[i + 1]);
-//			mii_audio_sample_t s = (audio[i]);
-			if (s < min)
-				min = s;
-			if (s > max)
-				max = s;
-			mii_audio_frame_write(f, s);
-		}
-		printf("MB Audio cycle %ld r=%d min %.4f max %.4f\n",
-				mb->flush_cycle_count, r, min, max);
+		_mii_mb_flush(mb);
 	}
 	return res;
 }
@@ -67,7 +182,12 @@ mii_mb_start(
 	printf("MB Start\n");
 	mb->init = 0;
 	mb->init_done = true;
-	mb->flush_cycle_count = 512 * mb->mii->audio.clk_per_sample;
+	mb->flush_cycle_count =
+			MII_MB_JOB_SAMPLES * mii_audio_clk_per_sample(&mb->mii->audio);
+	mb->render_cycle = mb->mii->cpu.total_cycle;
+	mb->source.state = MII_AUDIO_PLAYING;
+	// one PSG per channel
+	mb->source.channels = 2;
 	mii_audio_add_source(&mb->mii->audio, &mb->source);
 }
 
@@ -145,11 +265,21 @@ _mii_mb_init(
 	slot->drv_priv = mb;
 	mb->mii = mii;
 	mb->mb = mb_alloc();
-	mb_clock_t clock = {
-			.ref_step = 1,
-			.ts = mii->cpu.total_cycle,
-	};
+	mb_clock_t clock = _mii_mb_clock(mii);
 	mb_io_reset(mb->mb, &clock);
+	mb->synth = mb_ay3_synth_alloc();
+	sem_init(&mb->wake, 0, 0);
+	sem_init(&mb->done, 0, 0);
+	if (pthread_create(&mb->thread, NULL, _mii_mb_render_thread, mb)) {
+		perror(__func__);
+		sem_destroy(&mb->wake);
+		sem_destroy(&mb->done);
+		mb_ay3_synth_dispose(mb->synth);
+		free(mb->mb);
+		free(mb);
+		slot->drv_priv = NULL;
+		return -1;
+	}
 
 	char name[32];
 	snprintf(name, sizeof(name), "MB %d", slot->id+1);
@@ -172,13 +302,56 @@ _mii_mb_reset(
 {
 	mii_mb_t *mb = slot->drv_priv;
 	printf("%s\n", __func__);
-	mb_clock_t clock = {
-			.ref_step = 1,
-			.ts = mii->cpu.total_cycle,
-	};
+	mb_clock_t clock = _mii_mb_clock(mii);
 	mb_io_reset(mb->mb, &clock);
 }
 
+/* The sink is already gone, see mii_dispose(), so is our audio source */
+static void
+_mii_mb_dispose(
+		mii_t * mii,
+		struct mii_slot_t *slot )
+{
+	mii_mb_t *mb = slot->drv_priv;
+	if (!mb)
+		return;
+	mii_timer_set(mii, mb->timer, 0);
+	mb->quit = 1;
+	sem_post(&mb->wake);
+	pthread_join(mb->thread, NULL);
+	sem_destroy(&mb->wake);
+	sem_destroy(&mb->done);
+	mb_ay3_synth_dispose(mb->synth);
+	mb_dispose(mb->mb);
+	free(mb->mb);
+	free(mb);
+	slot->drv_priv = NULL;
+}
+
+static void
+_mii_mb_snapshot(
+		mii_t * mii,
+		struct mii_slot_t *slot,
+		struct mii_snap_io_t *io)
+{
+	mii_mb_t *mb = slot->drv_priv;
+	mii_snap_io_data(io, MII_SNAP_TAG('M','B','C','D'), &mb->init,
+			sizeof(mb->init));
+	mii_snap_io_data(io, MII_SNAP_TAG('M','B','C','Y'), &mb->flush_cycle_count,
+			sizeof(mb->flush_cycle_count));
+	mii_snap_io_data(io, MII_SNAP_TAG('M','B','L','F'), &mb->last_flush_cycle,
+			sizeof(mb->last_flush_cycle));
+	mii_snap_io_data(io, MII_SNAP_TAG('M','B','R','C'), &mb->render_cycle,
+			sizeof(mb->render_cycle));
+	mii_snap_io_data(io, MII_SNAP_TAG('M','B','S','T'), mb->mb,
+			mb_state_size());
+	if (io->save || io->error)
+		return;
+	// the synth is on the render thread, wait for it, then catch it up
+	_mii_mb_wait(mb, true);
+	mb_ay3_synth_restore(mb->synth, mb->mb);
+}
+
 static uint8_t
 _mii_mb_iospace_access(
 	mii_t * mii, struct mii_slot_t *slot,
@@ -195,8 +368,10 @@ static mii_slot_drv_t _driver = {
 	.desc = "Mockingboard",
 //	.enable_flag = MII_INIT_MOCKINGBOARD,
 	.init = _mii_mb_init,
+	.dispose = _mii_mb_dispose,
 	.reset = _mii_mb_reset,
 	.access = _mii_mb_iospace_access,
+	.snapshot = _mii_mb_snapshot,
 //	.probe = _mii_mb_probe,
 };
 MI_DRIVER_REGISTER(_driver);
@@ -17,9 +17,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "mii.h"
 #include "mii_bank.h"
+#include "mii_snapshot.h"
 
 /*
  * Coded against this information
@@ -315,12 +317,28 @@ _mii_mouse_access(
 	return 0;
 }
 
+static void
+_mii_mouse_snapshot(
+		mii_t * mii,
+		struct mii_slot_t *slot,
+		struct mii_snap_io_t *io)
+{
+	mii_card_mouse_t *c = slot->drv_priv;
+	mii_snap_io_data(io, MII_SNAP_TAG('M','S','C','D'), &c->mode,
+			offsetof(mii_card_mouse_t, last) + sizeof(c->last) -
+				offsetof(mii_card_mouse_t, mode));
+	// clamps are set by the firmware, so they go along with the card
+	mii_snap_io_data(io, MII_SNAP_TAG('M','S','E',' '), &mii->mouse,
+			sizeof(mii->mouse));
+}
+
 static mii_slot_drv_t _driver = {
 	.name = "mouse",
 	.desc = "Mouse card",
 	.init = _mii_mouse_init,
 	.dispose = _mii_mouse_dispose,
 	.access = _mii_mouse_access,
+	.snapshot = _mii_mouse_snapshot,
 };
 MI_DRIVER_REGISTER(_driver);
 
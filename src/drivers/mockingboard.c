@@ -62,7 +62,10 @@
 #define MB_VIA_IER_TIMER1			   0x40
 #define MB_VIA_IER_TIMER2			   0x20
 
-#define MB_AY_QUEUE_SIZE			   64
+#define MB_AY_QUEUE_SIZE			   (MB_AY3_EVENT_MAX / 2)
+/* in the queue, with the register + value, see _ay3_queue_event() */
+#define MB_AY_EVENT_WRITE			   0x80000000
+#define MB_AY_EVENT_RESET			   0x40000000
 
 #define MB_AY_REG_A_TONE_PERIOD_FINE   0x00
 #define MB_AY_REG_A_TONE_PERIOD_COARSE 0x01
@@ -137,21 +140,18 @@ typedef enum mb_via_timer_e {
  * To remove the need for IO ports, and to keep in spec with various
  * mockingboards, we'll implement a 8913.
  *
- * For performance, audio PCM data is generated in ay3_render()
+ * For performance, audio PCM data is generated in mb_ay3_synth_render()
  *
- * Commands from the 6522 are queued inside ay3_update(), but AY3
- * tone/noise/envelope generation happens in ay3_render().  This ensures that
- * audio data is not generated per emulated CPU cycle.  This is possible because
- * the AY3 effectively has no output besides the speaker.
- *
- * ay3_render() renders audio from the various tone and noise channels as their
- * state is set by the queued commands referenced above.
+ * Commands from the 6522 are queued, with their timestamp, inside ay3_update(),
+ * but AY3 tone/noise/envelope generation happens in mb_ay3_synth_render(), on
+ * a separate copy of the mixer state (mb_ay3_synth_t). This ensures that
+ * audio data is not generated per emulated CPU cycle, nor even on the thread
+ * that runs the emulation.  This is possible because the AY3 effectively has
+ * no output besides the speaker.
  *
  * Since audio commands shouldn't be that frequent, we can keep the queue small
- * as long as ay3_render() is called frequently enough (i.e. even if called once
- * per second, we shouldn't be receiving many commands from the 6522 in that
- * period of time... of course we should be calling ay3_update at something like
- * 15-60fps to avoid latency)
+ * as long as mb_ay3_events() is called frequently enough (mii_mb.c does it
+ * every few milliseconds of emulated time)
  */
 typedef struct mb_ay_t {
 	/* register reflection */
@@ -162,13 +162,12 @@ typedef struct mb_ay_t {
 	uint8_t		enable;
 	uint8_t		envelope_shape;
 
-	/* rendering event queue built by application writes to the AY3 for this
-	   window - consumed by _ay3_render(...).  times are offsets from
-	   the render_slice_start_ts.
+	/* rendering event queue built by application writes to the AY3 - consumed
+	   by mb_ay3_events(...).  times are the clock->ts of the write.
 
 	   queue items are combination of register + value */
 	uint32_t	queue[MB_AY_QUEUE_SIZE];
-	mb_clocks_t queue_time[MB_AY_QUEUE_SIZE];
+	mb_clocks_time_t queue_time[MB_AY_QUEUE_SIZE];
 	uint32_t	queue_tail;
 
 	/* reference time step per tick (set at mega2 reference step)  whicih should
@@ -352,6 +351,7 @@ _ay3_envelope_gen( //
 	float	 sample_dt)
 {
 	uint	level = 0;
+	uint	step;
 	float	dt_envelope;
 	uint8_t cycle;
 
@@ -359,10 +359,19 @@ _ay3_envelope_gen( //
 		  MB_AY_AMP_VARIABLE_MODE_FLAG)) {
 		return level;
 	}
+	/* not set up yet */
+	if (psg->mixer_envelope_period < FLT_EPSILON) {
+		return level;
+	}
 
 	cycle = psg->mixer_envelope_control >> 4;
 
 	dt_envelope = psg->mixer_envelope_time;
+	/* the time can be at the end of the period if the period was shortened,
+	   keep the level within the amplitude table */
+	step = (uint)(dt_envelope * 16 / psg->mixer_envelope_period);
+	if (step > 15)
+		step = 15;
 
 	//  this is rather brute force - there's probably a better way to do this,
 	//  like evaluating each state and look at the cycle count within the if block
@@ -386,20 +395,16 @@ _ay3_envelope_gen( //
 				if (psg->mixer_envelope_control & MB_AY_AMP_ENVELOPE_ATTACK) {
 					if (psg->mixer_envelope_control &
 						MB_AY_AMP_ENVELOPE_ALTERNATE) {
-						level = 15 - (uint)(dt_envelope * 16 /
-											psg->mixer_envelope_period);
+						level = 15 - step;
 					} else {
-						level =
-							(uint)(dt_envelope * 16 / psg->mixer_envelope_period);
+						level = step;
 					}
 				} else {
 					if (psg->mixer_envelope_control &
 						MB_AY_AMP_ENVELOPE_ALTERNATE) {
-						level =
-							(uint)(dt_envelope * 16 / psg->mixer_envelope_period);
+						level = step;
 					} else {
-						level = 15 - (uint)(dt_envelope * 16 /
-											psg->mixer_envelope_period);
+						level = 15 - step;
 					}
 				}
 			}
@@ -411,9 +416,9 @@ _ay3_envelope_gen( //
 		//  hold doesn't matter here (see the state switch at end of period logic
 		//  above, where cycle will always be 1)
 		if (psg->mixer_envelope_control & MB_AY_AMP_ENVELOPE_ATTACK) {
-			level = (uint)(dt_envelope * 16 / psg->mixer_envelope_period);
+			level = step;
 		} else {
-			level = 15 - (uint)(dt_envelope * 16 / psg->mixer_envelope_period);
+			level = 15 - step;
 		}
 	}
 
@@ -435,26 +440,6 @@ _ay3_envelope_gen( //
 	return level;
 }
 
-static float
-_ay3_amp_modify( //
-	mb_ay_t *psg,
-	uint	 channel_id,
-	float	 sample_in,
-	uint	 envelope,
-	float	 sample_dt)
-{
-	float sample_out;
-	if (psg->mixer_amp[channel_id] & MB_AY_AMP_VARIABLE_MODE_FLAG) {
-		sample_out = sample_in * s_ay3_8913_ampl_factor_westcott[envelope];
-	} else {
-		sample_out =
-			sample_in * s_ay3_8913_ampl_factor_westcott[psg->mixer_amp[channel_id] &
-														MB_AY_AMP_FIXED_LEVEL_MASK];
-	}
-
-	return sample_out;
-}
-
 static void
 _ay3_tone_enable( //
 	mb_ay_t *psg,
@@ -500,6 +485,10 @@ _ay3_mix_event( //
 	uint8_t event_reg = (uint8_t)((event >> 8) & 0xff);
 	uint8_t event_value = (uint8_t)(event & 0xff);
 
+	if (event & MB_AY_EVENT_RESET) {
+		_ay3_reset(psg, 0);
+		return;
+	}
 	switch (event_reg) {
 		case MB_AY_REG_A_TONE_PERIOD_COARSE:
 			_ay3_tone_setup(psg, 0, event_value, 1);
@@ -551,75 +540,59 @@ _ay3_queue_event( //
 	mb_ay_t *psg,
 	uint8_t	 value)
 {
-	return (0x80000000 | ((uint16_t)psg->reg_latch << 8) | value);
+	return (MB_AY_EVENT_WRITE | ((uint16_t)psg->reg_latch << 8) | value);
 }
 
-uint
-_ay3_render( //
-	mb_ay_t	   *psg,
-	mb_clocks_t duration,
-	uint		channel,
-	float	   *out,
-	uint		out_limit,
-	uint		samples_per_frame,
-	uint		samples_per_second)
+/* Samples are generated in blocks of this size, so the generators run as
+   tight loops on each channel, and the mix can be vectorized */
+#define MB_AY_RENDER_BLOCK 64
+
+/*	Renders 'count' samples, with no register changes, to every 'stride'
+	float of 'out'.  The generators are not independent per sample (they all
+	accumulate time), but they are between each other, so each one runs over
+	the whole block in turn */
+static void
+_ay3_render_block( //
+	mb_ay_t *psg,
+	float	*out,
+	uint	 count,
+	uint	 stride,
+	float	 sample_dt)
 {
-	float		render_window_secs = mb_ns_step_from_clocks(duration) * 1e-9f;
-	float		sample_dt = 1.0f / samples_per_second;
-	uint		sample_count = 0;
-	mb_clocks_t render_dt = mb_clocks_step_from_ns(sample_dt * 1e9f);
-	mb_clocks_t render_ts = 0;
-	float		render_t;
-	uint32_t	queue_index = 0;
-	float		sample[3];
-	float		current;
-	float		acc;
-	float		noise;
-	uint		envelope;
-
-printf("ay3_render: duration=%d, channel=%d, out_limit=%d, samples_per_frame=%d, samples_per_second=%d\n", duration, channel, out_limit, samples_per_frame, samples_per_second);
-printf("render_window_secs=%f, sample_dt=%f, render_dt=%d\n", render_window_secs, sample_dt, render_dt);
-	//  TODO: we can just persist tone_period + half_tone_period  instead of
-	//        frequency and trim back and forth calculations in _ay3_tone_setup
-	for (render_t = 0.0f; render_t < render_window_secs && sample_count < out_limit;
-		 render_t += sample_dt, out += samples_per_frame) {
-		if (queue_index < psg->queue_tail) {
-			while (psg->queue_time[queue_index] <= render_ts &&
-				   queue_index < psg->queue_tail) {
-				uint32_t queue_event = psg->queue[queue_index++];
-				_ay3_mix_event(psg, queue_event);
+	uint8_t noise[MB_AY_RENDER_BLOCK];
+	uint8_t envelope[MB_AY_RENDER_BLOCK];
+	float	tone[3][MB_AY_RENDER_BLOCK];
+	float	amp[3][MB_AY_RENDER_BLOCK];
+
+	while (count) {
+		uint n = count < MB_AY_RENDER_BLOCK ? count : MB_AY_RENDER_BLOCK;
+
+		for (uint i = 0; i < n; i++)
+			noise[i] = _ay3_noise_gen(psg, sample_dt);
+		for (uint ch = 0; ch < 3; ch++)
+			for (uint i = 0; i < n; i++)
+				tone[ch][i] = _ay3_tone_render(psg, ch, noise[i], sample_dt);
+		for (uint i = 0; i < n; i++)
+			envelope[i] = _ay3_envelope_gen(psg, sample_dt);
+		for (uint ch = 0; ch < 3; ch++) {
+			if (psg->mixer_amp[ch] & MB_AY_AMP_VARIABLE_MODE_FLAG) {
+				for (uint i = 0; i < n; i++)
+					amp[ch][i] = s_ay3_8913_ampl_factor_westcott[envelope[i]];
+			} else {
+				float fixed = s_ay3_8913_ampl_factor_westcott[
+						psg->mixer_amp[ch] & MB_AY_AMP_FIXED_LEVEL_MASK];
+				for (uint i = 0; i < n; i++)
+					amp[ch][i] = fixed;
 			}
 		}
-		noise = _ay3_noise_gen(psg, sample_dt);
-		sample[0] = _ay3_tone_render(psg, 0, noise, sample_dt);
-		sample[1] = _ay3_tone_render(psg, 1, noise, sample_dt);
-		sample[2] = _ay3_tone_render(psg, 2, noise, sample_dt);
-		envelope = _ay3_envelope_gen(psg, sample_dt);
-		sample[0] = _ay3_amp_modify(psg, 0, sample[0], envelope, sample_dt);
-		sample[1] = _ay3_amp_modify(psg, 1, sample[1], envelope, sample_dt);
-		sample[2] = _ay3_amp_modify(psg, 2, sample[2], envelope, sample_dt);
-		current = out[channel];
-		acc = (sample[0] + sample[1] + sample[2]) * 0.166667f;
-		current = out[channel] + acc;
-		if (current > 0.75f)
-			current = 0.75f;
-		else if (current < -0.75f)
-			current = -0.75;
-		out[channel] = current;
-
-		render_ts += render_dt;
-		sample_count++;
-	}
-
-	//  consume remaining events to prevent data loss if necessary
-	while (queue_index < psg->queue_tail) {
-		uint32_t queue_event = psg->queue[queue_index++];
-		_ay3_mix_event(psg, queue_event);
+		for (uint i = 0; i < n; i++) {
+			float acc = (tone[0][i] * amp[0][i] + tone[1][i] * amp[1][i] +
+						 tone[2][i] * amp[2][i]) * 0.166667f;
+			out[i * stride] = acc > 0.75f ? 0.75f : acc < -0.75f ? -0.75f : acc;
+		}
+		out += n * stride;
+		count -= n;
 	}
-
-	//  TODO: consume events until end of time window
-	psg->queue_tail = 0;
-	return sample_count;
 }
 
 static uint8_t
@@ -723,27 +696,49 @@ _ay3_set( //
 }
 
 /*
-	Queues commands for audio rendering via _ay3_render(...).  Fortunately
-	the AY3 here doesn't deal with port output - just taking commands.
-	For debugging and possible register reads, we keep a record of current
-	register values as well.
+	Queues commands for audio rendering via mb_ay3_synth_render(...).
+	Fortunately the AY3 here doesn't deal with port output - just taking
+	commands. For debugging and possible register reads, we keep a record of
+	current register values as well.
  */
+static void
+_ay3_queue( //
+	mb_ay_t			*psg,
+	uint32_t		 queue_event,
+	mb_clocks_time_t ts)
+{
+	if (psg->queue_tail < MB_AY_QUEUE_SIZE) {
+		psg->queue[psg->queue_tail] = queue_event;
+		psg->queue_time[psg->queue_tail] = ts;
+		psg->queue_tail++;
+	} else {
+		MB_WARN("ay3_update: lost synth event (%08x)", queue_event);
+	}
+}
+
 static void
 _ay3_update( //
-	mb_ay_t	   *psg,
-	uint8_t	   *bus,
-	uint8_t	   *bus_control,
-	mb_clocks_t render_slice_dt)
+	mb_ay_t			*psg,
+	uint8_t			*bus,
+	uint8_t			*bus_control,
+	mb_clocks_time_t ts)
 {
-	uint8_t	 bc1 = *bus_control & 0x1;
-	uint8_t	 bdir = *bus_control & 0x2;
 	uint8_t	 reset_b = *bus_control & 0x4;
 	uint32_t queue_event = 0;
 	if (*bus_control == psg->bus_control) {
 		return;
 	}
 	if (!reset_b) {
+		/* the queued events still have to be rendered, keep them */
+		mb_ay_t queued = *psg;
 		_ay3_reset(psg, 0);
+		memcpy(psg->queue, queued.queue, sizeof(psg->queue));
+		memcpy(psg->queue_time, queued.queue_time, sizeof(psg->queue_time));
+		psg->queue_tail = queued.queue_tail;
+		/* the reset can be held for a while, only queue it once */
+		if (!psg->queue_tail ||
+				psg->queue[psg->queue_tail - 1] != MB_AY_EVENT_RESET)
+			_ay3_queue(psg, MB_AY_EVENT_RESET, ts);
 		return;
 	}
 
@@ -769,15 +764,8 @@ _ay3_update( //
 			break;
 	}
 
-	if (queue_event) {
-		if (psg->queue_tail < MB_AY_QUEUE_SIZE) {
-			psg->queue[psg->queue_tail] = queue_event;
-			psg->queue_time[psg->queue_tail] = render_slice_dt;
-			psg->queue_tail++;
-		} else {
-			MB_WARN("ay3_update: lost synth event (%08x)", queue_event);
-		}
-	}
+	if (queue_event)
+		_ay3_queue(psg, queue_event, ts);
 
 	psg->bus_control = *bus_control;
 }
@@ -864,10 +852,14 @@ typedef struct mb_t {
 	uint8_t		via_ay3_bus_control[2];
 	/* timestamp within current render window */
 	mb_clocks_t sync_time_budget;
-	mb_clocks_t ay3_render_slice_duration;
 	mb_clock_t	last_clocks;
 } mb_t;
 
+/* The AY3s as the synthesizer sees them, on the audio thread */
+typedef struct mb_ay3_synth_t {
+	mb_ay_t		ay3[2];
+} mb_ay3_synth_t;
+
 static inline mb_via_t *
 _mmio_via_addr_parse( //
 	mb_t   *context,
@@ -969,12 +961,14 @@ mb_io_reset( //
 	memset(&board->via[1], 0, sizeof(mb_via_t));
 	_ay3_reset(&board->ay3[0], clock->ref_step);
 	_ay3_reset(&board->ay3[1], clock->ref_step);
+	/* and silence the synthesizer */
+	_ay3_queue(&board->ay3[0], MB_AY_EVENT_RESET, clock->ts);
+	_ay3_queue(&board->ay3[1], MB_AY_EVENT_RESET, clock->ts);
 	board->last_clocks = *clock;
 	board->via_ay3_bus[0] = 0x00;
 	board->via_ay3_bus[1] = 0x00;
 	board->via_ay3_bus_control[0] = 0x00;
 	board->via_ay3_bus_control[1] = 0x00;
-	board->ay3_render_slice_duration = 0;
 	board->sync_time_budget = 0;
 }
 
@@ -989,20 +983,21 @@ mb_io_sync( //
 
 //printf("mb_io_sync: dt_clocks=%d, sync_time_budget=%d\n", dt_clocks, board->sync_time_budget);
 	while (board->sync_time_budget > clock->ref_step) {
+		/* time of this step, to timestamp the AY3 writes */
+		mb_clocks_time_t ts = clock->ts - board->sync_time_budget;
 		_via_update_state(
 			&board->via[0], &board->via_ay3_bus[0], &board->via_ay3_bus_control[0]);
 		_ay3_update(&board->ay3[0],
 					&board->via_ay3_bus[0],
 					&board->via_ay3_bus_control[0],
-					board->ay3_render_slice_duration);
+					ts);
 		_via_update_state(
 			&board->via[1], &board->via_ay3_bus[1], &board->via_ay3_bus_control[1]);
 		_ay3_update(&board->ay3[1],
 					&board->via_ay3_bus[1],
 					&board->via_ay3_bus_control[1],
-					board->ay3_render_slice_duration);
+					ts);
 		board->sync_time_budget -= clock->ref_step;
-		board->ay3_render_slice_duration += clock->ref_step;
 	}
 	board->last_clocks = *clock;
 
@@ -1182,39 +1177,103 @@ mb_dispose( //
 {
 }
 
+size_t
+mb_state_size()
+{
+	return sizeof(mb_t);
+}
+
 uint
-mb_ay3_render( //
-	struct mb_t * mb,
-	float		*samples_out,
-	uint		 sample_limit,
-	uint		 samples_per_frame,
-	uint		 samples_per_second)
+mb_ay3_events( //
+	struct mb_t	   *mb,
+	mb_ay3_event_t *events,
+	uint			max)
 {
-	uint  lcount = _ay3_render( //
-		 &mb->ay3[0],
-		 mb->ay3_render_slice_duration,
-		 0,
-		 samples_out,
-		 sample_limit,
-		 samples_per_frame,
-		 samples_per_second);
-	uint  rcount = _ay3_render( //
-		 &mb->ay3[1],
-		 mb->ay3_render_slice_duration,
-		 1,
-		 samples_out,
-		 sample_limit,
-		 samples_per_frame,
-		 samples_per_second);
-	if (lcount < rcount) {
-		for (; lcount < rcount; ++lcount) {
-			samples_out[lcount << 1] = 0.0f;
+	uint count = 0;
+	for (uint chip = 0; chip < 2; chip++) {
+		mb_ay_t *psg = &mb->ay3[chip];
+		for (uint i = 0; i < psg->queue_tail && count < max; i++, count++) {
+			events[count].ts = psg->queue_time[i];
+			events[count].event = psg->queue[i];
+			events[count].chip = chip;
 		}
-	} else {
-		for (; rcount < lcount; ++rcount) {
-			samples_out[(rcount << 1) + 1] = 0.0f;
+		psg->queue_tail = 0;
+	}
+	return count;
+}
+
+struct mb_ay3_synth_t *
+mb_ay3_synth_alloc()
+{
+	mb_ay3_synth_t *synth = calloc(1, sizeof(*synth));
+	for (uint chip = 0; chip < 2; chip++)
+		_ay3_reset(&synth->ay3[chip], MB_CLOCKS_PHI0_CYCLE);
+	return synth;
+}
+
+void
+mb_ay3_synth_dispose( //
+	struct mb_ay3_synth_t *synth)
+{
+	free(synth);
+}
+
+void
+mb_ay3_synth_restore( //
+	struct mb_ay3_synth_t *synth,
+	struct mb_t			  *mb)
+{
+	for (uint chip = 0; chip < 2; chip++) {
+		mb_ay_t *psg = &mb->ay3[chip];
+		mb_ay_t *out = &synth->ay3[chip];
+		uint8_t	 latch = psg->reg_latch;
+
+		_ay3_reset(out, MB_CLOCKS_PHI0_CYCLE);
+		for (uint reg = 0; reg <= MB_AY_REG_ENVELOPE_SHAPE; reg++) {
+			psg->reg_latch = reg;
+			_ay3_mix_event(out, _ay3_queue_event(psg, _ay3_get(psg)));
+		}
+		psg->reg_latch = latch;
+		psg->queue_tail = 0;
+	}
+}
+
+void
+mb_ay3_synth_render( //
+	struct mb_ay3_synth_t *synth,
+	const mb_ay3_event_t  *events,
+	uint				   event_count,
+	mb_clocks_time_t	   ts,
+	double				   ts_step,
+	float				  *samples_out,
+	uint				   sample_count,
+	uint				   samples_per_second)
+{
+	float sample_dt = 1.0f / samples_per_second;
+
+	for (uint chip = 0; chip < 2; chip++) {
+		mb_ay_t *psg = &synth->ay3[chip];
+		uint	 pos = 0;
+		for (uint i = 0; i < event_count; i++) {
+			if (events[i].chip != chip)
+				continue;
+			/* an event applies from the first sample at, or after, it */
+			uint at = 0;
+			if (events[i].ts > ts) {
+				double when = (events[i].ts - ts) / ts_step;
+				at = when >= sample_count ? sample_count : (uint)when;
+				if (at < when)
+					at++;
+			}
+			if (at > pos) {
+				_ay3_render_block(psg, samples_out + (pos * 2) + chip,
+						at - pos, 2, sample_dt);
+				pos = at;
+			}
+			_ay3_mix_event(psg, events[i].event);
 		}
+		if (pos < sample_count)
+			_ay3_render_block(psg, samples_out + (pos * 2) + chip,
+					sample_count - pos, 2, sample_dt);
 	}
-	mb->ay3_render_slice_duration = 0;
-	return rcount;
 }
@@ -10,6 +10,7 @@
  */
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
 
 typedef uint64_t mb_clocks_time_t;
 typedef uint32_t mb_clocks_t;
@@ -26,6 +27,17 @@ typedef struct mb_clock_t {
 } mb_clock_t;
 
 struct mb_t;
+struct mb_ay3_synth_t;
+
+/* Max number of AY3 events mb_ay3_events() can return */
+#define MB_AY3_EVENT_MAX		   256
+
+/* An AY3 register write (or reset), timestamped by mb_io_sync() */
+typedef struct mb_ay3_event_t {
+	mb_clocks_time_t ts;
+	uint32_t		 event;
+	uint8_t			 chip;
+} mb_ay3_event_t;
 
 /** A bit confusing and created to avoid floating point math whenever possible
  *  (whether this was a good choice given modern architectures... ?)
@@ -110,6 +122,9 @@ mb_alloc();
 void
 mb_dispose( //
 	struct mb_t * mb);
+/* mb_t is plain data, this is its size, for snapshots */
+size_t
+mb_state_size();
 void
 mb_io_read( //
 	struct mb_t *board,
@@ -129,13 +144,40 @@ mb_io_reset( //
 	struct mb_t *board,
 	mb_clock_t	*clock);
 
+/* Moves the AY3 events queued since the last call to 'events', returns how
+   many there were. These are in order for each chip, not between chips */
 uint
-mb_ay3_render( //
-	struct mb_t * mb,
-	float		*samples_out,
-	uint		 sample_limit,
-	uint		 samples_per_frame,
-	uint		 samples_per_second);
+mb_ay3_events( //
+	struct mb_t	   *mb,
+	mb_ay3_event_t *events,
+	uint			max);
+
+/* The synthesizer only sees the AY3 events, so it can run on another thread */
+struct mb_ay3_synth_t *
+mb_ay3_synth_alloc();
+void
+mb_ay3_synth_dispose( //
+	struct mb_ay3_synth_t *synth);
+/* Resets the synthesizer, and replays the AY3 registers of 'mb' into it;
+   for when 'mb' was restored from a snapshot. The events still queued in
+   'mb' are dropped, the registers already reflect them */
+void
+mb_ay3_synth_restore( //
+	struct mb_ay3_synth_t *synth,
+	struct mb_t			  *mb);
+/* Renders 'sample_count' stereo frames (chip 0 left, chip 1 right), the first
+   one at time 'ts', then one every 'ts_step' clocks; the events are applied
+   at their own time */
+void
+mb_ay3_synth_render( //
+	struct mb_ay3_synth_t *synth,
+	const mb_ay3_event_t  *events,
+	uint				   event_count,
+	mb_clocks_time_t	   ts,
+	double				   ts_step,
+	float				  *samples_out,
+	uint				   sample_count,
+	uint				   samples_per_second);
 
 #ifdef __cplusplus
 }
@@ -16,6 +16,8 @@
 #include "mii_video.h"
 #include "mii_sw.h"
 #include "mii_65c02.h"
+#include "mii_rewind.h"
+#include "mii_capture.h"
 #include "minipt.h"
 
 #if MII_65C02_DIRECT_ACCESS
@@ -24,6 +26,10 @@ _mii_cpu_direct_access_cb(
 		struct mii_cpu_t *cpu,
 		mii_cpu_state_t   access );
 #endif
+static uint64_t
+_mii_run_budget_cb(
+		mii_t *mii,
+		void *param);
 
 mii_slot_drv_t * mii_slot_drv_list = NULL;
 
@@ -190,6 +196,76 @@ mii_sw(
 	return mii_bank_peek(&mii->bank[MII_BANK_SW], sw);
 }
 
+/*
+ * Return the host pointer to 'page' in bank bank_index, or NULL if that
+ * page can't be accessed directly.
+ */
+static uint8_t *
+_mii_page_fast_ptr(
+		mii_t *mii,
+		uint8_t bank_index,
+		uint8_t page,
+		bool write)
+{
+	mii_bank_t * b = &mii->bank[bank_index];
+	if (!b->mem || (write && b->ro))
+		return NULL;
+	uint8_t page_index = page - (b->base >> 8);
+	if (b->access && b->access[page_index].cb)
+		return NULL;
+	return b->mem + b->mem_offset + (page << 8) - b->base;
+}
+
+static uint8_t *
+_mii_page_fast_dirty(
+		mii_t *mii,
+		uint8_t bank_index,
+		uint8_t page)
+{
+	mii_bank_t * b = &mii->bank[bank_index];
+	if (!b->dirty)
+		return &mii->mem_fast.dirty_none;
+	return b->dirty + ((b->mem_offset + (page << 8) - b->base) >> 8);
+}
+
+/*
+ * Rebuild the fast page pointers for pages whose bank changed, or all of
+ * them if a bank memory was remapped (ramworks, IIc ROM bank), or if
+ * mem_fast.rebuild was set
+ */
+static void
+_mii_page_fast_update(
+		mii_t *mii,
+		const uint8_t old[256])
+{
+	bool all = mii->mem_fast.rebuild;
+	mii->mem_fast.rebuild = 0;
+	for (int i = 0; i < MII_BANK_COUNT; i++) {
+		if (mii->mem_fast.bank_mem[i] != mii->bank[i].mem) {
+			mii->mem_fast.bank_mem[i] = mii->bank[i].mem;
+			all = true;
+		}
+	}
+	for (int i = 0; i < 256; i++) {
+		if (!all && mii->mem[i].both == old[i])
+			continue;
+		mii->mem_fast.read[i] = _mii_page_fast_ptr(mii,
+									mii->mem[i].read, i, false);
+		mii->mem_fast.write[i] = _mii_page_fast_ptr(mii,
+									mii->mem[i].write, i, true);
+		mii->mem_fast.dirty[i] = _mii_page_fast_dirty(mii,
+									mii->mem[i].write, i);
+	}
+	// soft switches, and $cfff (deselect card roms) are always 'slow'
+	mii->mem_fast.read[0xc0] = mii->mem_fast.write[0xc0] = NULL;
+	mii->mem_fast.read[0xcf] = mii->mem_fast.write[0xcf] = NULL;
+	// writes to text/lores and hires pages need mii_access_video()
+	for (int i = 0x04; i <= 0x0b; i++)
+		mii->mem_fast.write[i] = NULL;
+	for (int i = 0x20; i <= 0x5f; i++)
+		mii->mem_fast.write[i] = NULL;
+}
+
 static void
 mii_page_table_update(
 		mii_t *mii)
@@ -197,6 +273,9 @@ mii_page_table_update(
 	if (likely(!mii->mem_dirty))
 		return;
 	mii->mem_dirty = 0;
+	uint8_t old[256];
+	for (int i = 0; i < 256; i++)
+		old[i] = mii->mem[i].both;
 	uint32_t sw = mii->sw_state;
 	bool altzp 		= SWW_GETSTATE(sw, SWALTPZ);
 	bool page2 		= SWW_GETSTATE(sw, SWPAGE2);
@@ -264,9 +343,10 @@ mii_page_table_update(
 			(altzp ? MII_BANK_AUX_BSR : MII_BANK_BSR) + bsrpage2 :
 					MII_BANK_ROM,
 				0xd0, 0xdf);
+	_mii_page_fast_update(mii, old);
 }
 
-static void
+void
 mii_bank_update_ramworks(
 		mii_t *mii,
 		uint8_t bank)
@@ -276,6 +356,8 @@ mii_bank_update_ramworks(
 		bank = 0;
 	if (!mii->ramworks.bank[bank]) {
 		mii->ramworks.bank[bank] = malloc(0x10000);
+		mii->ramworks.dirty[bank] = malloc(256);
+		memset(mii->ramworks.dirty[bank], 1, 256);
 		int c = 0, a = 0;
 		for (int i = 0; i < 128; i++ ) {
 			if (mii->ramworks.bank[i])
@@ -290,6 +372,11 @@ mii_bank_update_ramworks(
 	mii->bank[MII_BANK_AUX].mem = mii->ramworks.bank[bank];
 	mii->bank[MII_BANK_AUX_BSR].mem = mii->ramworks.bank[bank];
 	mii->bank[MII_BANK_AUX_BSR_P2].mem = mii->ramworks.bank[bank];
+	mii->bank[MII_BANK_AUX_BASE].dirty = mii->ramworks.dirty[0];
+	mii->bank[MII_BANK_AUX].dirty = mii->ramworks.dirty[bank];
+	mii->bank[MII_BANK_AUX_BSR].dirty = mii->ramworks.dirty[bank];
+	mii->bank[MII_BANK_AUX_BSR_P2].dirty = mii->ramworks.dirty[bank];
+	mii->mem_dirty = 1;	// refresh the fast page pointers
 }
 
 void
@@ -471,6 +558,7 @@ mii_access_soft_switches(
 					printf("BANKING IIC FIRST ROM\n");
 					mii->bank[MII_BANK_ROM].mem = (uint8_t*)mii->rom->rom;
 				}
+				mii->mem_dirty = 1;
 				return res;
 				break;
 		}
@@ -673,6 +761,7 @@ mii_init(
 	memset(mii, 0, sizeof(*mii));
 	mii->speed = MII_SPEED_NTSC;
 	mii->timer.map = 0;
+	mii->timer.next = UINT64_MAX;
 
 	for (int i = 0; i < MII_BANK_COUNT; i++)
 		mii->bank[i] = _mii_banks_init[i];
@@ -683,6 +772,12 @@ mii_init(
 	mii->bank[MII_BANK_MAIN].mem = mem;
 	mii->bank[MII_BANK_BSR].mem = mem;
 	mii->bank[MII_BANK_BSR_P2].mem = mem;
+	// the main bank owns it, see mii_bank_dispose()
+	uint8_t *dirty = malloc(256);
+	memset(dirty, 1, 256);
+	mii->bank[MII_BANK_MAIN].dirty = dirty;
+	mii->bank[MII_BANK_BSR].dirty = dirty;
+	mii->bank[MII_BANK_BSR_P2].dirty = dirty;
 	mii->ramworks.avail = 0;
 	mii_bank_update_ramworks(mii, 0);
 
@@ -702,6 +797,8 @@ mii_init(
 #endif
 	for (int i = 0; i < 7; i++)
 		mii->slot[i].id = i;
+	mii->run.timer_id = mii_timer_register(mii,
+			_mii_run_budget_cb, NULL, 0, "run budget");
 	mii_bank_install_access_cb(&mii->bank[MII_BANK_ROM],
 			_mii_select_c3introm, mii, 0xc3, 0xc3);
 }
@@ -732,6 +829,9 @@ mii_prepare(
 		}
 		drv = drv->next;
 	}
+	// drivers might have installed bank access callbacks
+	mii->mem_fast.rebuild = 1;
+	mii->mem_dirty = 1;
 	mii_audio_start(&mii->audio);
 }
 
@@ -739,6 +839,8 @@ void
 mii_dispose(
 		mii_t *mii )
 {
+	// stop the audio driver first, slot drivers free their sources
+	mii_audio_dispose(&mii->audio);
 	for (int i = 0; i < 7; i++) {
 		if (mii->slot[i].drv && mii->slot[i].drv->dispose)
 			mii->slot[i].drv->dispose(mii, &mii->slot[i]);
@@ -748,11 +850,15 @@ mii_dispose(
 	for (int i = 0; i < 128; i++ ) {
 		if (mii->ramworks.bank[i]) {
 			free(mii->ramworks.bank[i]);
+			free(mii->ramworks.dirty[i]);
 			mii->ramworks.bank[i] = NULL;
+			mii->ramworks.dirty[i] = NULL;
 		}
 	}
+	mii_rewind_dispose(mii);
+	mii_capture_stop(mii);
+	mii_video_dispose(mii);
 	mii_speaker_dispose(&mii->speaker);
-	mii_audio_dispose(&mii->audio);
 	mii_dd_system_dispose(&mii->dd);
 	mii->state = MII_INIT;
 }
@@ -807,14 +913,31 @@ mii_mem_access(
 {
 	if (!do_sw && addr >= 0xc000 && addr <= 0xc0ff && addr != 0xcfff)
 		return;
+	// fast page pointers are rebuilt with the page table
+	if (unlikely(mii->mem_dirty))
+		mii_page_table_update(mii);
+	uint8_t page = addr >> 8;
+	if (wr) {
+		uint8_t * p = mii->mem_fast.write[page];
+		if (likely(p)) {
+			p[addr & 0xff] = *d;
+			*mii->mem_fast.dirty[page] = 1;
+			return;
+		}
+	} else {
+		uint8_t * p = mii->mem_fast.read[page];
+		if (likely(p)) {
+			*d = p[addr & 0xff];
+			return;
+		}
+	}
 	uint8_t done =
 		_mii_deselect_cXrom(mii, addr, d, wr) ||
 		mii_access_keyboard(mii, addr, d, wr) ||
 		mii_access_video(mii, addr, d, wr) ||
 		mii_access_soft_switches(mii, addr, d, wr);
 	if (done)
-		return;
-	uint8_t page = addr >> 8;
+		goto slow_done;
 	if (wr) {
 		uint8_t m = mii->mem[page].write;
 		mii_bank_t * b = &mii->bank[m];
@@ -831,6 +954,10 @@ mii_mem_access(
 		mii_bank_t * b = &mii->bank[m];
 		*d = mii_bank_peek(b, addr);
 	}
+slow_done:
+	// the CPU might be fetching operands from mem_fast.read, keep it current
+	if (unlikely(mii->mem_dirty && mii->cpu.fetch))
+		mii_page_table_update(mii);
 }
 
 static void
@@ -875,6 +1002,102 @@ mii_register_trap(
 	return 0xff;
 }
 
+/*
+ * Timer heap helpers. The heap is ordered by deadline, each timer knows its
+ * own index in the heap, so they can be moved/removed without a search.
+ */
+#define _TD(_mii, _hi) (_mii)->timer.timers[(_mii)->timer.heap[_hi]].deadline
+
+/* timers due on the same cycle fire in timer id order, as they always did */
+static inline bool
+_mii_timer_before(
+		mii_t *mii,
+		int a,
+		int b)
+{
+	return _TD(mii, a) < _TD(mii, b) ||
+			(_TD(mii, a) == _TD(mii, b) && mii->timer.heap[a] < mii->timer.heap[b]);
+}
+
+static void
+_mii_timer_heap_swap(
+		mii_t *mii,
+		int a,
+		int b)
+{
+	uint8_t ta = mii->timer.heap[a], tb = mii->timer.heap[b];
+	mii->timer.heap[a] = tb;
+	mii->timer.heap[b] = ta;
+	mii->timer.timers[tb].index = a;
+	mii->timer.timers[ta].index = b;
+}
+
+static void
+_mii_timer_heap_fix(
+		mii_t *mii,
+		int i)
+{
+	// sift up...
+	while (i > 0 && _mii_timer_before(mii, i, (i - 1) / 2)) {
+		_mii_timer_heap_swap(mii, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	// ... or down
+	do {
+		int l = (i * 2) + 1, r = l + 1, m = i;
+		if (l < mii->timer.count && _mii_timer_before(mii, l, m))
+			m = l;
+		if (r < mii->timer.count && _mii_timer_before(mii, r, m))
+			m = r;
+		if (m == i)
+			break;
+		_mii_timer_heap_swap(mii, i, m);
+		i = m;
+	} while (1);
+	mii->timer.next = _TD(mii, 0);
+}
+
+static void
+_mii_timer_heap_remove(
+		mii_t *mii,
+		uint8_t timer_id)
+{
+	int i = mii->timer.timers[timer_id].index;
+	if (i == 0xff)
+		return;
+	mii->timer.timers[timer_id].index = 0xff;
+	int last = --mii->timer.count;
+	if (i != last) {
+		uint8_t t = mii->timer.heap[last];
+		mii->timer.heap[i] = t;
+		mii->timer.timers[t].index = i;
+		_mii_timer_heap_fix(mii, i);
+	}
+	mii->timer.next = mii->timer.count ? _TD(mii, 0) : UINT64_MAX;
+}
+
+/* (re)start timer_id, stop it if 'when' is zero or negative */
+static void
+_mii_timer_arm(
+		mii_t *mii,
+		uint8_t timer_id,
+		int64_t when)
+{
+	if (when <= 0) {
+		_mii_timer_heap_remove(mii, timer_id);
+		mii->timer.timers[timer_id].when = when;
+		return;
+	}
+	mii->timer.timers[timer_id].deadline = mii->timer.now + when;
+	int i = mii->timer.timers[timer_id].index;
+	if (i == 0xff) {
+		i = mii->timer.count++;
+		mii->timer.heap[i] = timer_id;
+		mii->timer.timers[timer_id].index = i;
+	}
+	_mii_timer_heap_fix(mii, i);
+}
+
 uint8_t
 mii_timer_register(
 		mii_t *mii,
@@ -891,8 +1114,9 @@ mii_timer_register(
 	mii->timer.map |= 1ull << i;
 	mii->timer.timers[i].cb = cb;
 	mii->timer.timers[i].param = param;
-	mii->timer.timers[i].when = when;
 	mii->timer.timers[i].name = name;
+	mii->timer.timers[i].index = 0xff;
+	_mii_timer_arm(mii, i, when);
 	return i;
 }
 
@@ -903,7 +1127,9 @@ mii_timer_get(
 {
 	if (timer_id >= (int)sizeof(mii->timer.map) * 8)
 		return 0;
-	return mii->timer.timers[timer_id].when;
+	if (mii->timer.timers[timer_id].index == 0xff)
+		return mii->timer.timers[timer_id].when;
+	return (int64_t)(mii->timer.timers[timer_id].deadline - mii->timer.now);
 }
 
 int
@@ -914,27 +1140,28 @@ mii_timer_set(
 {
 	if (timer_id >= (int)sizeof(mii->timer.map) * 8)
 		return -1;
-	mii->timer.timers[timer_id].when = when;
+	_mii_timer_arm(mii, timer_id, when);
 	return 0;
 }
 
+/*
+ * Called when 'now' has reached 'next'; fires all the timers that are due.
+ * The timer stays at the top of the heap while its callback runs, so
+ * mii_timer_get() returns how late it is (0 or negative), as before. The
+ * callback return value is then added to that; if the result is still 0
+ * or negative, the timer stops.
+ */
 static void
 mii_timer_run(
-		mii_t *mii,
-		uint64_t cycles)
+		mii_t *mii)
 {
-	uint64_t timer = mii->timer.map;
-	while (timer) {
-		int i = ffsll(timer) - 1;
-		timer &= ~(1ull << i);
-		if (mii->timer.timers[i].when > 0) {
-			mii->timer.timers[i].when -= cycles;
-			if (mii->timer.timers[i].when <= 0) {
-				if (mii->timer.timers[i].cb)
-					mii->timer.timers[i].when += mii->timer.timers[i].cb(mii,
-							mii->timer.timers[i].param);
-			}
-		}
+	while (mii->timer.next <= mii->timer.now) {
+		uint8_t i = mii->timer.heap[0];
+		uint64_t ret = 0;
+		if (mii->timer.timers[i].cb)
+			ret = mii->timer.timers[i].cb(mii, mii->timer.timers[i].param);
+		// this also covers the callback re-arming (or stopping) its own timer
+		_mii_timer_arm(mii, i, mii_timer_get(mii, i) + ret);
 	}
 }
 
@@ -1002,11 +1229,20 @@ _mii_cpu_direct_access_cb(
 	mii_t *mii = cpu->access_param;
 
 	mii->cpu_state = access;	// update to latest state
-	uint8_t cycle = mii->timer.last_cycle;
-	mii_timer_run(mii,
-				mii->cpu.cycle > cycle ? mii->cpu.cycle - cycle :
-					mii->cpu.cycle);
+	if (unlikely(cpu->fetch)) {
+		/* operand fetches don't come thru here, so the cycle deltas can't be
+		 * relied upon, count the cycles that happened since the last call */
+		uint64_t total = cpu->total_cycle + cpu->cycle;
+		mii->timer.now += total - mii->timer.last_total;
+		mii->timer.last_total = total;
+	} else {
+		uint8_t cycle = mii->timer.last_cycle;
+		mii->timer.now += mii->cpu.cycle > cycle ? mii->cpu.cycle - cycle :
+						mii->cpu.cycle;
+	}
 	mii->timer.last_cycle = mii->cpu.cycle;
+	if (unlikely(mii->timer.now >= mii->timer.next))
+		mii_timer_run(mii);
 
 	const uint16_t addr = access.addr;
 	int wr = access.w;
@@ -1023,7 +1259,8 @@ _mii_cpu_direct_access_cb(
 			if (addr >= mii->debug.bp[i].addr &&
 					addr < mii->debug.bp[i].addr + mii->debug.bp[i].size) {
 				if (((mii->debug.bp[i].kind & MII_BP_R) && !wr) ||
-						((mii->debug.bp[i].kind & MII_BP_W) && wr)) {
+						((mii->debug.bp[i].kind & MII_BP_W) && wr) ||
+						((mii->debug.bp[i].kind & MII_BP_PC) && access.sync)) {
 
 					if (1 || !mii->debug.bp[i].silent) {
 						printf("BREAKPOINT %d at %04x PC:%04x\n",
@@ -1031,6 +1268,7 @@ _mii_cpu_direct_access_cb(
 						mii_dump_run_trace(mii);
 						mii_dump_trace_state(mii);
 						mii->cpu.instruction_run = 0;
+						mii->run.bp_hit = 1;
 						mii->state = MII_STOPPED;
 					}
 				}
@@ -1046,6 +1284,22 @@ _mii_cpu_direct_access_cb(
 
 	return mii->cpu_state;
 }
+/*
+ * Hand the fast page pointers to the CPU, so it can fetch operands without
+ * calling the access callback, unless something needs to see every cycle.
+ */
+static void
+_mii_cpu_fetch_map(
+		mii_t *mii)
+{
+	bool fast = mii->fast_fetch && !mii->debug.bp_map && mii->trace_cpu <= 1;
+	if (fast && mii->mem_dirty)
+		mii_page_table_update(mii);
+	if (fast && !mii->cpu.fetch)
+		mii->timer.last_total = mii->cpu.total_cycle + mii->cpu.cycle;
+	mii->cpu.fetch = fast ? mii->mem_fast.read : NULL;
+}
+
 void
 mii_run(
 		mii_t *mii)
@@ -1057,12 +1311,87 @@ mii_run(
 	} else
 		mii->cpu.instruction_run = 100000;
 
+	_mii_cpu_fetch_map(mii);
 	mii->cpu_state = mii_cpu_run(&mii->cpu, mii->cpu_state);
 
 	if (unlikely(mii->cpu_state.trap))
 		_mii_handle_trap(mii);
 }
 
+/* budget timer callback, stops the CPU at the end of this instruction */
+static uint64_t
+_mii_run_budget_cb(
+		mii_t *mii,
+		void *param)
+{
+	mii->cpu.instruction_run = 0;
+	return 0;
+}
+
+int
+mii_run_until(
+		mii_t *mii,
+		uint64_t deadline,
+		uint32_t flags)
+{
+	if (mii->state != MII_RUNNING)
+		return MII_RUN_STOPPED;
+	int res = MII_RUN_BUDGET;
+	uint32_t frame = mii->video.frame_count;
+
+	mii->run.bp_hit = 0;
+	do {
+		// cycles of the last instruction aren't in total_cycle yet
+		uint64_t now = mii->cpu.total_cycle + mii->cpu.cycle;
+		if (now >= deadline)
+			break;
+		uint64_t left = deadline - now;
+		mii_timer_set(mii, mii->run.timer_id,
+				left > INT64_MAX ? INT64_MAX : (int64_t)left);
+		mii->cpu.instruction_run = mii->trace_cpu > 1 ? 0 : UINT32_MAX;
+		_mii_cpu_fetch_map(mii);
+		mii->cpu_state = mii_cpu_run(&mii->cpu, mii->cpu_state);
+
+		if (unlikely(mii->cpu_state.trap)) {
+			_mii_handle_trap(mii);
+			if (flags & MII_RUN_STOP_TRAP) {
+				res = MII_RUN_TRAP;
+				break;
+			}
+		}
+		if (unlikely(mii->state != MII_RUNNING)) {
+			res = mii->run.bp_hit ? MII_RUN_BREAKPOINT : MII_RUN_STOPPED;
+			break;
+		}
+		if (mii->video.frame_count != frame) {
+			// between instructions, a good time for a rewind snapshot
+			if (mii->rewind)
+				mii_rewind_frame(mii);
+			if (mii->capture)
+				mii_capture_frame(mii);
+			frame = mii->video.frame_count;
+			if (flags & MII_RUN_STOP_FRAME) {
+				res = MII_RUN_FRAME;
+				break;
+			}
+		}
+	} while (1);
+	// disarm, so it doesn't stop a mii_run() call later on
+	mii_timer_set(mii, mii->run.timer_id, 0);
+	return res;
+}
+
+int
+mii_run_cycles(
+		mii_t *mii,
+		uint64_t cycles,
+		uint32_t flags)
+{
+	uint64_t now = mii->cpu.total_cycle + mii->cpu.cycle;
+	uint64_t deadline = now + cycles < now ? UINT64_MAX : now + cycles;
+	return mii_run_until(mii, deadline, flags);
+}
+
 //! Read one byte from and addres, using the current memory mapping
 uint8_t
 mii_read_one(
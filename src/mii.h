@@ -138,16 +138,27 @@ typedef struct mii_t {
 	 * and call the callback (if present).
 	 * The callback returns the number of cycles to wait until the next
 	 * call.
+	 * Internally, the running timers have an absolute deadline in 'now'
+	 * cycles, and are kept in a binary min-heap ordered by deadline, so
+	 * the memory access path only has to compare 'now' with 'next'.
 	 */
 	struct {
 		uint64_t 	map;
+		uint64_t	now;		// monotonic cycle counter
+		uint64_t	next;		// deadline of the heap top, or UINT64_MAX
 #if MII_65C02_DIRECT_ACCESS
 		uint8_t		last_cycle;
+		uint64_t	last_total;	// fast fetch mode, see mii_cpu_t.fetch
 #endif
+		uint8_t		count;		// number of timers in the heap
+		uint8_t		heap[64];	// timer ids, heap[0] is the next to fire
 		struct {
 			mii_timer_p 		cb;
 			void *				param;
+			// cycles left, only valid when stopped (ie 0 or negative)
 			int64_t 			when;
+			uint64_t			deadline;	// when running
+			uint8_t				index;		// in heap[], 0xff if stopped
 			const char *		name; // debug
 		} timers[64];
 	}				timer;
@@ -164,17 +175,36 @@ typedef struct mii_t {
 		};
 	} 				mem[256];
 	int 			mem_dirty;	// recalculate mem[] on next access
+	/*
+	 * Host pointers to each page as currently mapped, rebuilt along mem[]
+	 * by mii_page_table_update(). A NULL pointer means the page needs the
+	 * 'slow' path in mii_mem_access(): soft switches, ROM writes, writes
+	 * to video pages, and pages of banks with an access callback.
+	 * 'dirty' points to the dirty map byte of each writable page, or
+	 * to 'dirty_none' if the bank doesn't track them. 'rebuild' forces all
+	 * of them to be recalculated, ie when bank access callbacks changed.
+	 */
+	struct {
+		uint8_t *		read[256];
+		uint8_t *		write[256];
+		uint8_t *		dirty[256];
+		uint8_t *		bank_mem[MII_BANK_COUNT]; // detects remapping
+		uint8_t			dirty_none;
+		uint8_t			rebuild;
+	}				mem_fast;
 	/*
 	 * RAMWORKS card emulation, this is a 16MB address space, with 128
 	 * possible 64KB banks. The 'avail' bitfield marks the banks that
 	 * are 'possible' (depending on what size of RAMWORKS card is installed).
-	 * The 'bank' array is a pointer to the actual memory block.
+	 * The 'bank' array is a pointer to the actual memory block, 'dirty' is
+	 * its page dirty map, see mii_bank_t.
 	 *
 	 * These memory blocks replace the main AUX bank when a register is set.
 	 */
 	struct {
 		unsigned __int128	avail;
 		uint8_t * 			bank[128];
+		uint8_t * 			dirty[128];
 	}				ramworks;
 	/*
 	 * These are the 'real' state of the soft switches, as opposed to the
@@ -184,6 +214,12 @@ typedef struct mii_t {
 	uint32_t 		sw_state;	// B_SW* bitfield
 	mii_trace_t		trace;
 	int				trace_cpu;
+	/*
+	 * When set, the CPU fetches instruction operands straight from the
+	 * fast page pointers, bypassing the access callback. This is faster,
+	 * but not cycle exact. Disabled while tracing, or with breakpoints.
+	 */
+	int				fast_fetch;
 	mii_trap_t		trap;
 	mii_signal_pool_t sig_pool;	// vcd support
 	/*
@@ -206,6 +242,16 @@ typedef struct mii_t {
 	 */
 	mii_bank_access_t * soft_switches_override;
 	mii_slot_t		slot[7];
+	/*
+	 * State for mii_run_until(), the timer is armed with the cycles left
+	 * to run, and stops the CPU when it fires.
+	 */
+	struct {
+		uint8_t			timer_id;
+		uint8_t			bp_hit;		// set when a breakpoint stopped the CPU
+	}				run;
+	struct mii_rewind_t * rewind;	// optional, see mii_rewind.h
+	struct mii_capture_t * capture;	// optional, see mii_capture.h
 
 	/*
 	 * These are all the state of the various subsystems.
@@ -303,6 +349,39 @@ mii_reset(
 void
 mii_run(
 		mii_t *mii);
+
+/* Reasons for mii_run_until()/mii_run_cycles() to return */
+enum {
+	MII_RUN_BUDGET = 0,		// cycle budget/deadline was reached
+	MII_RUN_FRAME,			// a video frame ended (MII_RUN_STOP_FRAME)
+	MII_RUN_BREAKPOINT,		// a breakpoint was hit, state is MII_STOPPED
+	MII_RUN_TRAP,			// a trap was handled (MII_RUN_STOP_TRAP)
+	MII_RUN_STOPPED,		// state isn't (or no longer) MII_RUNNING
+};
+/* flags for mii_run_until()/mii_run_cycles() */
+enum {
+	MII_RUN_STOP_FRAME		= (1 << 0),	// return at the end of a video frame
+	MII_RUN_STOP_TRAP		= (1 << 1),	// return after a trap was handled
+};
+/*
+ * Run the CPU until cpu.total_cycle reaches 'deadline', or until one of
+ * the conditions in 'flags' (MII_RUN_STOP_*) happens. Breakpoints and any
+ * other change of mii->state also stop it.
+ * The deadline is checked at instruction boundaries, so it can overshoot
+ * by a few cycles. Traps are handled internally.
+ * Returns the reason it stopped, as a MII_RUN_* value.
+ */
+int
+mii_run_until(
+		mii_t *mii,
+		uint64_t deadline,
+		uint32_t flags);
+/* Same as mii_run_until(), for 'cycles' from now */
+int
+mii_run_cycles(
+		mii_t *mii,
+		uint64_t cycles,
+		uint32_t flags);
 // this one is thread safe, there's a FIFO behind it.
 void
 mii_keypress(
@@ -345,6 +424,11 @@ mii_mem_access(
 		uint8_t * byte,
 		bool write,
 		bool do_sw);
+/* Select ramworks 'bank' as the current AUX bank, allocates it if needed */
+void
+mii_bank_update_ramworks(
+		mii_t *mii,
+		uint8_t bank);
 /* register a callback to call when a specific soft switches is hit,
  * this allows overriding/supplementing/tracing access to sw.
  */
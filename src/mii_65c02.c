@@ -42,6 +42,19 @@ mii_cpu_init(
 		s.addr = _addr; s.data = _val; s.w = 1; cpu->cycle++; \
 		s = cpu->access(cpu, s); \
 	}
+/*
+ * Operand (and dummy) fetches from the instruction stream; these read
+ * straight from the host page if cpu->fetch has one, without calling access()
+ */
+#define _FETCH_PC(_val) { \
+		const uint16_t _a = _val; \
+		const uint8_t * _p = cpu->fetch ? cpu->fetch[_a >> 8] : NULL; \
+		if (_p) { \
+			s.addr = _a; s.w = 0; cpu->cycle++; \
+			s.data = _p[_a & 0xff]; \
+		} else \
+			_FETCH(_a); \
+	}
 #else
 #define _FETCH(_val) { \
 		s.addr = _val; s.w = 0; cpu->cycle++; \
@@ -51,8 +64,10 @@ mii_cpu_init(
 		s.addr = _addr; s.data = _val; s.w = 1; cpu->cycle++; \
 		pt_yield(cpu->state); \
 	}
+#define _FETCH_PC(_val) _FETCH(_val)
 #endif
 
+#ifdef MII_PACK_P
 #define _NZC(_val) { \
 		uint16_t v = (_val); \
 		cpu->P.N = !!(v & 0x80); \
@@ -64,15 +79,251 @@ mii_cpu_init(
 		cpu->P.N = !!(v & 0x80); \
 		cpu->P.Z = (v & 0xff) == 0; \
 	}
+#define _N(_val) { \
+		cpu->P.N = !!((_val) & 0x80); \
+	}
+#define _Z(_val) { \
+		cpu->P.Z = ((_val) & 0xff) == 0; \
+	}
+#else
+/* lazy flags, just keep the result, see mii_cpu_get_p_bit() */
+#define _NZC(_val) { \
+		uint16_t v = (_val); \
+		cpu->P._n = cpu->P._z = v; \
+		cpu->P.C = !!(v & 0xff00); \
+	}
+#define _NZ(_val) { \
+		cpu->P._n = cpu->P._z = (_val); \
+	}
+#define _N(_val) { \
+		cpu->P._n = (_val); \
+	}
+#define _Z(_val) { \
+		cpu->P._z = (_val); \
+	}
+#endif
 #define _C(_val) { \
 		cpu->P.C = !!(_val); \
 	}
 
+/*
+ * Opcode handlers, with the list of opcodes each of them handles. These lists
+ * are used to generate either the 'case' labels for the switch() dispatch, or
+ * the label tables for the threaded dispatch.
+ */
+#define MII_OPS_ADC		0x69, 0x65, 0x75, 0x6D, 0x7D, 0x79, 0x61, 0x71, 0x72
+#define MII_OPS_AND		0x29, 0x25, 0x35, 0x2D, 0x3D, 0x39, 0x21, 0x31, 0x32
+#define MII_OPS_ASL_A	0x0A
+#define MII_OPS_ASL		0x06, 0x16, 0x0E, 0x1E
+#define MII_OPS_BBX		0x0f, 0x1f, 0x2f, 0x3f, 0x4f, 0x5f, 0x6f, 0x7f, \
+						0x8f, 0x9f, 0xaf, 0xbf, 0xcf, 0xdf, 0xef, 0xff
+#define MII_OPS_BXX		0x90, 0xB0, 0xF0, 0x30, 0xD0, 0x10, 0x50, 0x70
+#define MII_OPS_BRA		0x80
+#define MII_OPS_BIT_IMM	0x89
+#define MII_OPS_BIT		0x24, 0x2C, 0x34, 0x3C
+#define MII_OPS_BRK		0x00
+#define MII_OPS_CLX		0x18, 0xD8, 0x58, 0xB8
+#define MII_OPS_CMP		0xC9, 0xC5, 0xD5, 0xCD, 0xDD, 0xD9, 0xC1, 0xD1, 0xD2
+#define MII_OPS_CPX		0xE0, 0xE4, 0xEC
+#define MII_OPS_CPY		0xC0, 0xC4, 0xCC
+#define MII_OPS_DEC_A	0x3A
+#define MII_OPS_DEC		0xC6, 0xD6, 0xCE, 0xDE
+#define MII_OPS_DEX		0xCA
+#define MII_OPS_DEY		0x88
+#define MII_OPS_EOR		0x49, 0x45, 0x55, 0x4D, 0x5D, 0x59, 0x41, 0x51, 0x52
+#define MII_OPS_INC_A	0x1A
+#define MII_OPS_INC		0xE6, 0xF6, 0xEE, 0xFE
+#define MII_OPS_INX		0xE8
+#define MII_OPS_INY		0xC8
+#define MII_OPS_JMP		0x4C, 0x6C, 0x7C
+#define MII_OPS_JSR		0x20
+#define MII_OPS_LDA		0xA9, 0xA5, 0xB5, 0xAD, 0xBD, 0xB9, 0xA1, 0xB1, 0xB2
+#define MII_OPS_LDX		0xA2, 0xA6, 0xB6, 0xAE, 0xBE
+#define MII_OPS_LDY		0xA0, 0xA4, 0xB4, 0xAC, 0xBC
+#define MII_OPS_LSR_A	0x4A
+#define MII_OPS_LSR		0x46, 0x56, 0x4E, 0x5E
+#define MII_OPS_NOP		0xEA
+#define MII_OPS_ORA		0x09, 0x05, 0x15, 0x0D, 0x1D, 0x19, 0x01, 0x11, 0x12
+#define MII_OPS_PHA		0x48
+#define MII_OPS_PHP		0x08
+#define MII_OPS_PHX		0xDA
+#define MII_OPS_PHY		0x5A
+#define MII_OPS_PLA		0x68
+#define MII_OPS_PLP		0x28
+#define MII_OPS_PLX		0xFA
+#define MII_OPS_PLY		0x7A
+#define MII_OPS_ROL_A	0x2A
+#define MII_OPS_ROL		0x26, 0x36, 0x2E, 0x3E
+#define MII_OPS_ROR_A	0x6A
+#define MII_OPS_ROR		0x66, 0x76, 0x6E, 0x7E
+#define MII_OPS_RTI		0x40
+#define MII_OPS_RTS		0x60
+#define MII_OPS_SBC		0xE9, 0xE5, 0xF5, 0xED, 0xFD, 0xF9, 0xE1, 0xF1, 0xF2
+#define MII_OPS_SEX		0x38, 0xF8, 0x78
+#define MII_OPS_STA		0x85, 0x95, 0x8D, 0x9D, 0x99, 0x81, 0x91, 0x92
+#define MII_OPS_STX		0x86, 0x96, 0x8E
+#define MII_OPS_STY		0x84, 0x94, 0x8C
+#define MII_OPS_STZ		0x64, 0x74, 0x9C, 0x9E
+#define MII_OPS_TRB		0x14, 0x1c
+#define MII_OPS_TSB		0x04, 0x0c
+#define MII_OPS_TAX		0xAA
+#define MII_OPS_TAY		0xA8
+#define MII_OPS_TSX		0xBA
+#define MII_OPS_TXA		0x8A
+#define MII_OPS_TXS		0x9A
+#define MII_OPS_TYA		0x98
+#define MII_OPS_XMB		0x07, 0x17, 0x27, 0x37, 0x47, 0x57, 0x67, 0x77, \
+						0x87, 0x97, 0xA7, 0xB7, 0xC7, 0xD7, 0xE7, 0xF7
+#define MII_OPS_NOP3	0x5c, 0xdc, 0xfc
+#define MII_OPS_NOP2	0x02, 0x22, 0x42, 0x62, 0x82, 0xC2, 0xE2, 0x44, 0x54, \
+						0xD4, 0xF4
+#define MII_OPS_STP		0xdb
+#define MII_OPS_NOP_XB	0xCB, 0x0B, 0x1B, 0x2B, 0x3B, 0x4B, 0x5B, 0x6B, 0x7B, \
+						0x8B, 0x9B, 0xAB, 0xBB, 0xEB, 0xFB
+#define MII_OPS_NOP_X3	0x03, 0x13, 0x23, 0x33, 0x43, 0x53, 0x63, 0x73, \
+						0x83, 0x93, 0xA3, 0xB3, 0xC3, 0xD3, 0xE3, 0xF3
+
+#define MII_OPS_HANDLERS(_h) \
+	_h(ADC) _h(AND) _h(ASL_A) _h(ASL) _h(BBX) _h(BXX) _h(BRA) _h(BIT_IMM) \
+	_h(BIT) _h(BRK) _h(CLX) _h(CMP) _h(CPX) _h(CPY) _h(DEC_A) _h(DEC) \
+	_h(DEX) _h(DEY) _h(EOR) _h(INC_A) _h(INC) _h(INX) _h(INY) _h(JMP) \
+	_h(JSR) _h(LDA) _h(LDX) _h(LDY) _h(LSR_A) _h(LSR) _h(NOP) _h(ORA) \
+	_h(PHA) _h(PHP) _h(PHX) _h(PHY) _h(PLA) _h(PLP) _h(PLX) _h(PLY) \
+	_h(ROL_A) _h(ROL) _h(ROR_A) _h(ROR) _h(RTI) _h(RTS) _h(SBC) _h(SEX) \
+	_h(STA) _h(STX) _h(STY) _h(STZ) _h(TRB) _h(TSB) _h(TAX) _h(TAY) \
+	_h(TSX) _h(TXA) _h(TXS) _h(TYA) _h(XMB) _h(NOP3) _h(NOP2) _h(STP) \
+	_h(NOP_XB) _h(NOP_X3)
+
+/* Calls _m(_name, op) for each of the (up to 16) opcodes in the list */
+#define _MII_EACH_1(_m, _n, _o)		_m(_n, _o)
+#define _MII_EACH_2(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_1(_m, _n, __VA_ARGS__)
+#define _MII_EACH_3(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_2(_m, _n, __VA_ARGS__)
+#define _MII_EACH_4(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_3(_m, _n, __VA_ARGS__)
+#define _MII_EACH_5(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_4(_m, _n, __VA_ARGS__)
+#define _MII_EACH_6(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_5(_m, _n, __VA_ARGS__)
+#define _MII_EACH_7(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_6(_m, _n, __VA_ARGS__)
+#define _MII_EACH_8(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_7(_m, _n, __VA_ARGS__)
+#define _MII_EACH_9(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_8(_m, _n, __VA_ARGS__)
+#define _MII_EACH_10(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_9(_m, _n, __VA_ARGS__)
+#define _MII_EACH_11(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_10(_m, _n, __VA_ARGS__)
+#define _MII_EACH_12(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_11(_m, _n, __VA_ARGS__)
+#define _MII_EACH_13(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_12(_m, _n, __VA_ARGS__)
+#define _MII_EACH_14(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_13(_m, _n, __VA_ARGS__)
+#define _MII_EACH_15(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_14(_m, _n, __VA_ARGS__)
+#define _MII_EACH_16(_m, _n, _o, ...)	_m(_n, _o) _MII_EACH_15(_m, _n, __VA_ARGS__)
+#define _MII_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+			_13, _14, _15, _16, _n, ...) _n
+#define _MII_NARGS(...) \
+		_MII_NARGS_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, \
+				5, 4, 3, 2, 1)
+#define _MII_EACH__(_cnt, _m, _n, ...) \
+		_MII_EACH_##_cnt(_m, _n, __VA_ARGS__)
+#define _MII_EACH_(_cnt, _m, _n, ...)	_MII_EACH__(_cnt, _m, _n, __VA_ARGS__)
+#define _MII_EACH(_m, _n, ...) \
+		_MII_EACH_(_MII_NARGS(__VA_ARGS__), _m, _n, __VA_ARGS__)
+
+#if MII_65C02_DIRECT_ACCESS
+#define _MII_TRAP_RETURN		return s;
+#else
+#define _MII_TRAP_RETURN
+#endif
+/*
+ * Fetch and decode the next opcode. We dont' reset the cycle before the
+ * fetch, that way calling code has a way of knowing how many cycles were used
+ * by the previous instruction
+ */
+#define _MII_FETCH_OPCODE() \
+		s.sync = 1; \
+		_FETCH(cpu->PC); \
+		cpu->total_cycle += cpu->cycle; \
+		s.sync = 0; \
+		cpu->cycle = 0; \
+		cpu->PC++; \
+		cpu->IR = s.data; \
+		d = mii_cpu_op[cpu->IR].desc; \
+		cpu->ir_log = (cpu->ir_log << 8) | cpu->IR; \
+		s.trap = cpu->trap && (cpu->ir_log & 0xffff) == cpu->trap; \
+		if (unlikely(s.trap)) { \
+			cpu->ir_log = 0; \
+			_MII_TRAP_RETURN \
+		}
+
+#if MII_65C02_THREADED
+/*
+ * Threaded dispatch; both the addressing modes and the opcode handlers are
+ * labels, the 'switch' becomes a computed goto through a label table. Each
+ * addressing mode jumps straight to the opcode handler, and in direct access
+ * mode, each opcode handler does its own store, fetches the next opcode and
+ * jumps to its addressing mode. This gives the branch predictor one indirect
+ * jump per handler, instead of one shared jump for all of them.
+ * Anything 'unusual' (reset, interrupts) takes the long way around via
+ * next_instruction. It works for both the direct access and protothread modes.
+ */
+#define _MII_OP_LABEL(_n, _o)	[_o] = &&_mii_op_##_n,
+#define _MII_OP_LABELS(_n)		_MII_EACH(_MII_OP_LABEL, _n, MII_OPS_##_n)
+#define MII_SWITCH(_table, _v)	goto *_table[_v]; {
+#define MII_SWITCH_END(_table)	} _table##_done: __attribute__((unused));
+#define MII_MODE(_mode)			_mii_mode_##_mode:
+#define MII_MODE_END { \
+			if (d.r) { \
+				_FETCH(cpu->_P); \
+				cpu->_D = s.data; \
+			} \
+			goto *_mii_op[cpu->IR]; \
+		}
+#define MII_OP(_n)				_mii_op_##_n:
+#define MII_OP_DEFAULT			_mii_op_default:
+#if MII_65C02_DIRECT_ACCESS
+#define MII_OP_END { \
+			if (d.w) { \
+				_STORE(cpu->_P, cpu->_D); \
+			} \
+			if (unlikely(!cpu->instruction_run)) \
+				return s; \
+			cpu->instruction_run--; \
+			if (unlikely(s.reset || s.irq || s.nmi || cpu->IRQ)) \
+				goto next_instruction; \
+			_MII_FETCH_OPCODE(); \
+			goto *_mii_mode[d.mode]; \
+		}
+#else
+#define MII_OP_END				goto _mii_op_done;
+#endif
+#else
+#define _MII_OP_CASE(_n, _o)	case _o:
+#define MII_SWITCH(_table, _v)	switch (_v) {
+#define MII_SWITCH_END(_table)	}
+#define MII_MODE(_mode)			case _mode:
+#define MII_MODE_END			break;
+#define MII_OP(_n)				_MII_EACH(_MII_OP_CASE, _n, MII_OPS_##_n)
+#define MII_OP_DEFAULT			default:
+#define MII_OP_END				break;
+#endif
+
 mii_cpu_state_t
 mii_cpu_run(
 		mii_cpu_t *cpu,
 		mii_cpu_state_t s)
 {
+#if MII_65C02_THREADED
+	static const void * const _mii_mode[16] = {
+		[IMPLIED] = &&_mii_mode_done,
+		[IMM] = &&_mii_mode_IMM, [ZP_REL] = &&_mii_mode_ZP_REL,
+		[ZP_X] = &&_mii_mode_ZP_X, [ZP_Y] = &&_mii_mode_ZP_Y,
+		[ABS] = &&_mii_mode_ABS, [ABS_X] = &&_mii_mode_ABS_X,
+		[ABS_Y] = &&_mii_mode_ABS_Y, [IND_X] = &&_mii_mode_IND_X,
+		[IND_AX] = &&_mii_mode_IND_AX, [IND_Y] = &&_mii_mode_IND_Y,
+		[IND] = &&_mii_mode_IND, [IND_Z] = &&_mii_mode_IND_Z,
+		[BRANCH] = &&_mii_mode_BRANCH,
+	};
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+	static const void * const _mii_op[256] = {
+		[0 ... 255] = &&_mii_op_default,
+		MII_OPS_HANDLERS(_MII_OP_LABELS)
+	};
+#pragma GCC diagnostic pop
+#endif
 #if MII_65C02_DIRECT_ACCESS
 	mii_op_desc_t d;
 #else
@@ -119,45 +370,28 @@ next_instruction:
 		cpu->IRQ = 0;
 		cpu->PC = cpu->_P;
 	}
-	s.sync = 1;
-	// we dont' reset the cycle here, that way calling code has a way of knowing
-	// how many cycles were used by the previous instruction
-	_FETCH(cpu->PC);
-	cpu->total_cycle += cpu->cycle;
-	s.sync = 0;
-	cpu->cycle = 0;
-	cpu->PC++;
-	cpu->IR = s.data;
-	d = mii_cpu_op[cpu->IR].desc;
-	cpu->ir_log = (cpu->ir_log << 8) | cpu->IR;
-	s.trap = cpu->trap && (cpu->ir_log & 0xffff) == cpu->trap;
-	if (unlikely(s.trap)) {
-		cpu->ir_log = 0;
-#if MII_65C02_DIRECT_ACCESS
-		return s;
-#endif
-	}
-	switch (d.mode) {
-		case IMM:
-			_FETCH(cpu->PC++);		cpu->_D = s.data;
-			break;
-		case BRANCH: // BEQ/BNE etc
-		case ZP_REL: // $(xx)
-			_FETCH(cpu->PC++);		cpu->_P = s.data;
-			break;
-		case ZP_X: // $xx,X
-			_FETCH(cpu->PC++);		cpu->_P = (s.data + cpu->X) & 0xff;
-			break;
-		case ZP_Y:	// $xx,Y
-			_FETCH(cpu->PC++);		cpu->_P = (s.data + cpu->Y) & 0xff;
-			break;
-		case ABS: {	// $xxxx
-			_FETCH(cpu->PC++);		cpu->_P = s.data;
-			_FETCH(cpu->PC++);		cpu->_P |= s.data << 8;
-		}	break;
-		case ABS_X: { // $xxxx,X
-			_FETCH(cpu->PC++);		cpu->_P = s.data;
-			_FETCH(cpu->PC++);		cpu->_P |= s.data << 8;
+	_MII_FETCH_OPCODE();
+	MII_SWITCH(_mii_mode, d.mode)
+		MII_MODE(IMM)
+			_FETCH_PC(cpu->PC++);		cpu->_D = s.data;
+			MII_MODE_END
+		MII_MODE(BRANCH) // BEQ/BNE etc
+		MII_MODE(ZP_REL) // $(xx)
+			_FETCH_PC(cpu->PC++);		cpu->_P = s.data;
+			MII_MODE_END
+		MII_MODE(ZP_X) // $xx,X
+			_FETCH_PC(cpu->PC++);		cpu->_P = (s.data + cpu->X) & 0xff;
+			MII_MODE_END
+		MII_MODE(ZP_Y)	// $xx,Y
+			_FETCH_PC(cpu->PC++);		cpu->_P = (s.data + cpu->Y) & 0xff;
+			MII_MODE_END
+		MII_MODE(ABS) {	// $xxxx
+			_FETCH_PC(cpu->PC++);		cpu->_P = s.data;
+			_FETCH_PC(cpu->PC++);		cpu->_P |= s.data << 8;
+		}	MII_MODE_END
+		MII_MODE(ABS_X) { // $xxxx,X
+			_FETCH_PC(cpu->PC++);		cpu->_P = s.data;
+			_FETCH_PC(cpu->PC++);		cpu->_P |= s.data << 8;
 			/*
 			 * this seems to be only used by a2audit, ever, which is bloody
 			 * annoying, so we just fake it to pass the test
@@ -168,61 +402,60 @@ next_instruction:
 			}
 			cpu->_P += cpu->X;
 			if ((cpu->_P & 0xff00) != (s.data << 8)) {
-				_FETCH(cpu->PC); // false read
+				_FETCH_PC(cpu->PC); // false read
 			}
-		}	break;
-		case ABS_Y: { // $xxxx,Y
-			_FETCH(cpu->PC++);		cpu->_P = s.data;
-			_FETCH(cpu->PC++);		cpu->_P |= s.data << 8;
+		}	MII_MODE_END
+		MII_MODE(ABS_Y) { // $xxxx,Y
+			_FETCH_PC(cpu->PC++);		cpu->_P = s.data;
+			_FETCH_PC(cpu->PC++);		cpu->_P |= s.data << 8;
 			cpu->_P += cpu->Y;
 			if ((cpu->_P & 0xff00) != (s.data << 8)) {
-				_FETCH(cpu->PC); // false read
+				_FETCH_PC(cpu->PC); // false read
 			}
-		}	break;
-		case IND_X: { // ($xx,X)
-			_FETCH(cpu->PC++);		cpu->_D = s.data;
+		}	MII_MODE_END
+		MII_MODE(IND_X) { // ($xx,X)
+			_FETCH_PC(cpu->PC++);		cpu->_D = s.data;
 			cpu->_D += cpu->X;
 			_FETCH(cpu->_D & 0xff);	cpu->_P = s.data;
 			cpu->_D++;
 			_FETCH(cpu->_D & 0xff);	cpu->_P |= s.data << 8;
-		}	break;
-		case IND_Y: { // ($xx),Y
-			_FETCH(cpu->PC++);		cpu->_D = s.data;
+		}	MII_MODE_END
+		MII_MODE(IND_Y) { // ($xx),Y
+			_FETCH_PC(cpu->PC++);		cpu->_D = s.data;
 			_FETCH(cpu->_D);		cpu->_P = s.data;
 			_FETCH((cpu->_D + 1) & 0xff);
 			cpu->_P |= s.data << 8;
 			cpu->_P += cpu->Y;
-		}	break;
-		case IND: {	// ($xxxx)
-			_FETCH(cpu->PC++); 		cpu->_D = s.data;
-			_FETCH(cpu->PC++); 		cpu->_D |= s.data << 8;
+		}	MII_MODE_END
+		MII_MODE(IND) {	// ($xxxx)
+			_FETCH_PC(cpu->PC++); 		cpu->_D = s.data;
+			_FETCH_PC(cpu->PC++); 		cpu->_D |= s.data << 8;
 			_FETCH(cpu->_D); 		cpu->_P = s.data;
 			_FETCH(cpu->_D + 1); 	cpu->_P |= s.data << 8;
-		}	break;
-		case IND_Z: {	// ($xx)
-			_FETCH(cpu->PC++); 		cpu->_D = s.data;
+		}	MII_MODE_END
+		MII_MODE(IND_Z) {	// ($xx)
+			_FETCH_PC(cpu->PC++); 		cpu->_D = s.data;
 			_FETCH(cpu->_D); 		cpu->_P = s.data;
 //			_FETCH((cpu->_D + 1)); 	cpu->_P |= s.data << 8;
 			// FD if $xx=0xFF then 0xFF+1 = 0x00 and not 0x100 bug fixed
 			_FETCH((cpu->_D + 1) & 0xFF); 	cpu->_P |= s.data << 8;
-		}	break;
-		case IND_AX: { // ($xxxx,X)
-			_FETCH(cpu->PC++);		cpu->_D = s.data;
-			_FETCH(cpu->PC++);		cpu->_D |= s.data << 8;
+		}	MII_MODE_END
+		MII_MODE(IND_AX) { // ($xxxx,X)
+			_FETCH_PC(cpu->PC++);		cpu->_D = s.data;
+			_FETCH_PC(cpu->PC++);		cpu->_D |= s.data << 8;
 			cpu->_D += cpu->X;
 			if ((cpu->_D & 0xff00) != (s.data << 8))
 				cpu->cycle++;
 			_FETCH(cpu->_D);		cpu->_P = s.data;
 			_FETCH(cpu->_D + 1);	cpu->_P |= s.data << 8;
-		}	break;
-	}
+		}	MII_MODE_END
+	MII_SWITCH_END(_mii_mode)
 	if (d.r) {
 		_FETCH(cpu->_P);
 		cpu->_D = s.data;
 	}
-	switch (cpu->IR) {
-		case 0x69: case 0x65: case 0x75: case 0x6D: case 0x7D:
-		case 0x79: case 0x61: case 0x71: case 0x72:
+	MII_SWITCH(_mii_op, cpu->IR)
+		MII_OP(ADC)
 		{ // ADC
 			// Handle adding in BCD with bit D
 			if (unlikely(cpu->P.D)) {
@@ -241,10 +474,8 @@ next_instruction:
 			//	printf("ADC %02x %02x C:%d %x%x\n",
 			//			cpu->A, D, !!cpu->P.C, hi & 0xf, lo & 0xf);
 				cpu->A = (hi << 4) | (lo & 0x0f);
-				// THAT is 65c02 behaviour
-				cpu->P.N = !!(cpu->A & 0x80);
-				// FD THAT is 65C02 behavior
-                cpu->P.Z = cpu->A == 0;
+				// THAT is 65c02 behaviour, FD: for Z too
+				_NZ(cpu->A);
 			} else {
 				uint16_t sum = cpu->A + cpu->_D + !!cpu->P.C;
 				cpu->P.V = cpu->P.C = 0;
@@ -253,34 +484,30 @@ next_instruction:
 				_NZC(sum);
 				cpu->A = sum;
 			}
-		}	break;
-		case 0x29: case 0x25: case 0x35: case 0x2D: case 0x3D:
-		case 0x39: case 0x21: case 0x31: case 0x32:
+		}	MII_OP_END
+		MII_OP(AND)
 		{ // AND
 			cpu->A &= cpu->_D;
 			_NZ(cpu->A);
-		}	break;
-		case 0x0A:
+		}	MII_OP_END
+		MII_OP(ASL_A)
 		{ // ASL
-			_FETCH(cpu->PC);	// cycle++
+			_FETCH_PC(cpu->PC);	// cycle++
 			cpu->P.C = !!(cpu->A & 0x80);
 			cpu->A <<= 1;
 			_NZ(cpu->A);
-		}	break;
-		case 0x06: case 0x16: case 0x0E: case 0x1E:
+		}	MII_OP_END
+		MII_OP(ASL)
 		{ // ASL
 			cpu->P.C = !!(cpu->_D & 0x80);
 			cpu->_D <<= 1;
 			_NZ(cpu->_D);
-		}	break;
-		case 0x0f: case 0x1f: case 0x2f: case 0x3f: case 0x4f:
-		case 0x5f: case 0x6f: case 0x7f: case 0x8f: case 0x9f:
-		case 0xaf: case 0xbf: case 0xcf: case 0xdf: case 0xef:
-		case 0xff:
+		}	MII_OP_END
+		MII_OP(BBX)
 		{ // BBR/BBS
 //			printf(" BB%c%d vs %02x\n", d.s_bit_value ? 'S' : 'R',
 //					d.s_bit, cpu->_D);
-			_FETCH(cpu->PC++);	// relative branch
+			_FETCH_PC(cpu->PC++);	// relative branch
 			if (((cpu->_D >> d.s_bit) & 1) == d.s_bit_value) {
 				cpu->_P = cpu->PC + (int8_t)s.data;
 				cpu->cycle++;
@@ -288,9 +515,8 @@ next_instruction:
 					cpu->cycle++;
 				cpu->PC = cpu->_P;
 			}
-		}	break;
-		case 0x90: case 0xB0: case 0xF0: case 0x30:
-		case 0xD0: case 0x10: case 0x50: case 0x70:
+		}	MII_OP_END
+		MII_OP(BXX)
 		{ // BCC, BCS, BEQ, BMI, BNE, BPL, BVC, BVS
 			if (d.s_bit_value == MII_GET_P_BIT(cpu, d.s_bit)) {
 				cpu->_P = cpu->PC + (int8_t)cpu->_P;
@@ -299,235 +525,231 @@ next_instruction:
 					cpu->cycle++;
 				cpu->PC = cpu->_P;
 			}
-		}	break;
-		case 0x80:
+		}	MII_OP_END
+		MII_OP(BRA)
 		{	// BRA
 			cpu->_P = cpu->PC + (int8_t)cpu->_P;
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			if ((cpu->_P & 0xff00) != (cpu->PC & 0xff00))
 				cpu->cycle++;
 			cpu->PC = cpu->_P;
-		}	break;
-		case 0x89:
+		}	MII_OP_END
+		MII_OP(BIT_IMM)
 		{	// BIT immediate -- does not change N & V!
-			cpu->P.Z = !(cpu->A & cpu->_D);
-		}	break;
-		case 0x24: case 0x2C: case 0x34: case 0x3C:
+			_Z(cpu->A & cpu->_D);
+		}	MII_OP_END
+		MII_OP(BIT)
 		{ // BIT
-			cpu->P.Z = !(cpu->A & cpu->_D);
-			cpu->P.N = !!(cpu->_D & 0x80);
+			_Z(cpu->A & cpu->_D);
+			_N(cpu->_D);
 			cpu->P.V = !!(cpu->_D & 0x40);
-		}	break;
-		case 0x00:
+		}	MII_OP_END
+		MII_OP(BRK)
 		{ // BRK
 			// Turns out BRK is a 2 byte opcode, who knew? well that guy did:
 			// https://www.nesdev.org/the%20'B'%20flag%20&%20BRK%20instruction.txt#:~:text=A%20note%20on%20the%20BRK,opcode%2C%20and%20not%20just%201.
-			_FETCH(cpu->PC++);
+			_FETCH_PC(cpu->PC++);
 			s.irq = 1;
 			cpu->IRQ = MII_CPU_IRQ_BRK;		// BRK sort of IRQ interrupt
-		}	break;
-		case 0x18: case 0xD8: case 0x58: case 0xB8:
+		}	MII_OP_END
+		MII_OP(CLX)
 		{ // CLC, CLD, CLI, CLV
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			MII_SET_P_BIT(cpu, d.s_bit, 0);
-		}	break;
-		case 0xC9: case 0xC5: case 0xD5: case 0xCD: case 0xDD:
-		case 0xD9: case 0xC1: case 0xD1: case 0xD2:
+		}	MII_OP_END
+		MII_OP(CMP)
 		{ // CMP
 			cpu->P.C = !!(cpu->A >= cpu->_D);
 			uint8_t d = cpu->A - cpu->_D;
 			_NZ(d);
-		}	break;
-		case 0xE0: case 0xE4: case 0xEC:
+		}	MII_OP_END
+		MII_OP(CPX)
 		{ // CPX
 			cpu->P.C = !!(cpu->X >= cpu->_D);
 			uint8_t d = cpu->X - cpu->_D;
 			_NZ(d);
-		}	break;
-		case 0xC0: case 0xC4: case 0xCC:
+		}	MII_OP_END
+		MII_OP(CPY)
 		{ // CPY
 			cpu->P.C = !!(cpu->Y >= cpu->_D);
 			uint8_t d = cpu->Y - cpu->_D;
 			_NZ(d);
-		}	break;
-		case 0x3A:
+		}	MII_OP_END
+		MII_OP(DEC_A)
 		{ // DEC
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(--cpu->A);
-		}	break;
-		case 0xC6: case 0xD6: case 0xCE: case 0xDE:
+		}	MII_OP_END
+		MII_OP(DEC)
 		{ // DEC
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(--cpu->_D);
-		}	break;
-		case 0xCA:
+		}	MII_OP_END
+		MII_OP(DEX)
 		{ // DEX
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(--cpu->X);
-		}	break;
-		case 0x88:
+		}	MII_OP_END
+		MII_OP(DEY)
 		{ // DEY
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(--cpu->Y);
-		}	break;
-		case 0x49: case 0x45: case 0x55: case 0x4D: case 0x5D:
-		case 0x59: case 0x41: case 0x51: case 0x52:
+		}	MII_OP_END
+		MII_OP(EOR)
 		{ // EOR
 			cpu->A ^= cpu->_D;
 			_NZ(cpu->A);
-		}	break;
-		case 0x1A:
+		}	MII_OP_END
+		MII_OP(INC_A)
 		{ // INC (accumulator)
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(++cpu->A);
-		}	break;
-		case 0xE6: case 0xF6: case 0xEE: case 0xFE:
+		}	MII_OP_END
+		MII_OP(INC)
 		{ // INC
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(++cpu->_D);
-		}	break;
-		case 0xE8:
+		}	MII_OP_END
+		MII_OP(INX)
 		{ // INX
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(++cpu->X);
-		}	break;
-		case 0xC8:
+		}	MII_OP_END
+		MII_OP(INY)
 		{ // INY
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			_NZ(++cpu->Y);
-		}	break;
-		case 0x4C: case 0x6C: case 0x7C:
+		}	MII_OP_END
+		MII_OP(JMP)
 		{ // JMP
 			cpu->PC = cpu->_P;
-		}	break;
-		case 0x20:
+		}	MII_OP_END
+		MII_OP(JSR)
 		// https://github.com/AppleWin/AppleWin/issues/1257
 		{ // JSR
-			_FETCH(cpu->PC++);		cpu->_P = s.data;
+			_FETCH_PC(cpu->PC++);		cpu->_P = s.data;
 			_FETCH(0x0100 | cpu->S);
 			_STORE(0x0100 | cpu->S--, cpu->PC >> 8);
 			_STORE(0x0100 | cpu->S--, cpu->PC & 0xff);
-			_FETCH(cpu->PC++);		cpu->_P |= s.data << 8;
+			_FETCH_PC(cpu->PC++);		cpu->_P |= s.data << 8;
 			cpu->PC = cpu->_P;
-		}	break;
-		case 0xA9: case 0xA5: case 0xB5: case 0xAD: case 0xBD:
-		case 0xB9: case 0xA1: case 0xB1: case 0xB2:
+		}	MII_OP_END
+		MII_OP(LDA)
 		{ // LDA
 			cpu->A = cpu->_D;
 			_NZ(cpu->A);
-		}	break;
-		case 0xA2: case 0xA6: case 0xB6: case 0xAE: case 0xBE:
+		}	MII_OP_END
+		MII_OP(LDX)
 		{ // LDX
 			cpu->X = cpu->_D;
 			_NZ(cpu->X);
-		}	break;
-		case 0xA0: case 0xA4: case 0xB4: case 0xAC: case 0xBC:
+		}	MII_OP_END
+		MII_OP(LDY)
 		{ // LDY
 			cpu->Y = cpu->_D;
 			_NZ(cpu->Y);
-		}	break;
-		case 0x4A:
+		}	MII_OP_END
+		MII_OP(LSR_A)
 		{ // LSR
-			_FETCH(cpu->PC);
+			_FETCH_PC(cpu->PC);
 			cpu->P.C = !!(cpu->A & 0x01);
 			cpu->A >>= 1;
 			_NZ(cpu->A);
-		}	break;
-		case 0x46: case 0x56: case 0x4E: case 0x5E:
+		}	MII_OP_END
+		MII_OP(LSR)
 		{ // LSR
 			cpu->P.C = !!(cpu->_D & 0x01);
 			cpu->_D >>= 1;
 			_NZ(cpu->_D);
-		}	break;
-		case 0xEA:
+		}	MII_OP_END
+		MII_OP(NOP)
 		{ // NOP
-			_FETCH(cpu->PC);
-		}	break;
-		case 0x09: case 0x05: case 0x15: case 0x0D: case 0x1D:
-		case 0x19: case 0x01: case 0x11: case 0x12:
+			_FETCH_PC(cpu->PC);
+		}	MII_OP_END
+		MII_OP(ORA)
 		{ // ORA
 			cpu->A |= cpu->_D;
 			_NZ(cpu->A);
-		}	break;
-		case 0x48:
+		}	MII_OP_END
+		MII_OP(PHA)
 		{ // PHA
 			_STORE(0x0100 | cpu->S--, cpu->A); cpu->cycle++;
-		}	break;
-		case 0x08:
+		}	MII_OP_END
+		MII_OP(PHP)
 		{ // PHP
 			uint8_t p = 0;
 			MII_GET_P(cpu, p);
 			p |= (1 << B_B) | (1 << B_X);
 			_STORE(0x0100 | cpu->S--, p);	cpu->cycle++;
-		}	break;
-		case 0xDA:
+		}	MII_OP_END
+		MII_OP(PHX)
 		{ // PHX
 			_STORE(0x0100 | cpu->S--, cpu->X);cpu->cycle++;
-		}	break;
-		case 0x5A:
+		}	MII_OP_END
+		MII_OP(PHY)
 		{ // PHY
 			_STORE(0x0100 | cpu->S--, cpu->Y);cpu->cycle++;
-		}	break;
-		case 0x68:
+		}	MII_OP_END
+		MII_OP(PLA)
 		{ // PLA
 			_FETCH(0x0100 | ++cpu->S);cpu->cycle++;
 			cpu->A = s.data;cpu->cycle++;
 			_NZ(cpu->A);
-		}	break;
-		case 0x28:
+		}	MII_OP_END
+		MII_OP(PLP)
 		{ // PLP
 			_FETCH(0x0100 | ++cpu->S);cpu->cycle++;
 			MII_SET_P(cpu, s.data);cpu->cycle++;
-		}	break;
-		case 0xFA:
+		}	MII_OP_END
+		MII_OP(PLX)
 		{ // PLX
 			_FETCH(0x0100 | ++cpu->S);
 			cpu->X = s.data;
 			_NZ(cpu->X);
-		}	break;
-		case 0x7A:
+		}	MII_OP_END
+		MII_OP(PLY)
 		{ // PLY
 			_FETCH(0x0100 | ++cpu->S);
 			cpu->Y = s.data;
 			_NZ(cpu->Y);
-		}	break;
-		case 0x2A:
+		}	MII_OP_END
+		MII_OP(ROL_A)
 		{ // ROL immediate
-			_FETCH(cpu->PC);	// cycle++
+			_FETCH_PC(cpu->PC);	// cycle++
 			uint8_t c = cpu->P.C;
 			cpu->P.C = !!(cpu->A & 0x80);
 			cpu->A <<= 1;
 			cpu->A |= c;
 			_NZ(cpu->A);
-		}	break;
-		case 0x26: case 0x36: case 0x2E: case 0x3E:
+		}	MII_OP_END
+		MII_OP(ROL)
 		{ // ROL
 			uint8_t c = cpu->P.C;
 			cpu->P.C = !!(cpu->_D & 0x80);
 			cpu->_D <<= 1;
 			cpu->_D |= c;
 			_NZ(cpu->_D);
-		}	break;
-		case 0x6A:
+		}	MII_OP_END
+		MII_OP(ROR_A)
 		{ // ROR
-			_FETCH(cpu->PC);	// cycle++
+			_FETCH_PC(cpu->PC);	// cycle++
 			uint8_t c = cpu->P.C;
 			cpu->P.C = !!(cpu->A & 0x01);
 			cpu->A >>= 1;
 			cpu->A |= c << 7;
 			_NZ(cpu->A);
-		}	break;
-		case 0x66: case 0x76: case 0x6E: case 0x7E:
+		}	MII_OP_END
+		MII_OP(ROR)
 		{ // ROR
 			uint8_t c = cpu->P.C;
 			cpu->P.C = !!(cpu->_D & 0x01);
 			cpu->_D >>= 1;
 			cpu->_D |= c << 7;
 			_NZ(cpu->_D);
-		}	break;
-		case 0x40:
+		}	MII_OP_END
+		MII_OP(RTI)
 		{ // RTI
-			_FETCH(cpu->PC);	// dummy write
+			_FETCH_PC(cpu->PC);	// dummy write
 			cpu->S++; _FETCH(0x0100 | cpu->S);
 			// FD : Modified to set Break bit to 0 in order to pass Harte's tests .
 			for (int i = 0; i < 8; i++)
@@ -539,17 +761,16 @@ next_instruction:
 			cpu->S++; _FETCH(0x0100 | cpu->S);
 			cpu->_P |= s.data << 8;
 			cpu->PC = cpu->_P;
-		}	break;
-		case 0x60:
+		}	MII_OP_END
+		MII_OP(RTS)
 		{ // RTS
 			_FETCH(0x0100 | ((++cpu->S) & 0xff));cpu->cycle++;
 			cpu->_P = s.data;
 			_FETCH(0x0100 | ((++cpu->S) & 0xff));cpu->cycle++;
 			cpu->_P |= s.data << 8;
 			cpu->PC = cpu->_P + 1; cpu->cycle++;
-		}	break;
-		case 0xE9: case 0xE5: case 0xF5: case 0xED: case 0xFD:
-		case 0xF9: case 0xE1: case 0xF1: case 0xF2:
+		}	MII_OP_END
+		MII_OP(SBC)
 		{ // SBC
 			// Handle subbing in BCD with bit D
 			if (unlikely(cpu->P.D)) {
@@ -559,7 +780,6 @@ next_instruction:
 				uint8_t lo = (cpu->A & 0x0f) + (D & 0x0f) + !!cpu->P.C;
 				if (lo > 9) lo += 6;
 				uint8_t hi = (cpu->A >> 4) + (D >> 4) + (lo > 0x0f);
-				cpu->P.Z = ((uint8_t)(cpu->A + D + cpu->P.C)) == 0;
 				// that is 6502 behaviour
 //				cpu->P.N = !!(hi & 0xf8);
 				cpu->P.V = !!((!((cpu->A ^ D) & 0x80) &&
@@ -570,7 +790,7 @@ next_instruction:
 			//			cpu->A, D, !!cpu->P.C, hi & 0xf, lo & 0xf);
 				cpu->A = (hi << 4) | (lo & 0x0f);
 				// THAT is 65c02 behaviour
-				cpu->P.N = !!(cpu->A & 0x80);
+				_NZ(cpu->A);
 #else
 				// Decimal mode
 				// Perform decimal subtraction
@@ -607,107 +827,97 @@ next_instruction:
 				_NZC(sum);
 				cpu->A = sum;
 			}
-		}	break;
-		case 0x38: case 0xF8: case 0x78:
+		}	MII_OP_END
+		MII_OP(SEX)
 		{ // SEC, SED, SEI
 			MII_SET_P_BIT(cpu, d.s_bit, 1);
-		}	break;
-		case 0x85: case 0x95: case 0x8D: case 0x9D:
-		case 0x99: case 0x81: case 0x91: case 0x92:
+		}	MII_OP_END
+		MII_OP(STA)
 		{ // STA
 			cpu->_D = cpu->A;cpu->cycle++;
-		}	break;
-		case 0x86: case 0x96: case 0x8E:
+		}	MII_OP_END
+		MII_OP(STX)
 		{ // STX
 			cpu->_D = cpu->X;
-		}	break;
-		case 0x84: case 0x94: case 0x8C:
+		}	MII_OP_END
+		MII_OP(STY)
 		{ // STY
 			cpu->_D = cpu->Y;
-		}	break;
-		case 0x64: case 0x74: case 0x9C: case 0x9E:
+		}	MII_OP_END
+		MII_OP(STZ)
 		{ // STZ
 			cpu->_D = 0;
-		}	break;
-		case 0x14: case 0x1c:
+		}	MII_OP_END
+		MII_OP(TRB)
 		{	// TRB
-			cpu->P.Z = !(cpu->A & cpu->_D);
+			_Z(cpu->A & cpu->_D);
 			cpu->_D &= ~cpu->A;
-		}	break;
-		case 0x04: case 0x0c:
+		}	MII_OP_END
+		MII_OP(TSB)
 		{	// TSB
-			cpu->P.Z = !(cpu->A & cpu->_D);
+			_Z(cpu->A & cpu->_D);
 			cpu->_D |= cpu->A;
-		}	break;
-		case 0xAA:
+		}	MII_OP_END
+		MII_OP(TAX)
 		{ // TAX
 			cpu->X = cpu->A;cpu->cycle++;
 			_NZ(cpu->X);
-		}	break;
-		case 0xA8:
+		}	MII_OP_END
+		MII_OP(TAY)
 		{ // TAY
 			cpu->Y = cpu->A;cpu->cycle++;
 			_NZ(cpu->Y);
-		}	break;
-		case 0xBA:
+		}	MII_OP_END
+		MII_OP(TSX)
 		{ // TSX
 			cpu->X = cpu->S;cpu->cycle++;
 			_NZ(cpu->X);
-		}	break;
-		case 0x8A:
+		}	MII_OP_END
+		MII_OP(TXA)
 		{ // TXA
 			cpu->A = cpu->X;cpu->cycle++;
 			_NZ(cpu->A);
-		}	break;
-		case 0x9A:
+		}	MII_OP_END
+		MII_OP(TXS)
 		{ // TXS
 			cpu->S = cpu->X;cpu->cycle++;
-		}	break;
-		case 0x98:
+		}	MII_OP_END
+		MII_OP(TYA)
 		{ // TYA
 			cpu->A = cpu->Y;cpu->cycle++;
 			_NZ(cpu->A);
-		}	break;
-		case 0x07: case 0x17: case 0x27: case 0x37: case 0x47:
-		case 0x57: case 0x67: case 0x77: case 0x87: case 0x97:
-		case 0xA7: case 0xB7: case 0xC7: case 0xD7: case 0xE7:
-		case 0xF7:
+		}	MII_OP_END
+		MII_OP(XMB)
 		{ // RMB/SMB
 			cpu->_D = (cpu->_D & ~(1 << d.s_bit)) | (d.s_bit_value << d.s_bit);
-		}	break;
+		}	MII_OP_END
 		/* Apparently these NOPs use 3 bytes, according to the tests */
-		case 0x5c: case 0xdc: case 0xfc:
-			_FETCH(cpu->PC++);
-			// fall through
+		MII_OP(NOP3)
+			_FETCH_PC(cpu->PC++);
+			_FETCH_PC(cpu->PC++);
+			MII_OP_END
 		/* Apparently these NOPs use 2 bytes, according to the tests */
-		case 0x02: case 0x22: case 0x42: case 0x62: case 0x82:
-		case 0xC2: case 0xE2: case 0x44: case 0x54: case 0xD4:
-		case 0xF4:
-			_FETCH(cpu->PC++);	// consume that byte
-			break;
-		case 0xdb:
+		MII_OP(NOP2)
+			_FETCH_PC(cpu->PC++);	// consume that byte
+			MII_OP_END
+		MII_OP(STP)
 		// trap NOPs / STP (WDC)
-			_FETCH(cpu->PC++); // FD: Added to pass HARTE's test
-			break;
-		case 0xCB :
+			_FETCH_PC(cpu->PC++); // FD: Added to pass HARTE's test
+			MII_OP_END
+		MII_OP(NOP_XB)
 		// FD: Added to pass HARTE's test
 		// WAI for WDC65C02 not in R65C02
 		// FD: Added to properly pass HARTE's test
-		case 0x0B: case 0x1B: case 0x2B: case 0x3B: case 0x4B: case 0x5B:
-		case 0x6B: case 0x7B: case 0x8B: case 0x9B: case 0xAB: case 0xBB:
-		// these two are SPECIAL, 0xebfb is used as the 'trap' that calls
+		// 0xEB and 0xFB are SPECIAL, 0xebfb is used as the 'trap' that calls
 		// back into the emulator. This is used by the smartport driver
-		case 0xEB: case 0xFB:
-		case 0x03: case 0X13: case 0X23: case 0X33: case 0x43: case 0x53:
-		case 0x63: case 0x73: case 0x83: case 0x93: case 0xA3: case 0xB3:
-		case 0xC3: case 0xD3: case 0xE3: case 0xF3:
+		MII_OP(NOP_X3)
 			//  NOPs
-			break;
-		default:
+			MII_OP_END
+		MII_OP_DEFAULT
 			printf("%04x %02x UNKNOWN INSTRUCTION\n", cpu->PC, cpu->IR);
 		//	exit(1);
-			break;
-	}
+			MII_OP_END
+	MII_SWITCH_END(_mii_op)
 	if (d.w) {
 		_STORE(cpu->_P, cpu->_D);
 	}
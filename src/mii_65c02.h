@@ -13,9 +13,16 @@
 /*
  * This is pretty heavily dependant on the way bitfields are packed in
  * bytes, so it's not technically portable; if you have problems using a
- * strange compiler, undefine this and use the 'discrete' version below.
+ * strange compiler, set this to zero to use the 'lazy' version below.
+ * The lazy version doesn't compute N and Z for every instruction, it keeps
+ * the value they derive from, and only constructs them when P is read.
  */
+#ifndef MII_65C02_PACK_P
+#define MII_65C02_PACK_P			1
+#endif
+#if MII_65C02_PACK_P
 #define MII_PACK_P
+#endif
 
 /*
  * State structure used to 'talk' to the CPU emulator.
@@ -65,6 +72,15 @@ enum {
 #define MII_65C02_DIRECT_ACCESS		1
 #endif
 
+/*
+ * Use computed gotos through label tables to dispatch the addressing modes
+ * and opcodes, instead of the switch() statements. Set to zero to use the
+ * switch() version, which is functionally identical.
+ */
+#ifndef MII_65C02_THREADED
+#define MII_65C02_THREADED			1
+#endif
+
 #if MII_65C02_DIRECT_ACCESS
 struct mii_cpu_t;
 typedef mii_cpu_state_t (*mii_cpu_direct_access_cb)(
@@ -93,10 +109,13 @@ typedef struct mii_cpu_t {
 #else
 	/* My experience with simavr shows that maintaining a 8 bits bitfield
 	 * for a status register is a lot slower than having discrete flags
-	 * and 'constructing' the matching 8 bits register when needed */
+	 * and 'constructing' the matching 8 bits register when needed.
+	 * Here N and Z aren't flags, but the last value they were computed
+	 * from: N is bit 7 of _n, Z is set when _z is zero. Use the accessor
+	 * macros below to read/write them. */
 	union {
 		struct {
-			uint8_t 	C, Z, I, D, B, _R, V, N;
+			uint8_t 	C, _z, I, D, B, _R, V, _n;
 		};
 		uint8_t 	P[8];
 	}			P;
@@ -118,6 +137,11 @@ typedef struct mii_cpu_t {
 #if MII_65C02_DIRECT_ACCESS
 	mii_cpu_direct_access_cb access;
 	void *					access_param;	// typically struct mii_t*
+	/* Optional, host pointer to each of the 256 pages the CPU can fetch
+	 * its operands from without calling access(), or NULL. The opcode
+	 * fetch, and all the data accesses still go thru access(), but this is
+	 * not cycle exact anymore, as access() won't see the operand cycles */
+	uint8_t * const *		fetch;
 #else
 	/* State of the protothread for the CPU state machine (minipt.h) */
 	void *		state;
@@ -141,7 +165,7 @@ mii_cpu_run(
 
 #ifdef MII_PACK_P
 #define MII_SET_P(_cpu, _byte) { \
-			(_cpu)->P.P = (_byte & 0xEF) | 0x20; \
+			(_cpu)->P.P = ((_byte) & 0xEF) | 0x20; \
 		}                                   // FD: to pass HARTE's test : 0x20 instead of 0x30, unset Break Bit
 #define MII_GET_P(_cpu, _res) \
 		(_res) = (_cpu)->P.P
@@ -152,20 +176,41 @@ mii_cpu_run(
 #define MII_GET_P_BIT(_cpu, _bit) \
 		!!(((_cpu)->P.P & (1 << (_bit))))
 #else
+static inline uint8_t
+mii_cpu_get_p_bit(
+		const mii_cpu_t *cpu,
+		int bit)
+{
+	switch (bit) {
+		case 1:	return cpu->P.P[1] == 0;	// Z
+		case 7:	return cpu->P.P[7] >> 7;	// N
+		default: return cpu->P.P[bit];
+	}
+}
+static inline void
+mii_cpu_set_p_bit(
+		mii_cpu_t *cpu,
+		int bit,
+		int val)
+{
+	switch (bit) {
+		case 1:	cpu->P.P[1] = !val;	break;
+		case 7:	cpu->P.P[7] = val ? 0x80 : 0; break;
+		default: cpu->P.P[bit] = !!val; break;
+	}
+}
 #define MII_SET_P(_cpu, _byte) { \
-		const int __byte = _byte; \
+		const int __byte = ((_byte) & 0xEF) | 0x20; \
 		for (int _pi = 0; _pi < 8; _pi++) \
-			(_cpu)->P.P[_pi] = _pi == B_B || _pi == B_X || \
-						((__byte) & (1 << _pi)); \
-		}
+			mii_cpu_set_p_bit(_cpu, _pi, __byte & (1 << _pi)); \
+	}
 #define MII_GET_P(_cpu, _res) { \
 		(_res) = 0; \
 		for (int _pi = 0; _pi < 8; _pi++) \
-			(_res) |= (_cpu)->P.P[_pi] << _pi; \
-	}
-#define MII_SET_P_BIT(_cpu, _bit, _val) { \
-		(_cpu)->P.P[_bit] = _val; \
+			(_res) |= mii_cpu_get_p_bit(_cpu, _pi) << _pi; \
 	}
+#define MII_SET_P_BIT(_cpu, _bit, _val) \
+		mii_cpu_set_p_bit(_cpu, _bit, _val)
 #define MII_GET_P_BIT(_cpu, _bit) \
-		((_cpu)->P.P[_bit])
+		mii_cpu_get_p_bit(_cpu, _bit)
 #endif
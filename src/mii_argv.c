@@ -12,6 +12,8 @@
 #include <ctype.h>
 
 #include "mii.h"
+#include "mii_rewind.h"
+#include "mii_capture.h"
 
 extern mii_slot_drv_t * mii_slot_drv_list;
 
@@ -28,10 +30,24 @@ _mii_usage(
 	printf("  --list-drivers\tList available drivers, exit\n");
 	printf("  --list-roms\tList available ROMs, exit\n");
 	printf("  --video-rom <name>\tLoad a video ROM\n");
+	printf("  --indexed-video\tRender palette indexes, the host applies\n");
+	printf("\t\tthe palette and scanlines\n");
+	printf("  --video-thread\tRender the video lines on a separate thread\n");
 	printf("  -m, --mute\tMute the speaker\n");
 	printf("  -vol, --volume <volume>\tSet speaker volume (0.0 to 10.0)\n");
 	printf("  --audio-off, --no-audio, --silent\tDisable audio output\n");
+	printf("  --audio-latency <ms>\tTarget audio latency (default %d)\n",
+			MII_AUDIO_LATENCY_MS);
+	printf("  --audio-device <pcm>\tPlay directly on ALSA device <pcm>,\n");
+	printf("\t\tie 'default' or 'hw:0'\n");
+	printf("  --audio-periods <count>x<frames>\tALSA device periods,\n");
+	printf("\t\tie 2x128 (default 3x256)\n");
 	printf("  -speed, --speed <speed>\tSet the CPU speed in MHz\n");
+	printf("  --fast-fetch\tFetch CPU operands directly, faster but\n");
+	printf("\t\tnot cycle exact\n");
+	printf("  --rewind <seconds>\tKeep <seconds> of history to rewind\n");
+	printf("  --capture <base>\tCapture video and audio to\n");
+	printf("\t\t<base>.pam and <base>.wav\n");
 	printf("  -s, --slot <slot>:<driver>\tSpecify a slot and driver\n");
 	printf("\t\tSlot id is 1..7\n");
 	printf("  -d, --drive <slot>:<drive>:<filename>\tLoad a drive\n");
@@ -170,6 +186,10 @@ mii_argv_parse(
 				printf("mii: video rom %s not found\n", name);
 				return 1;
 			}
+		} else if (!strcmp(arg, "--indexed-video")) {
+			mii->video.indexed = 1;
+		} else if (!strcmp(arg, "--video-thread")) {
+			mii->video.threaded = 1;
 		} else if (!strcmp(arg, "-m") || !strcmp(arg, "--mute")) {
 			mii->audio.muted = true;
 		} else if (!strcmp(arg, "--audio-off") ||
@@ -177,6 +197,31 @@ mii_argv_parse(
 					!strcmp(arg, "--silent")) {
 			mii->audio.drv = NULL;
 			*ioFlags |= MII_INIT_SILENT;
+		} else if (!strcmp(arg, "--audio-latency")) {
+			if (i < argc-1) {
+				mii_audio_set_latency(&mii->audio, atof(argv[++i]));
+			} else {
+				printf("mii: missing latency value\n");
+				return 1;
+			}
+		} else if (!strcmp(arg, "--audio-device")) {
+			if (i < argc-1) {
+				mii->audio.device = argv[++i];
+			} else {
+				printf("mii: missing audio device\n");
+				return 1;
+			}
+		} else if (!strcmp(arg, "--audio-periods")) {
+			uint count = 0, frames = 0;
+			if (i < argc-1 &&
+					sscanf(argv[++i], "%ux%u", &count, &frames) == 2 &&
+					count >= 2 && frames >= 16) {
+				mii->audio.periods = count;
+				mii->audio.period_size = frames;
+			} else {
+				printf("mii: invalid audio periods, use <count>x<frames>\n");
+				return 1;
+			}
 		} else if (!strcmp(arg, "-vol") || !strcmp(arg, "--volume")) {
 			if (i < argc-1) {
 				float vol = atof(argv[++i]);
@@ -196,6 +241,23 @@ mii_argv_parse(
 				printf("mii: missing speed value\n");
 				return 1;
 			}
+		} else if (!strcmp(arg, "--fast-fetch")) {
+			mii->fast_fetch = 1;
+		} else if (!strcmp(arg, "--rewind")) {
+			if (i < argc-1) {
+				mii_rewind_init(mii, atoi(argv[++i]));
+			} else {
+				printf("mii: missing rewind seconds\n");
+				return 1;
+			}
+		} else if (!strcmp(arg, "--capture")) {
+			if (i < argc-1) {
+				if (mii_capture_start(mii, argv[++i]))
+					return 1;
+			} else {
+				printf("mii: missing capture file name\n");
+				return 1;
+			}
 		} else {
 			if (argv[i][0] == '-') {
 				char dup[128];
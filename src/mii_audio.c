@@ -12,6 +12,17 @@
 
 #include "mii.h"
 
+/* These two are read by the emulation thread, see mii_audio_clk_per_sample() */
+static void
+_mii_audio_set_rate(
+		mii_audio_sink_t *s,
+		float rate)
+{
+	float clk = s->clk_nominal * rate;
+	__atomic_store(&s->rate, &rate, __ATOMIC_RELAXED);
+	__atomic_store(&s->clk_per_sample, &clk, __ATOMIC_RELAXED);
+}
+
 void
 mii_audio_init(
 		struct mii_t *mii,
@@ -19,6 +30,8 @@ mii_audio_init(
 {
 	sink->drv = NULL;
 	sink->mii = mii;
+	sink->latency_ms = MII_AUDIO_LATENCY_MS;
+	sink->rate = 1.0f;
 	SLIST_INIT(&sink->source);
 	mii_audio_run(sink);
 }
@@ -53,6 +66,54 @@ mii_audio_start(
 		sink->drv->start(sink);
 }
 
+static float
+_mii_audio_clamp(
+		float v,
+		float max)
+{
+	return v > max ? max : v < -max ? -max : v;
+}
+
+/*
+ * The emulation is paced by its own timer, the device by its own clock;
+ * left alone, the FIFOs would slowly fill up (and drop samples) or run dry.
+ * This looks at how full the FIFOs being played are, and nudges the number
+ * of cycles per sample (by less than MII_AUDIO_RATE_MAX) to keep them at
+ * the target latency. It's a PI controller on the smoothed fill, as the
+ * emulation produces its samples in bursts, once per video frame.
+ */
+static void
+_mii_audio_regulate(
+		mii_audio_sink_t *s )
+{
+	mii_audio_source_t *source;
+	int fill = -1;
+
+	SLIST_FOREACH(source, &s->source, self) {
+		if (source->state != MII_AUDIO_PLAYING || !source->last_read)
+			continue;
+		int avail = mii_audio_frame_get_read_size(&source->fifo) /
+						source->channels;
+		if (avail > fill)
+			fill = avail;
+	}
+	if (fill < 0) {		// nothing playing, keep the current rate
+		s->fill = -1;
+		return;
+	}
+	if (s->fill < 0)
+		s->fill = fill;
+	else
+		s->fill += (fill - s->fill) * 0.05f;
+	float target = s->period + (s->latency_ms * MII_AUDIO_FREQ) / 1000.0f;
+	float error = (s->fill - target) / target;
+	s->rate_i = _mii_audio_clamp(s->rate_i + error * 0.00002f,
+					MII_AUDIO_RATE_MAX);
+	// too full: more cycles per sample, so fewer samples
+	_mii_audio_set_rate(s, 1.0f + _mii_audio_clamp(error * 0.005f + s->rate_i,
+					MII_AUDIO_RATE_MAX));
+}
+
 void
 mii_audio_run(
 		mii_audio_sink_t *s )
@@ -61,9 +122,137 @@ mii_audio_run(
 	// if CPU speed has changed, recalculate the number of cycles per sample
 	if (s->cpu_speed != s->mii->speed) {
 		s->cpu_speed = s->mii->speed;
-		s->clk_per_sample = ((1000000.0 * s->mii->speed) /
-					(float)MII_AUDIO_FREQ) + 0.5f;
+		s->clk_nominal = (1000000.0 * s->mii->speed) / (float)MII_AUDIO_FREQ;
+		_mii_audio_set_rate(s, 1.0f);
+		s->rate_i = 0;
+		s->fill = -1;
 		printf("%s: %.2f cycles per sample\n", __func__, s->clk_per_sample);
+		return;
+	}
+	_mii_audio_regulate(s);
+}
+
+void
+mii_audio_set_latency(
+		mii_audio_sink_t *sink,
+		float latency_ms)
+{
+	// the FIFOs hold a bit less than 100ms
+	if (latency_ms < 5)
+		latency_ms = 5;
+	else if (latency_ms > 50)
+		latency_ms = 50;
+	sink->latency_ms = latency_ms;
+}
+
+/*
+ * These are written so that -O3 vectorizes them (gcc does a better job at it
+ * than with its vector extensions); the output is interleaved stereo, the
+ * gains are per channel, so 'pan' is a balance control.
+ */
+static void
+_mii_audio_mix_mono(
+		float * restrict dst,
+		const mii_audio_sample_t * restrict src,
+		uint frames,
+		float gain_l,
+		float gain_r)
+{
+	// size_t, as gcc won't vectorize if the index can wrap around
+	for (size_t i = 0; i < frames; i++) {
+		dst[i * 2] += src[i] * gain_l;
+		dst[(i * 2) + 1] += src[i] * gain_r;
+	}
+}
+
+static void
+_mii_audio_mix_stereo(
+		float * restrict dst,
+		const mii_audio_sample_t * restrict src,
+		uint frames,
+		float gain_l,
+		float gain_r)
+{
+	for (size_t i = 0; i < frames; i++) {
+		dst[i * 2] += src[i * 2] * gain_l;
+		dst[(i * 2) + 1] += src[(i * 2) + 1] * gain_r;
+	}
+}
+
+/* Mix up to 'frames' frames of this source into 'mix', returns how many */
+static uint
+_mii_audio_mix_source(
+		mii_audio_sink_t *sink,
+		mii_audio_source_t *s,
+		float *mix,
+		uint frames)
+{
+	mii_audio_frame_t *f = &s->fifo;
+	uint avail = mii_audio_frame_get_read_size(f) / s->channels;
+	if (avail > frames)
+		avail = frames;
+	if (sink->muted) {	// just advance read pointer
+		mii_audio_frame_read_offset(f, avail * s->channels);
+		return 0;
+	}
+	/*
+	 * Wait for a full buffer of audio available before we start
+	 * taking it, otherwise we'd be padding the end of the frame
+	 * with zeroes, creating horrible click.
+	 * Once the engine is started, we're OK to take whatever is
+	 * available.
+	 */
+	if (!(s->last_read ? avail > 0 : avail == frames)) {
+		s->last_read = 0;
+		return 0;
+	}
+	float gain_l = s->vol_multiplier * (s->pan > 0 ? 1.0f - s->pan : 1.0f);
+	float gain_r = s->vol_multiplier * (s->pan < 0 ? 1.0f + s->pan : 1.0f);
+	uint done = 0;
+	while (done < avail) {
+		// the FIFO wraps around, stereo frames never straddle the end
+		uint n = (mii_audio_frame_fifo_size - f->read) / s->channels;
+		if (n > avail - done)
+			n = avail - done;
+		const mii_audio_sample_t *src = mii_audio_frame_read_ptr(f);
+		if (s->channels == 2)
+			_mii_audio_mix_stereo(mix + (done * 2), src, n, gain_l, gain_r);
+		else
+			_mii_audio_mix_mono(mix + (done * 2), src, n, gain_l, gain_r);
+		mii_audio_frame_read_offset(f, n * s->channels);
+		done += n;
+	}
+	s->last_read = done;
+	return done;
+}
+
+void
+mii_audio_mix(
+		mii_audio_sink_t *sink,
+		float *out,
+		uint frames,
+		uint channels)
+{
+	while (frames) {
+		uint n = frames > MII_AUDIO_MIX_FRAMES ? MII_AUDIO_MIX_FRAMES : frames;
+		float * restrict mix = sink->mix;
+		mii_audio_source_t *s;
+
+		memset(mix, 0, n * 2 * sizeof(mix[0]));
+		SLIST_FOREACH(s, &sink->source, self)
+			_mii_audio_mix_source(sink, s, mix, n);
+		// clip once, after all the sources are in
+		if (channels == 2) {
+			for (uint i = 0; i < n * 2; i++)
+				out[i] = mix[i] > 1.0f ? 1.0f : mix[i] < -1.0f ? -1.0f : mix[i];
+		} else {
+			for (uint i = 0; i < n; i++) {
+				float m = (mix[i * 2] + mix[(i * 2) + 1]) * 0.5f;
+				out[i] = m > 1.0f ? 1.0f : m < -1.0f ? -1.0f : m;
+			}
+		}
+		out += n * channels;
+		frames -= n;
 	}
 }
 
@@ -88,12 +277,24 @@ mii_audio_volume(
 	s->volume = volume;
 }
 
+void
+mii_audio_pan(
+		mii_audio_source_t *s,
+		float pan)
+{
+	if (pan < -1) pan = -1;
+	else if (pan > 1) pan = 1;
+	s->pan = pan;
+}
+
 void
 mii_audio_add_source(
 		mii_audio_sink_t *sink,
 		mii_audio_source_t *source)
 {
 	source->sink = sink;
+	if (!source->channels)
+		source->channels = 1;
 	mii_audio_volume(source, 5);
 	SLIST_INSERT_HEAD(&sink->source, source, self);
 }
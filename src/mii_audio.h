@@ -13,8 +13,16 @@
 #include "bsd_queue.h"
 
 #define MII_AUDIO_FREQ			(44100)
-// circular buffer
-#define MII_AUDIO_FRAME_SIZE  	4096
+// the sink always mixes to interleaved stereo
+#define MII_AUDIO_CHANNELS		2
+// circular buffer, in samples; stereo sources use two per frame
+#define MII_AUDIO_FRAME_SIZE  	8192
+// frames mixed at once, see mii_audio_mix()
+#define MII_AUDIO_MIX_FRAMES	1024
+// default target latency of the FIFOs, on top of the device buffer
+#define MII_AUDIO_LATENCY_MS	30
+// max deviation from the nominal sample rate, see mii_audio_run()
+#define MII_AUDIO_RATE_MAX		0.005f
 
 typedef float mii_audio_sample_t;
 
@@ -33,7 +41,8 @@ enum mii_audio_source_state_e {
 
 /*
  * A source of samples. It has a FIFO that source can fill up, and
- * it is attached to a sink that will consume the samples.
+ * it is attached to a sink that will consume the samples. A source is mono
+ * or stereo, stereo ones write interleaved left/right samples.
  * The state field is filed by the source itself, the audio sink uses
  * it to know when playing starts/stops for padding reasons.
  */
@@ -41,6 +50,8 @@ typedef struct mii_audio_source_t {
 	struct mii_audio_sink_t *		sink;
 	SLIST_ENTRY(mii_audio_source_t) self;
 	uint							state;
+	uint							channels;	// 1 or 2
+	float							pan;		// -1.0 (left) to 1.0 (right)
 	// mute (without having to the the volume to zero)
 	float			   				volume;			// volume, 0.0 to 10.0
 	float			  				vol_multiplier;	// 0.0 to 1.0
@@ -72,8 +83,74 @@ typedef struct mii_audio_sink_t {
 	float			  				cpu_speed;
 	// number of cycles per sample (at current CPU speed)
 	float			   				clk_per_sample;
+	/*
+	 * Rate control; the emulation and the audio device don't run on the
+	 * same clock, so clk_per_sample is clk_nominal scaled by 'rate' to
+	 * keep the FIFOs at latency_ms. 'period' is set by the driver, it's
+	 * the number of samples it reads at once.
+	 */
+	float							clk_nominal;
+	float							latency_ms;
+	uint							period;
+	float							fill;		// smoothed, in samples
+	float							rate_i;		// integral term
+	float							rate;
+	// rate and clk_per_sample are written by the audio thread, see below
+	/*
+	 * For the drivers that open the device themselves (see mii_alsa_audio.c)
+	 * device name, number and size (in frames) of periods; 0 for defaults.
+	 * The driver fills device_ms with the latency it got, and counts xruns.
+	 */
+	const char *					device;
+	uint							periods, period_size;
+	float							device_ms;
+	uint							xruns;
+	// optional, sees every frame written by the sources, see mii_capture.c
+	void (*tap)(
+				struct mii_audio_sink_t *sink,
+				mii_audio_source_t *source,
+				const mii_audio_sample_t *frame);
+	void *							tap_param;
+	// interleaved stereo mixing buffer, see mii_audio_mix()
+	float							mix[MII_AUDIO_MIX_FRAMES *
+										MII_AUDIO_CHANNELS]
+											__attribute__((aligned(32)));
 } mii_audio_sink_t;
 
+/* mii_audio_run() updates these on the audio thread, the emulation side
+ * reads them with these */
+static inline float
+mii_audio_clk_per_sample(
+		const mii_audio_sink_t *sink)
+{
+	float clk;
+	__atomic_load(&sink->clk_per_sample, &clk, __ATOMIC_RELAXED);
+	return clk;
+}
+
+static inline float
+mii_audio_rate(
+		const mii_audio_sink_t *sink)
+{
+	float rate;
+	__atomic_load(&sink->rate, &rate, __ATOMIC_RELAXED);
+	return rate;
+}
+
+/* Sources write their frames (source->channels samples) with this, so the
+ * sink's tap sees them. Only whole frames go in the FIFO */
+static inline void
+mii_audio_source_write(
+		mii_audio_source_t *source,
+		const mii_audio_sample_t *frame)
+{
+	if (mii_audio_frame_get_write_size(&source->fifo) >= source->channels)
+		for (uint i = 0; i < source->channels; i++)
+			mii_audio_frame_write(&source->fifo, frame[i]);
+	if (source->sink && source->sink->tap)
+		source->sink->tap(source->sink, source, frame);
+}
+
 void
 mii_audio_init(
 		struct mii_t *mii,
@@ -96,11 +173,30 @@ mii_audio_add_source(
 void
 mii_audio_start(
 		mii_audio_sink_t *sink );
+/* Called by the driver before each period, updates clk_per_sample */
 void
 mii_audio_run(
 		mii_audio_sink_t *sink );
+/* Called by the driver to fill a period, mixes 'frames' frames from the
+ * sources into 'out', interleaved, with 1 or 2 'channels' */
+void
+mii_audio_mix(
+		mii_audio_sink_t *sink,
+		float *out,
+		uint frames,
+		uint channels);
+// target latency, in milliseconds
+void
+mii_audio_set_latency(
+		mii_audio_sink_t *sink,
+		float latency_ms);
 // volume from 0 to 10, sets the audio sample multiplier.
 void
 mii_audio_volume(
 		mii_audio_source_t *source,
 		float volume);
+// balance, from -1 (left only) to 1 (right only), 0 is centered
+void
+mii_audio_pan(
+		mii_audio_source_t *source,
+		float pan);
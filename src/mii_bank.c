@@ -32,9 +32,12 @@ mii_bank_dispose(
 		mii_bank_t *bank)
 {
 //	printf("%s %s\n", __func__, bank->name);
-	if (bank->alloc)
+	if (bank->alloc) {
 		free(bank->mem);
+		free(bank->dirty);
+	}
 	bank->mem = NULL;
+	bank->dirty = NULL;
 	bank->alloc = 0;
 	if (bank->access) {
 		// Allow callback to free anything it wants
@@ -83,6 +86,10 @@ mii_bank_write(
 	if (mii_bank_access(bank, addr, data, len, true))
 		return;
 	uint32_t phy = bank->mem_offset + addr - bank->base;
+	if (bank->dirty) {
+		for (uint32_t p = phy >> 8; p <= (phy + len - 1) >> 8; p++)
+			bank->dirty[p] = 1;
+	}
 	do {
 		bank->mem[phy++] = *data++;
 	} while (likely(--len));
@@ -112,6 +119,21 @@ mii_bank_read(
 	} while (likely(--len));
 }
 
+uint16_t
+mii_bank_is_dirty(
+		const mii_bank_t *bank,
+		uint16_t addr1,
+		uint16_t addr2)
+{
+	uint32_t first = (bank->mem_offset + addr1 - bank->base) >> 8;
+	uint32_t last = (bank->mem_offset + addr2 - bank->base) >> 8;
+	if (!bank->dirty)
+		return last - first + 1;
+	uint16_t res = 0;
+	for (uint32_t p = first; p <= last; p++)
+		res += bank->dirty[p] != 0;
+	return res;
+}
 
 void
 mii_bank_install_access_cb(
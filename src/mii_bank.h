@@ -45,6 +45,9 @@ typedef struct mii_bank_t {
 	mii_bank_access_t * access;
 	uint8_t		*mem;
 	uint32_t 	mem_offset;
+	/* optional, one byte per 256 bytes page of 'mem', set when written to.
+	 * Banks sharing the same memory share the same map */
+	uint8_t		*dirty;
 } mii_bank_t;
 
 void
@@ -73,11 +76,13 @@ mii_bank_access(
 		uint16_t len,
 		bool write);
 
-/* return the number of pages dirty (written into since last time) between
- * addr1 and addr2 (inclusive) */
-uint8_t
+/* return the number of pages dirty (written into since the last snapshot)
+ * between addr1 and addr2 (inclusive). This doesn't clear them, that map
+ * belongs to the snapshot code, see MII_SNAP_SAVE_DIRTY. Banks without a
+ * dirty map always return all the pages in the range */
+uint16_t
 mii_bank_is_dirty(
-		mii_bank_t *bank,
+		const mii_bank_t *bank,
 		uint16_t addr1,
 		uint16_t addr2);
 void
@@ -0,0 +1,448 @@
+/*
+ * mii_capture.c
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "mii.h"
+#include "mii_capture.h"
+#include "fifo_declare.h"
+
+#define MII_CAPTURE_FRAMES		8		// video frames waiting to be written
+#define MII_CAPTURE_BLOCK		1024	// samples per audio block
+#define MII_CAPTURE_RING		16384	// audio mixing ring, in samples
+// samples kept in the ring for the sources that write late (speaker)
+#define MII_CAPTURE_LATENCY		4096
+#define MII_CAPTURE_SOURCES		4
+
+typedef struct mii_capture_frame_t {
+	uint64_t 			cycle;
+	uint8_t 			indexed;
+	mii_color_t 		palette[64];
+	uint32_t 			pixels[MII_VIDEO_WIDTH * MII_VIDEO_HEIGHT];
+	uint8_t 			index_pixels[MII_VIDEO_WIDTH * (MII_VIDEO_HEIGHT / 2)];
+} mii_capture_frame_t;
+
+typedef struct mii_capture_block_t {
+	uint64_t 			cycle;		// of the first sample
+	float 				sample[MII_CAPTURE_BLOCK];
+} mii_capture_block_t;
+
+DECLARE_FIFO(mii_capture_frame_t *, mii_capture_frame_fifo, 16);
+DEFINE_FIFO(mii_capture_frame_t *, mii_capture_frame_fifo);
+DECLARE_FIFO(mii_capture_block_t, mii_capture_block_fifo, 64);
+DEFINE_PTR_FIFO(mii_capture_block_t, mii_capture_block_fifo);
+
+typedef struct mii_capture_t {
+	mii_t *				mii;
+	FILE *				video, *audio;
+	pthread_t 			thread;
+	sem_t 				wake;
+	// a frame/block was released, if 'waiting' for one, see _mii_capture_wait
+	sem_t 				frame_done, block_done;
+	volatile int 		quit, frame_waiting, block_waiting;
+	mii_capture_stats_t stats;
+	// frames go from 'free' to 'full', and back once written
+	mii_capture_frame_fifo_t free, full;
+	mii_capture_frame_t * frame[MII_CAPTURE_FRAMES];
+	mii_capture_block_fifo_t blocks;
+	// audio mixing, on the emulation thread
+	uint64_t 			start_cycle;	// cycle of sample 0
+	uint64_t 			flushed;		// samples sent to the writer
+	struct {
+		mii_audio_source_t * source;
+		uint64_t 			pos;		// of its next sample
+	}					src[MII_CAPTURE_SOURCES];
+	float 				ring[MII_CAPTURE_RING];
+	// writer thread
+	uint32_t 			samples;		// written to the WAV file
+	uint64_t 			audio_cycle;	// of the first one
+	uint8_t 			rgb[MII_VIDEO_WIDTH * MII_VIDEO_HEIGHT * 3];
+} mii_capture_t;
+
+/* WAV header, 32 bits float mono, with a 'fact' chunk as non PCM needs it */
+enum {
+	MII_WAV_RIFF_SIZE 	= 4,
+	MII_WAV_FACT_COUNT 	= 46,
+	MII_WAV_DATA_SIZE 	= 54,
+	MII_WAV_HEADER 		= 58,
+};
+
+static void
+_mii_capture_le(
+		uint8_t *p,
+		uint32_t v,
+		int size)
+{
+	for (int i = 0; i < size; i++, v >>= 8)
+		p[i] = v;
+}
+
+static void
+_mii_capture_wav_header(
+		mii_capture_t *c,
+		uint32_t riff_size)
+{
+	uint8_t h[MII_WAV_HEADER];
+	memcpy(h + 0, "RIFF", 4);
+	_mii_capture_le(h + MII_WAV_RIFF_SIZE, riff_size, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	_mii_capture_le(h + 16, 18, 4);
+	_mii_capture_le(h + 20, 3, 2);					// IEEE float
+	_mii_capture_le(h + 22, 1, 2);					// channels
+	_mii_capture_le(h + 24, MII_AUDIO_FREQ, 4);
+	_mii_capture_le(h + 28, MII_AUDIO_FREQ * sizeof(float), 4);
+	_mii_capture_le(h + 32, sizeof(float), 2);		// block align
+	_mii_capture_le(h + 34, 32, 2);					// bits per sample
+	_mii_capture_le(h + 36, 0, 2);					// extension size
+	memcpy(h + 38, "fact", 4);
+	_mii_capture_le(h + 42, 4, 4);
+	_mii_capture_le(h + MII_WAV_FACT_COUNT, c->samples, 4);
+	memcpy(h + 50, "data", 4);
+	_mii_capture_le(h + MII_WAV_DATA_SIZE, c->samples * sizeof(float), 4);
+	fseek(c->audio, 0, SEEK_SET);
+	fwrite(h, sizeof(h), 1, c->audio);
+}
+
+/* Add a LIST/INFO chunk with the cycle of the first sample, fix the sizes */
+static void
+_mii_capture_wav_close(
+		mii_capture_t *c)
+{
+	char cmt[64];
+	int len = snprintf(cmt, sizeof(cmt), "start cycle %lu",
+					(unsigned long)c->audio_cycle) + 1;
+	len = (len + 1) & ~1;	// chunks are word aligned
+	uint8_t h[20];
+	memcpy(h, "LIST", 4);
+	_mii_capture_le(h + 4, 4 + 8 + len, 4);
+	memcpy(h + 8, "INFOICMT", 8);
+	_mii_capture_le(h + 16, len, 4);
+	fseek(c->audio, 0, SEEK_END);
+	fwrite(h, sizeof(h), 1, c->audio);
+	fwrite(cmt, len, 1, c->audio);
+	uint32_t riff = MII_WAV_HEADER - 8 + (c->samples * sizeof(float)) +
+						sizeof(h) + len;
+	_mii_capture_wav_header(c, riff);
+	fclose(c->audio);
+}
+
+static void
+_mii_capture_write_frame(
+		mii_capture_t *c,
+		mii_capture_frame_t *f)
+{
+	fprintf(c->video, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 3\nMAXVAL 255\n"
+				"TUPLTYPE RGB\n# cycle %lu\nENDHDR\n",
+				MII_VIDEO_WIDTH, MII_VIDEO_HEIGHT, (unsigned long)f->cycle);
+	uint8_t * d = c->rgb;
+	for (int y = 0; y < MII_VIDEO_HEIGHT; y++) {
+		for (int x = 0; x < MII_VIDEO_WIDTH; x++, d += 3) {
+			mii_color_t p;
+			// indexed frames get their scanlines here, like the GL shader
+			if (f->indexed)
+				p = f->palette[f->index_pixels[(y / 2) * MII_VIDEO_WIDTH + x] |
+							((y & 1) ? MII_VIDEO_INDEX_MASK : 0)];
+			else
+				p = f->pixels[y * MII_VIDEO_WIDTH + x];
+			d[0] = p;
+			d[1] = p >> 8;
+			d[2] = p >> 16;
+		}
+	}
+	fwrite(c->rgb, sizeof(c->rgb), 1, c->video);
+}
+
+static void *
+_mii_capture_thread(
+		void *param)
+{
+	mii_capture_t * c = param;
+
+	do {
+		while (!mii_capture_frame_fifo_isempty(&c->full)) {
+			mii_capture_frame_t * f = mii_capture_frame_fifo_read(&c->full);
+			_mii_capture_write_frame(c, f);
+			c->stats.frames++;
+			mii_capture_frame_fifo_write(&c->free, f);
+			__sync_synchronize();
+			if (c->frame_waiting)
+				sem_post(&c->frame_done);
+		}
+		while (!mii_capture_block_fifo_isempty(&c->blocks)) {
+			mii_capture_block_t * b = mii_capture_block_fifo_read_ptr(&c->blocks);
+			if (!c->samples)
+				c->audio_cycle = b->cycle;
+			fwrite(b->sample, sizeof(b->sample), 1, c->audio);
+			c->samples += MII_CAPTURE_BLOCK;
+			c->stats.blocks++;
+			mii_capture_block_fifo_read_offset(&c->blocks, 1);
+			__sync_synchronize();
+			if (c->block_waiting)
+				sem_post(&c->block_done);
+		}
+		// whatever was queued before stopping is still written
+		if (c->quit)
+			break;
+		sem_wait(&c->wake);
+	} while (1);
+	return NULL;
+}
+
+/*
+ * Without an audio driver (headless) there is no real time to keep up
+ * with, so the emulation waits for the writer to release a frame (or an
+ * audio block) instead of dropping it.
+ */
+static void
+_mii_capture_wait(
+		mii_capture_t *c,
+		bool frame)
+{
+	sem_t * done = frame ? &c->frame_done : &c->block_done;
+	volatile int * waiting = frame ? &c->frame_waiting : &c->block_waiting;
+
+	while (sem_trywait(done) == 0)	// stale posts
+		;
+	*waiting = 1;
+	__sync_synchronize();
+	while (frame ? mii_capture_frame_fifo_isempty(&c->free) :
+				mii_capture_block_fifo_isfull(&c->blocks)) {
+		sem_post(&c->wake);
+		sem_wait(done);
+	}
+	*waiting = 0;
+}
+
+/* Called with each video frame, on the thread that draws them */
+static void
+_mii_capture_frame_hook(
+		mii_video_t *video,
+		const mii_video_frame_t *frame,
+		void *param)
+{
+	mii_capture_t * c = param;
+
+	if (mii_capture_frame_fifo_isempty(&c->free)) {
+		if (c->mii->audio.drv) {	// real time, don't hold up the UI
+			c->stats.frames_dropped++;
+			return;
+		}
+		_mii_capture_wait(c, true);
+	}
+	mii_capture_frame_t * f = mii_capture_frame_fifo_read(&c->free);
+	f->cycle = frame->cycle;
+	f->indexed = frame->indexed;
+	if (f->indexed) {
+		memcpy(f->palette, frame->palette, sizeof(f->palette));
+		memcpy(f->index_pixels, frame->index_pixels, sizeof(f->index_pixels));
+	} else
+		memcpy(f->pixels, frame->pixels, sizeof(f->pixels));
+	mii_capture_frame_fifo_write(&c->full, f);
+	sem_post(&c->wake);
+}
+
+/* Send the mixed samples before 'upto' to the writer */
+static void
+_mii_capture_audio_flush(
+		mii_capture_t *c,
+		uint64_t upto)
+{
+	float clk = mii_audio_clk_per_sample(&c->mii->audio);
+
+	while (c->flushed + MII_CAPTURE_BLOCK <= upto) {
+		float * s = c->ring + (c->flushed % MII_CAPTURE_RING);
+		if (mii_capture_block_fifo_isfull(&c->blocks) && !c->mii->audio.drv)
+			_mii_capture_wait(c, false);
+		if (mii_capture_block_fifo_isfull(&c->blocks))
+			c->stats.blocks_dropped++;
+		else {
+			mii_capture_block_t * b =
+					mii_capture_block_fifo_write_ptr(&c->blocks);
+			b->cycle = c->start_cycle + (uint64_t)(c->flushed * clk);
+			for (int i = 0; i < MII_CAPTURE_BLOCK; i++)
+				b->sample[i] = s[i] > 1.0f ? 1.0f :
+								s[i] < -1.0f ? -1.0f : s[i];
+			mii_capture_block_fifo_write_offset(&c->blocks, 1);
+			sem_post(&c->wake);
+		}
+		memset(s, 0, MII_CAPTURE_BLOCK * sizeof(*s));
+		c->flushed += MII_CAPTURE_BLOCK;
+	}
+}
+
+/* current sample position, from the CPU cycles */
+static uint64_t
+_mii_capture_audio_now(
+		mii_capture_t *c)
+{
+	float clk = mii_audio_clk_per_sample(&c->mii->audio);
+	if (clk < 1)	// audio not running yet
+		return 0;
+	return (c->mii->cpu.total_cycle - c->start_cycle) / clk;
+}
+
+/*
+ * Called for each frame written by the audio sources. Each source has its
+ * own position in the mixing ring; it follows the samples it writes, and
+ * is moved to the current cycle when it starts again after being silent.
+ */
+static void
+_mii_capture_tap(
+		mii_audio_sink_t *sink,
+		mii_audio_source_t *source,
+		const mii_audio_sample_t *frame)
+{
+	mii_capture_t * c = sink->tap_param;
+	int si = 0;
+
+	for (; si < MII_CAPTURE_SOURCES; si++)
+		if (!c->src[si].source || c->src[si].source == source)
+			break;
+	if (si == MII_CAPTURE_SOURCES)
+		return;
+	c->src[si].source = source;
+	uint64_t now = _mii_capture_audio_now(c);
+	uint64_t * pos = &c->src[si].pos;
+	if (*pos + MII_CAPTURE_LATENCY < now)
+		*pos = now;
+	if (*pos < c->flushed)
+		*pos = c->flushed;
+	if (*pos < c->flushed + MII_CAPTURE_RING) {
+		// the capture is mono, stereo sources are down mixed
+		mii_audio_sample_t sample = frame[0];
+		if (source->channels == 2)
+			sample = (frame[0] + frame[1]) * 0.5f;
+		if (!sink->muted)
+			c->ring[*pos % MII_CAPTURE_RING] +=
+					sample * source->vol_multiplier;
+		(*pos)++;
+	}
+	// without a driver (headless) nobody else empties the source fifos
+	if (!sink->drv)
+		mii_audio_frame_read_offset(&source->fifo, source->channels);
+}
+
+int
+mii_capture_start(
+		mii_t *mii,
+		const char *base)
+{
+	mii_capture_stop(mii);
+
+	char path[1024];
+	mii_capture_t * c = calloc(1, sizeof(*c));
+	c->mii = mii;
+	snprintf(path, sizeof(path), "%s.pam", base);
+	c->video = fopen(path, "wb");
+	if (!c->video) {
+		perror(path);
+		goto error;
+	}
+	snprintf(path, sizeof(path), "%s.wav", base);
+	c->audio = fopen(path, "wb");
+	if (!c->audio) {
+		perror(path);
+		goto error;
+	}
+	_mii_capture_wav_header(c, 0);
+	for (int i = 0; i < MII_CAPTURE_FRAMES; i++) {
+		c->frame[i] = malloc(sizeof(*c->frame[i]));
+		mii_capture_frame_fifo_write(&c->free, c->frame[i]);
+	}
+	c->start_cycle = mii->cpu.total_cycle;
+	sem_init(&c->wake, 0, 0);
+	sem_init(&c->frame_done, 0, 0);
+	sem_init(&c->block_done, 0, 0);
+	if (pthread_create(&c->thread, NULL, _mii_capture_thread, c)) {
+		perror(__func__);
+		sem_destroy(&c->wake);
+		sem_destroy(&c->frame_done);
+		sem_destroy(&c->block_done);
+		goto error;
+	}
+	mii->capture = c;
+	mii->audio.tap_param = c;
+	mii->audio.tap = _mii_capture_tap;
+	mii->video.frame_hook.param = c;
+	mii->video.frame_hook.cb = _mii_capture_frame_hook;
+	printf("%s: capturing to %s.pam/.wav\n", __func__, base);
+	return 0;
+error:
+	if (c->video)
+		fclose(c->video);
+	if (c->audio)
+		fclose(c->audio);
+	for (int i = 0; i < MII_CAPTURE_FRAMES; i++)
+		free(c->frame[i]);
+	free(c);
+	return -1;
+}
+
+void
+mii_capture_frame(
+		mii_t *mii)
+{
+	mii_capture_t * c = mii->capture;
+	uint64_t now = _mii_capture_audio_now(c);
+	if (now > MII_CAPTURE_LATENCY)
+		_mii_capture_audio_flush(c, now - MII_CAPTURE_LATENCY);
+}
+
+int
+mii_capture_stop(
+		mii_t *mii)
+{
+	mii_capture_t * c = mii->capture;
+	if (!c)
+		return 0;
+	// let the render thread finish the frames it has queued, with the hook
+	mii_video_sync(mii);
+	mii->video.frame_hook.cb = NULL;
+	mii->audio.tap = NULL;
+	// flush the ring, up to the last sample written
+	uint64_t end = _mii_capture_audio_now(c);
+	for (int i = 0; i < MII_CAPTURE_SOURCES; i++)
+		if (c->src[i].source && c->src[i].pos > end)
+			end = c->src[i].pos;
+	end = (end + MII_CAPTURE_BLOCK - 1) & ~(MII_CAPTURE_BLOCK - 1);
+	if (end > c->flushed + MII_CAPTURE_RING)	// can't be more than that
+		end = c->flushed + MII_CAPTURE_RING;
+	_mii_capture_audio_flush(c, end);
+	c->quit = 1;
+	sem_post(&c->wake);
+	pthread_join(c->thread, NULL);
+	sem_destroy(&c->wake);
+	sem_destroy(&c->frame_done);
+	sem_destroy(&c->block_done);
+
+	fclose(c->video);
+	_mii_capture_wav_close(c);
+	printf("%s: %u frames (%u dropped), %u audio blocks (%u dropped)\n",
+			__func__, c->stats.frames, c->stats.frames_dropped,
+			c->stats.blocks, c->stats.blocks_dropped);
+	int res = c->stats.frames_dropped || c->stats.blocks_dropped ? -1 : 0;
+	for (int i = 0; i < MII_CAPTURE_FRAMES; i++)
+		free(c->frame[i]);
+	free(c);
+	mii->capture = NULL;
+	return res;
+}
+
+int
+mii_capture_stats(
+		mii_t *mii,
+		mii_capture_stats_t *stats)
+{
+	if (!mii->capture)
+		return -1;
+	*stats = mii->capture->stats;
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * mii_capture.h
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Lossless capture of the video and audio output. Every video frame is
+ * written to <base>.pam, as a stream of 560x384 RGB PAM images, each with
+ * a '# cycle <n>' comment in its header. The mixed speaker and mockingboard
+ * samples are written to <base>.wav, 32 bits float mono (stereo sources
+ * are down mixed), with the cycle of the first sample in its comment.
+ *
+ * The files are written by a separate thread. With an audio driver, if it
+ * can't keep up, frames and audio blocks are dropped, the emulation never
+ * waits for it; without one (headless) the emulation waits instead.
+ * ffmpeg can read both, ie:
+ *   ffmpeg -f image2pipe -c:v pam -r 60 -i out.pam -i out.wav out.mkv
+ */
+struct mii_t;
+
+typedef struct mii_capture_stats_t {
+	uint32_t			frames, frames_dropped;
+	uint32_t			blocks, blocks_dropped;	// audio
+} mii_capture_stats_t;
+
+/* Start capturing to <base>.pam and <base>.wav. Returns 0, or -1 on
+ * errors. This has to be called from the thread that runs the emulation */
+int
+mii_capture_start(
+		struct mii_t *mii,
+		const char *base);
+/* Flush and close the files, this is called by mii_dispose() too.
+ * Returns -1 if frames or audio blocks were dropped, 0 otherwise */
+int
+mii_capture_stop(
+		struct mii_t *mii);
+/* Called by mii_run_until() at the end of each frame, to flush the audio */
+void
+mii_capture_frame(
+		struct mii_t *mii);
+/* Returns 0 and the current counters, or -1 if not capturing */
+int
+mii_capture_stats(
+		struct mii_t *mii,
+		mii_capture_stats_t *stats);
@@ -19,6 +19,7 @@
 #include "mii_65c02_ops.h"
 #include "mii_65c02_disasm.h"
 #include "mii_rom.h"
+#include "mii_rewind.h"
 
 void
 mii_hexdump(
@@ -205,11 +206,15 @@ show_state:
 	}
 	if (!strcmp(argv[1], "timers")) {
 		uint64_t timer = mii->timer.map;
-		printf("mii: %d cycle timers\n", __builtin_popcountll(timer));
+		printf("mii: %d cycle timers, %d running, now %lu\n",
+				__builtin_popcountll(timer), mii->timer.count,
+				(unsigned long)mii->timer.now);
 		while (timer) {
 			int i = ffsll(timer) - 1;
 			timer &= ~(1ull << i);
-			printf("%2d: %8ld %s\n", i, mii->timer.timers[i].when,
+			printf("%2d: %8ld %c %s\n", i, mii_timer_get(mii, i),
+					mii->timer.timers[i].index == 0 ? '*' :
+						mii->timer.timers[i].index == 0xff ? ' ' : '+',
 					mii->timer.timers[i].name);
 		}
 		return;
@@ -246,11 +251,12 @@ _mii_mish_bp(
 	if (!argv[1] || !strcmp(argv[1], "list")) {
 		printf("breakpoints: map %04x\n", mii->debug.bp_map);
 		for (int i = 0; i < (int)sizeof(mii->debug.bp_map)*8; i++) {
-			printf("%2d %c %04x %c%c%c size:%2d\n", i,
+			printf("%2d %c %04x %c%c%c%c size:%2d\n", i,
 					(mii->debug.bp_map & (1 << i)) ? '*' : ' ',
 					mii->debug.bp[i].addr,
 					(mii->debug.bp[i].kind & MII_BP_R) ? 'r' : '-',
 					(mii->debug.bp[i].kind & MII_BP_W) ? 'w' : '-',
+					(mii->debug.bp[i].kind & MII_BP_PC) ? 'x' : '-',
 					(mii->debug.bp[i].kind & MII_BP_STICKY) ? 's' : '-',
 					mii->debug.bp[i].size);
 		}
@@ -265,6 +271,8 @@ _mii_mish_bp(
 			kind |= MII_BP_R;
 		if (strchr(p, 'w'))
 			kind |= MII_BP_W;
+		if (strchr(p, 'x'))
+			kind |= MII_BP_PC;
 		if (strchr(p, 's'))
 			kind |= MII_BP_STICKY;
 		if (!kind || kind == MII_BP_STICKY)
@@ -489,10 +497,21 @@ _mii_mish_audio(
 {
 	mii_t * mii = param;
 	if (argc < 2) {
-		printf("audio volume: %.3f multiplier:%.3f muted:%d\n",
+		printf("audio volume: %.3f multiplier:%.3f pan:%.2f muted:%d\n",
 					mii->speaker.source.volume,
 					mii->speaker.source.vol_multiplier,
+					mii->speaker.source.pan,
 					mii->audio.muted);
+		printf("audio latency: %.0fms fill:%.0f rate:%.5f "
+					"clk/sample:%.3f\n",
+					mii->audio.latency_ms, mii->audio.fill,
+					mii_audio_rate(&mii->audio),
+					mii_audio_clk_per_sample(&mii->audio));
+		if (mii->audio.device)
+			printf("audio device: %s %ux%u frames, %.1fms xruns:%u\n",
+					mii->audio.device, mii->audio.periods,
+					mii->audio.period_size, mii->audio.device_ms,
+					mii->audio.xruns);
 		return;
 	}
 	if (!strcmp(argv[1], "record")) {
@@ -517,6 +536,13 @@ _mii_mish_audio(
 		else if (!argv[2] || (argv[2] && !strcmp(argv[2], "toggle")))
 			mii->audio.muted = !mii->audio.muted;
 		printf("audio: %s\n", mii->audio.muted ? "muted" : "unmuted");
+	} else if (!strcmp(argv[1], "latency")) {
+		if (argc < 3) {
+			printf("audio: missing latency\n");
+			return;
+		}
+		mii_audio_set_latency(&mii->audio, atof(argv[2]));
+		printf("audio: latency %.0fms\n", mii->audio.latency_ms);
 	} else if (!strcmp(argv[1], "volume")) {
 		if (argc < 3) {
 			printf("audio: missing volume\n");
@@ -529,11 +555,45 @@ _mii_mish_audio(
 		mii_audio_volume(&mii->speaker.source, vol);
 		printf("audio: volume %.3f (amp: %.4f)\n",
 					vol, mii->speaker.source.vol_multiplier);
+	} else if (!strcmp(argv[1], "pan")) {
+		if (argc < 3) {
+			printf("audio: missing pan\n");
+			return;
+		}
+		mii_audio_pan(&mii->speaker.source, atof(argv[2]));
+		printf("audio: pan %.2f\n", mii->speaker.source.pan);
 	} else {
 		printf("audio: unknown command %s\n", argv[1]);
 	}
 }
 
+static void
+_mii_mish_rewind(
+		void * param,
+		int argc,
+		const char * argv[])
+{
+	mii_t * mii = param;
+	mii_rewind_t * rw = mii->rewind;
+	if (!rw) {
+		printf("rewind: not enabled, use --rewind <seconds>\n");
+		return;
+	}
+	if (argc < 2) {
+		printf("rewind: %.2fs of %ds, %uKB of deltas\n",
+				rw->count / (float)MII_REWIND_FPS, rw->max / MII_REWIND_FPS,
+				(unsigned)(rw->size / 1024));
+		return;
+	}
+	float seconds = atof(argv[1]);
+	if (seconds <= 0) {
+		printf("rewind: invalid number of seconds %s\n", argv[1]);
+		return;
+	}
+	mii_rewind_request(mii, seconds * MII_REWIND_FPS);
+	printf("rewind: going back %.2fs\n", seconds);
+}
+
 static void
 _mii_mish_bsave(
 		void * param,
@@ -580,6 +640,9 @@ _mii_mish_bsave(
 		mii_bank_t * bank = &mii->bank[MII_BANK_MAIN];
 		fread(bank->mem + addr, size, 1, f);
 		fclose(f);
+		if (size)	// bypassed mii_bank_write(), so mark the pages
+			memset(bank->dirty + (addr >> 8), 1,
+					((addr + size - 1) >> 8) - (addr >> 8) + 1);
 		printf("bsave: %s loaded %d bytes at %04x\n", file, size, addr);
 	} else {
 		printf("%s: unknown command\n", argv[0]);
@@ -602,7 +665,7 @@ MISH_CMD_HELP(mii,
 		" speed <speed> : set speed in MHz",
 		" stop : stop the cpu",
 		" quit|exit : quit the emulator",
-		" timers : list active timers",
+		" timers : list timers, * is the next to fire, + running",
 		" roms : list loaded roms",
 		" irq : list active IRQs"
 		);
@@ -612,7 +675,7 @@ MISH_CMD_NAMES(bp, "bp");
 MISH_CMD_HELP(bp,
 		"mii: breakpoints. 'sticky' means the breakpoint is re-armed after hit",
 		" <default> : dump state",
-		" +<addr>[r|w][s] [size]: add at <addr> for read/write, sticky",
+		" +<addr>[r|w|x][s] [size]: add at <addr> for read/write/execute, sticky",
 		" -<index> : disable (don't clear) breakpoint <index>"
 		);
 MII_MISH(bp, _mii_mish_bp);
@@ -676,7 +739,9 @@ MISH_CMD_HELP(audio,
 		"audio: audio control/debug",
 		" record: record/stop debug file.",
 		" mute: mute/unmute audio.",
-		" volume: set volume (0.0 to 1.0)."
+		" latency <ms>: target latency of the audio FIFOs.",
+		" volume: set volume (0.0 to 1.0).",
+		" pan <-1.0 to 1.0>: speaker balance, 0 is centered."
 		);
 MII_MISH(audio, _mii_mish_audio);
 
@@ -688,3 +753,11 @@ MISH_CMD_HELP(bsave,
 		" bload <file> <addr>: load binary data from file."
 		);
 MII_MISH(bsave, _mii_mish_bsave);
+
+MISH_CMD_NAMES(rewind, "rewind");
+MISH_CMD_HELP(rewind,
+		"rewind: go back in time, needs --rewind <seconds>",
+		" <default> : show how much history is available",
+		" <seconds> : rewind <seconds> (can be fractional)"
+		);
+MII_MISH(rewind, _mii_mish_rewind);
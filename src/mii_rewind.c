@@ -0,0 +1,148 @@
+/*
+ * mii_rewind.c
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mii.h"
+#include "mii_snapshot.h"
+#include "mii_rewind.h"
+
+static void
+_mii_rewind_flush(
+		mii_rewind_t *rw)
+{
+	for (uint32_t i = 0; i < rw->count; i++)
+		free(rw->frame[(rw->first + i) % rw->max].delta);
+	rw->first = rw->count = 0;
+	rw->size = 0;
+}
+
+void
+mii_rewind_init(
+		mii_t *mii,
+		uint32_t seconds)
+{
+	mii_rewind_dispose(mii);
+	if (!seconds)
+		return;
+	mii_rewind_t *rw = calloc(1, sizeof(*rw));
+	rw->max = seconds * MII_REWIND_FPS;
+	rw->frame = calloc(rw->max, sizeof(*rw->frame));
+	mii->rewind = rw;
+}
+
+void
+mii_rewind_dispose(
+		mii_t *mii)
+{
+	mii_rewind_t *rw = mii->rewind;
+	if (!rw)
+		return;
+	_mii_rewind_flush(rw);
+	mii_snapshot_free(rw->head);
+	free(rw->frame);
+	free(rw);
+	mii->rewind = NULL;
+}
+
+/* true if both snapshots are for the same machine configuration */
+static bool
+_mii_rewind_same_conf(
+		const mii_snapshot_t *a,
+		const mii_snapshot_t *b)
+{
+	const mii_snap_chunk_t *ca = mii_snap_find(a, MII_SNAP_CONF, 0);
+	const mii_snap_chunk_t *cb = mii_snap_find(b, MII_SNAP_CONF, 0);
+	return ca && cb && ca->size == cb->size &&
+				!memcmp(ca->data, cb->data, ca->size);
+}
+
+void
+mii_rewind_frame(
+		mii_t *mii)
+{
+	mii_rewind_t *rw = mii->rewind;
+	if (!rw)
+		return;
+	if (rw->pending) {
+		mii_rewind_back(mii, rw->pending);
+		rw->pending = 0;
+		return;
+	}
+	mii_snapshot_t *snap = mii_snapshot_save(mii, rw->head,
+									MII_SNAP_SAVE_DIRTY);
+	if (rw->head) {
+		if (!_mii_rewind_same_conf(rw->head, snap)) {
+			printf("%s: machine configuration changed, flushed\n", __func__);
+			_mii_rewind_flush(rw);
+		} else {
+			if (rw->count == rw->max) {	// drop the oldest one
+				mii_rewind_frame_t *f = &rw->frame[rw->first];
+				rw->size -= f->size;
+				free(f->delta);
+				rw->first = (rw->first + 1) % rw->max;
+				rw->count--;
+			}
+			mii_rewind_frame_t *f =
+					&rw->frame[(rw->first + rw->count) % rw->max];
+			f->delta = mii_snapshot_delta(snap, rw->head, &f->size);
+			rw->size += f->size;
+			rw->count++;
+		}
+		mii_snapshot_free(rw->head);
+	}
+	rw->head = snap;
+}
+
+int
+mii_rewind_back(
+		mii_t *mii,
+		uint32_t frames)
+{
+	mii_rewind_t *rw = mii->rewind;
+	if (!rw || !rw->head)
+		return -1;
+	if (frames > rw->count)
+		frames = rw->count;
+	mii_snapshot_t *snap = mii_snapshot_clone(rw->head);
+	int res = 0;
+	for (uint32_t i = 0; i < frames && !res; i++) {
+		uint32_t fi = (rw->first + rw->count - 1) % rw->max;
+		mii_rewind_frame_t *f = &rw->frame[fi];
+		res = mii_snapshot_apply(snap, f->delta, f->size);
+		rw->size -= f->size;
+		free(f->delta);
+		f->delta = NULL;
+		rw->count--;
+	}
+	if (res == 0)
+		res = mii_snapshot_restore(mii, snap);
+	mii_snapshot_free(rw->head);
+	rw->head = NULL;
+	if (res) {	// the history is useless now
+		printf("%s: failed, history flushed\n", __func__);
+		_mii_rewind_flush(rw);
+		mii_snapshot_free(snap);
+		return -1;
+	}
+	rw->head = snap;
+	return frames;
+}
+
+void
+mii_rewind_request(
+		mii_t *mii,
+		uint32_t frames)
+{
+	if (!mii->rewind) {
+		printf("%s: rewind is not enabled\n", __func__);
+		return;
+	}
+	mii->rewind->pending = frames ? frames : 1;
+}
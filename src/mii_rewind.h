@@ -0,0 +1,64 @@
+/*
+ * mii_rewind.h
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Rewind buffer. At the end of each video frame, a snapshot is taken (see
+ * mii_snapshot.h), and only what changed since the previous frame is kept,
+ * as a delta that turns it back into the previous one. Only the latest
+ * snapshot is kept whole.
+ *
+ * Rewinding applies these deltas, newest first, and restores the result.
+ * The history is lost if the machine configuration changes.
+ */
+#define MII_REWIND_FPS		60
+
+struct mii_t;
+struct mii_snapshot_t;
+
+typedef struct mii_rewind_frame_t {
+	uint32_t			size;
+	uint8_t *			delta;		// turns frame n into frame n-1
+} mii_rewind_frame_t;
+
+typedef struct mii_rewind_t {
+	struct mii_snapshot_t * head;	// latest frame
+	mii_rewind_frame_t *	frame;	// ring of deltas
+	uint32_t				max, first, count;
+	size_t					size;	// total size of the deltas
+	// set by mii_rewind_request(), done at the end of the next frame
+	volatile uint32_t		pending;
+} mii_rewind_t;
+
+/* Enable rewind, with 'seconds' of history. 0 disables it. This has to be
+ * called from the thread that runs the emulation */
+void
+mii_rewind_init(
+		struct mii_t *mii,
+		uint32_t seconds);
+void
+mii_rewind_dispose(
+		struct mii_t *mii);
+/* Called by mii_run_until() at the end of each frame */
+void
+mii_rewind_frame(
+		struct mii_t *mii);
+/* Go back 'frames' frames (or as far as possible), now. Returns the number
+ * of frames rewound, or -1 on errors */
+int
+mii_rewind_back(
+		struct mii_t *mii,
+		uint32_t frames);
+/* Same, from any thread, it will be done at the end of the current frame */
+void
+mii_rewind_request(
+		struct mii_t *mii,
+		uint32_t frames);
@@ -57,6 +57,9 @@ mii_slot_drv_register(
 		}
 	}
 	mii->slot[slot_id - 1].drv = drv;
+	// driver might have installed bank callbacks
+	mii->mem_fast.rebuild = 1;
+	mii->mem_dirty = 1;
 	return 0;
 }
 
@@ -9,6 +9,8 @@
 
 #include <stdint.h>
 
+struct mii_snap_io_t;
+
 typedef struct mii_slot_t {
 	uint8_t				aux_rom_selected: 1, id;
 	void *				drv_priv;			// for driver use
@@ -46,6 +48,11 @@ typedef struct mii_slot_drv_t {
 			struct mii_slot_t *slot,
 			uint32_t cmd,
 			void * param);
+	/* optional, save or restore the card state, see mii_snapshot.h */
+	void (*snapshot)(
+			struct mii_t * mii,
+			struct mii_slot_t *slot,
+			struct mii_snap_io_t *io);
 } mii_slot_drv_t;
 
 // get driver installed in slot_id
@@ -0,0 +1,887 @@
+/*
+ * mii_snapshot.c
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "mii.h"
+#include "mii_sw.h"
+#include "mii_snapshot.h"
+#include "mii_65c02_ops.h"
+
+#define MII_SNAP_MAGIC		"MIISNAP"
+#define MII_SNAP_PT_NULL	INT64_MIN
+
+/* Chunks saved by the core, the drivers use their own tags */
+#define MII_SNAP_CPU		MII_SNAP_TAG('C','P','U',' ')
+#define MII_SNAP_MACH		MII_SNAP_TAG('M','A','C','H')
+#define MII_SNAP_TIMR		MII_SNAP_TAG('T','I','M','R')
+#define MII_SNAP_MAIN		MII_SNAP_TAG('M','A','I','N')
+#define MII_SNAP_RWKS		MII_SNAP_TAG('R','W','K','S')
+#define MII_SNAP_CROM		MII_SNAP_TAG('C','R','O','M')
+#define MII_SNAP_SWIO		MII_SNAP_TAG('S','W','I','O')
+#define MII_SNAP_SPKR		MII_SNAP_TAG('S','P','K','R')
+
+/* What has to match for a snapshot to be restored */
+typedef struct mii_snap_conf_t {
+	uint32_t			emu;
+	char				rom[16];
+	char				slot[7][16];	// driver names
+	uint64_t			timer_map;
+	uint16_t			irq_map;
+	unsigned __int128	ramworks;
+} mii_snap_conf_t;
+
+/* CPU registers, independent of the way P is stored */
+typedef struct mii_snap_cpu_t {
+	uint8_t				A, X, Y, S, P, IR, IRQ, cycle;
+	uint16_t			PC, _D, _P;
+	uint32_t			ir_log;
+	uint64_t			total_cycle;
+	uint32_t			state;			// mii_cpu_state_t
+} mii_snap_cpu_t;
+
+typedef struct mii_snap_mach_t {
+	uint32_t			sw_state;
+	float				speed;
+	uint16_t			irq_raised;
+} mii_snap_mach_t;
+
+typedef struct mii_snap_timers_t {
+	uint64_t			now, next, last_total;
+	uint8_t				last_cycle, count, heap[64];
+	struct {
+		int64_t				when;
+		uint64_t			deadline;
+		uint8_t				index;
+	}					t[64];
+} mii_snap_timers_t;
+
+typedef struct mii_snap_speaker_t {
+	mii_audio_sample_t	sample;
+	uint64_t			last_click_cycle;
+} mii_snap_speaker_t;
+
+static mii_snap_chunk_t *
+_mii_snap_add(
+		mii_snapshot_t *snap,
+		uint32_t tag,
+		uint16_t id,
+		uint16_t flags,
+		uint32_t size)
+{
+	if (snap->count == snap->alloc) {
+		snap->alloc = snap->alloc ? snap->alloc * 2 : 32;
+		snap->chunk = realloc(snap->chunk, snap->alloc * sizeof(*snap->chunk));
+	}
+	mii_snap_chunk_t *c = &snap->chunk[snap->count++];
+	memset(c, 0, sizeof(*c));
+	c->tag = tag;
+	c->id = id;
+	c->flags = flags;
+	c->size = size;
+	return c;
+}
+
+const mii_snap_chunk_t *
+mii_snap_find(
+		const mii_snapshot_t *snap,
+		uint32_t tag,
+		uint16_t id)
+{
+	for (uint32_t i = 0; snap && i < snap->count; i++)
+		if (snap->chunk[i].tag == tag && snap->chunk[i].id == id)
+			return &snap->chunk[i];
+	return NULL;
+}
+
+/*
+ * Chunks are restored in the same order they were saved, so start looking
+ * where the previous one was found.
+ */
+static const mii_snap_chunk_t *
+_mii_snap_lookup(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		uint16_t flags,
+		uint32_t size)
+{
+	const mii_snapshot_t *snap = io->snap;
+	for (uint32_t i = 0; i < snap->count; i++) {
+		uint32_t ci = (io->index + i) % snap->count;
+		const mii_snap_chunk_t *c = &snap->chunk[ci];
+		if (c->tag != tag || c->id != io->id)
+			continue;
+		if (c->size != size || (c->flags & MII_SNAP_PAGES) != flags) {
+			printf("%s: chunk %.4s:%d has the wrong size/type\n", __func__,
+					(char*)&tag, io->id);
+			break;
+		}
+		io->index = ci + 1;
+		return c;
+	}
+	printf("%s: chunk %.4s:%d not found\n", __func__, (char*)&tag, io->id);
+	io->error++;
+	return NULL;
+}
+
+void
+mii_snap_io_data(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		void *data,
+		uint32_t size)
+{
+	if (io->save) {
+		mii_snap_chunk_t *c = _mii_snap_add(io->snap, tag, io->id, 0, size);
+		c->data = malloc(size);
+		memcpy(c->data, data, size);
+		return;
+	}
+	const mii_snap_chunk_t *c = _mii_snap_lookup(io, tag, 0, size);
+	if (c)
+		memcpy(data, c->data, size);
+}
+
+void
+mii_snap_io_check(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		const void *data,
+		uint32_t size)
+{
+	if (io->save) {
+		mii_snap_io_data(io, tag, (void*)data, size);
+		return;
+	}
+	const mii_snap_chunk_t *c = _mii_snap_lookup(io, tag, 0, size);
+	if (c && memcmp(c->data, data, size)) {
+		printf("%s: chunk %.4s:%d doesn't match\n", __func__,
+				(char*)&tag, io->id);
+		io->error++;
+	}
+}
+
+void
+mii_snap_io_pages(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		uint8_t *mem,
+		uint8_t *dirty,
+		uint32_t size)
+{
+	uint32_t count = size / 256;
+	if (!io->save) {
+		const mii_snap_chunk_t *c = _mii_snap_lookup(io, tag,
+										MII_SNAP_PAGES, size);
+		for (uint32_t i = 0; c && i < count; i++)
+			memcpy(mem + (i * 256), c->page[i]->data, 256);
+		if (c && dirty)
+			memset(dirty, 1, count);
+		return;
+	}
+	mii_snapshot_t *snap = io->snap;
+	mii_snap_chunk_t *c = _mii_snap_add(snap, tag, io->id,
+								MII_SNAP_PAGES, size);
+	c->page = malloc(count * sizeof(*c->page));
+	/* The previous snapshot normally has the exact same layout */
+	const mii_snap_chunk_t *p = NULL;
+	if (io->prev) {
+		uint32_t ci = snap->count - 1;
+		if (ci < io->prev->count && io->prev->chunk[ci].tag == tag &&
+				io->prev->chunk[ci].id == io->id)
+			p = &io->prev->chunk[ci];
+		else
+			p = mii_snap_find(io->prev, tag, io->id);
+		if (p && (p->size != size || !(p->flags & MII_SNAP_PAGES)))
+			p = NULL;
+	}
+	if (!io->dirty)
+		dirty = NULL;
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t *src = mem + (i * 256);
+		bool clean = dirty && !dirty[i];
+		if (dirty)
+			dirty[i] = 0;
+		if (p && (clean || !memcmp(p->page[i]->data, src, 256))) {
+			c->page[i] = p->page[i];
+			c->page[i]->refcount++;
+			snap->pages_shared++;
+			continue;
+		}
+		c->page[i] = malloc(sizeof(*c->page[i]));
+		c->page[i]->refcount = 1;
+		memcpy(c->page[i]->data, src, 256);
+		snap->pages_new++;
+	}
+}
+
+void
+mii_snap_io_pt(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		void **state,
+		void *function)
+{
+	int64_t offset = MII_SNAP_PT_NULL;
+	if (io->save && *state)
+		offset = (char*)*state - (char*)function;
+	mii_snap_io_data(io, tag, &offset, sizeof(offset));
+	if (!io->save && !io->error)
+		*state = offset == MII_SNAP_PT_NULL ? NULL :
+						(char*)function + offset;
+}
+
+static void
+_mii_snapshot_conf(
+		mii_t *mii,
+		mii_snap_io_t *io)
+{
+	mii_snap_conf_t conf;
+	// it's compared with memcmp(), the padding has to be zeroed too
+	memset(&conf, 0, sizeof(conf));
+	conf.emu = mii->emu;
+	conf.timer_map = mii->timer.map;
+	conf.irq_map = mii->irq.map;
+	conf.ramworks = mii->ramworks.avail;
+	if (mii->rom)
+		strncpy(conf.rom, mii->rom->name, sizeof(conf.rom) - 1);
+	for (int i = 0; i < 7; i++)
+		if (mii->slot[i].drv)
+			strncpy(conf.slot[i], mii->slot[i].drv->name,
+					sizeof(conf.slot[i]) - 1);
+	io->id = 0;
+	mii_snap_io_check(io, MII_SNAP_CONF, &conf, sizeof(conf));
+}
+
+static void
+_mii_snapshot_cpu(
+		mii_t *mii,
+		mii_snap_io_t *io)
+{
+	mii_cpu_t *cpu = &mii->cpu;
+	mii_snap_cpu_t c = {};
+	if (io->save) {
+		c = (mii_snap_cpu_t) {
+			.A = cpu->A, .X = cpu->X, .Y = cpu->Y, .S = cpu->S,
+			.IR = cpu->IR, .IRQ = cpu->IRQ, .cycle = cpu->cycle,
+			.PC = cpu->PC, ._D = cpu->_D, ._P = cpu->_P,
+			.ir_log = cpu->ir_log, .total_cycle = cpu->total_cycle,
+			.state = mii->cpu_state.raw,
+		};
+		MII_GET_P(cpu, c.P);
+	}
+	mii_snap_io_data(io, MII_SNAP_CPU, &c, sizeof(c));
+	if (io->save || io->error)
+		return;
+	cpu->A = c.A; cpu->X = c.X; cpu->Y = c.Y; cpu->S = c.S;
+	cpu->IR = c.IR; cpu->IRQ = c.IRQ; cpu->cycle = c.cycle;
+	cpu->PC = c.PC; cpu->_D = c._D; cpu->_P = c._P;
+	cpu->ir_log = c.ir_log;
+	cpu->total_cycle = c.total_cycle;
+	MII_SET_P(cpu, c.P);
+	// MII_SET_P() clears B, it's only ever set by the IRQ code
+	MII_SET_P_BIT(cpu, B_B, (c.P >> B_B) & 1);
+	mii->cpu_state.raw = c.state;
+}
+
+static void
+_mii_snapshot_timers(
+		mii_t *mii,
+		mii_snap_io_t *io)
+{
+	mii_snap_timers_t t = {};
+	/* The mii_run_until() budget is armed when the rewind snapshots are
+	 * taken, it's stored disarmed, the run loop re-arms it on each pass,
+	 * so a stale deadline can't cut the next run short once restored */
+	bool armed = false;
+	int64_t budget = 0;
+	if (io->save) {
+		armed = mii->timer.timers[mii->run.timer_id].index != 0xff;
+		budget = mii_timer_get(mii, mii->run.timer_id);
+		if (armed)
+			mii_timer_set(mii, mii->run.timer_id, 0);
+		t.now = mii->timer.now;
+		t.next = mii->timer.next;
+		t.last_total = mii->timer.last_total;
+		t.last_cycle = mii->timer.last_cycle;
+		t.count = mii->timer.count;
+		memcpy(t.heap, mii->timer.heap, sizeof(t.heap));
+		for (int i = 0; i < 64; i++) {
+			t.t[i].when = mii->timer.timers[i].when;
+			// a stopped timer's deadline is stale, and meaningless
+			if (mii->timer.timers[i].index != 0xff)
+				t.t[i].deadline = mii->timer.timers[i].deadline;
+			t.t[i].index = mii->timer.timers[i].index;
+		}
+		if (armed)	// same deadline, unless it was already due
+			mii_timer_set(mii, mii->run.timer_id, budget > 0 ? budget : 1);
+	}
+	mii_snap_io_data(io, MII_SNAP_TIMR, &t, sizeof(t));
+	if (io->save || io->error)
+		return;
+	mii->timer.now = t.now;
+	mii->timer.next = t.next;
+	mii->timer.last_total = t.last_total;
+	mii->timer.last_cycle = t.last_cycle;
+	mii->timer.count = t.count;
+	memcpy(mii->timer.heap, t.heap, sizeof(t.heap));
+	for (int i = 0; i < 64; i++) {
+		mii->timer.timers[i].when = t.t[i].when;
+		mii->timer.timers[i].deadline = t.t[i].deadline;
+		mii->timer.timers[i].index = t.t[i].index;
+	}
+}
+
+/* Everything but the configuration */
+static void
+_mii_snapshot_state(
+		mii_t *mii,
+		mii_snap_io_t *io)
+{
+	io->id = 0;
+	_mii_snapshot_cpu(mii, io);
+
+	mii_snap_mach_t m = {
+		.sw_state = mii->sw_state,
+		.speed = mii->speed,
+		.irq_raised = mii->irq.raised,
+	};
+	mii_snap_io_data(io, MII_SNAP_MACH, &m, sizeof(m));
+	if (!io->save && !io->error) {
+		mii->sw_state = m.sw_state;
+		mii->speed = m.speed;
+		mii->irq.raised = m.irq_raised;
+	}
+	_mii_snapshot_timers(mii, io);
+
+	mii_snap_io_pages(io, MII_SNAP_MAIN,
+			mii->bank[MII_BANK_MAIN].mem, mii->bank[MII_BANK_MAIN].dirty,
+			0x10000);
+	if (!io->save) {	// make sure all the ramworks banks exist
+		for (uint32_t i = 0; i < io->snap->count; i++)
+			if (io->snap->chunk[i].tag == MII_SNAP_RWKS &&
+					!mii->ramworks.bank[io->snap->chunk[i].id])
+				mii_bank_update_ramworks(mii, io->snap->chunk[i].id);
+	}
+	for (int i = 0; i < 128; i++) {
+		// banks allocated since the snapshot was taken are left alone
+		if (!mii->ramworks.bank[i] ||
+				(!io->save && !mii_snap_find(io->snap, MII_SNAP_RWKS, i)))
+			continue;
+		io->id = i;
+		mii_snap_io_pages(io, MII_SNAP_RWKS, mii->ramworks.bank[i],
+				mii->ramworks.dirty[i], 0x10000);
+	}
+	io->id = 0;
+	mii_bank_t * crom = &mii->bank[MII_BANK_CARD_ROM];
+	mii_snap_io_pages(io, MII_SNAP_CROM, crom->mem, NULL, crom->size * 256);
+	mii_bank_t * sw = &mii->bank[MII_BANK_SW];
+	mii_snap_io_pages(io, MII_SNAP_SWIO, sw->mem, NULL, sw->size * 256);
+
+	mii_video_snapshot(mii, io);
+
+	mii_snap_speaker_t s = {
+		.sample = mii->speaker.sample,
+		.last_click_cycle = mii->speaker.last_click_cycle,
+	};
+	mii_snap_io_data(io, MII_SNAP_SPKR, &s, sizeof(s));
+	if (!io->save && !io->error) {
+		mii->speaker.sample = s.sample;
+		mii->speaker.last_click_cycle = s.last_click_cycle;
+		mii_speaker_restart(&mii->speaker);
+	}
+	for (int i = 0; i < 7; i++) {
+		mii_slot_t *slot = &mii->slot[i];
+		if (!slot->drv || !slot->drv->snapshot)
+			continue;
+		io->id = i + 1;
+		slot->drv->snapshot(mii, slot, io);
+	}
+	if (!io->save) {
+		mii_bank_update_ramworks(mii,
+				mii_bank_peek(&mii->bank[MII_BANK_SW], SWRAMWORKS_BANK));
+		mii->mem_dirty = 1;
+	}
+}
+
+mii_snapshot_t *
+mii_snapshot_save(
+		mii_t *mii,
+		const mii_snapshot_t *prev,
+		uint32_t flags)
+{
+	mii_snapshot_t *snap = calloc(1, sizeof(*snap));
+	snap->version = MII_SNAP_VERSION;
+	snap->cycle = mii->cpu.total_cycle;
+	mii_snap_io_t io = {
+		.snap = snap,
+		.prev = prev && prev->version == MII_SNAP_VERSION ? prev : NULL,
+		.save = true,
+		.dirty = !!(flags & MII_SNAP_SAVE_DIRTY),
+	};
+	_mii_snapshot_conf(mii, &io);
+	_mii_snapshot_state(mii, &io);
+	return snap;
+}
+
+int
+mii_snapshot_restore(
+		mii_t *mii,
+		const mii_snapshot_t *snap)
+{
+	if (!snap || snap->version != MII_SNAP_VERSION) {
+		printf("%s: invalid snapshot version\n", __func__);
+		return -1;
+	}
+	mii_snap_io_t io = {
+		.snap = (mii_snapshot_t *)snap,
+	};
+	_mii_snapshot_conf(mii, &io);
+	if (io.error) {
+		printf("%s: snapshot is for another machine configuration\n",
+				__func__);
+		return -1;
+	}
+	_mii_snapshot_state(mii, &io);
+	return io.error ? -1 : 0;
+}
+
+static void
+_mii_snap_chunk_free(
+		mii_snap_chunk_t *c)
+{
+	if (!(c->flags & MII_SNAP_PAGES)) {
+		free(c->data);
+		return;
+	}
+	for (uint32_t pi = 0; pi < c->size / 256; pi++)
+		if (--c->page[pi]->refcount == 0)
+			free(c->page[pi]);
+	free(c->page);
+}
+
+void
+mii_snapshot_free(
+		mii_snapshot_t *snap)
+{
+	if (!snap)
+		return;
+	for (uint32_t i = 0; i < snap->count; i++)
+		_mii_snap_chunk_free(&snap->chunk[i]);
+	free(snap->chunk);
+	free(snap);
+}
+
+mii_snapshot_t *
+mii_snapshot_clone(
+		const mii_snapshot_t *snap)
+{
+	mii_snapshot_t *res = calloc(1, sizeof(*res));
+	res->version = snap->version;
+	res->cycle = snap->cycle;
+	for (uint32_t i = 0; i < snap->count; i++) {
+		const mii_snap_chunk_t *s = &snap->chunk[i];
+		mii_snap_chunk_t *c = _mii_snap_add(res, s->tag, s->id,
+									s->flags, s->size);
+		if (s->flags & MII_SNAP_PAGES) {
+			uint32_t count = s->size / 256;
+			c->page = malloc(count * sizeof(*c->page));
+			for (uint32_t pi = 0; pi < count; pi++) {
+				c->page[pi] = s->page[pi];
+				c->page[pi]->refcount++;
+			}
+		} else {
+			c->data = malloc(s->size);
+			memcpy(c->data, s->data, s->size);
+		}
+	}
+	return res;
+}
+
+/*
+ * Deltas are a list of records, one per chunk that differs between the two
+ * snapshots, in host byte order:
+ *	uint32_t tag, uint16_t id, uint8_t kind, uint8_t flags, uint32_t size
+ * followed by, depending on 'kind':
+ *	XOR:	uint32_t len, rle[len]
+ *	PAGES:	uint32_t count, then count times:
+ *			uint16_t page, uint16_t len, rle[len]
+ *	FULL:	data[size], the chunk as a whole, pages are concatenated
+ *	REMOVE:	nothing, the chunk doesn't exist in the target snapshot
+ * The 'rle' data is a XOR of the two versions, with runs of zeroes
+ * compressed, see _mii_snap_rle_xor()
+ */
+enum {
+	MII_SNAP_DELTA_XOR = 0,
+	MII_SNAP_DELTA_PAGES,
+	MII_SNAP_DELTA_FULL,
+	MII_SNAP_DELTA_REMOVE,
+};
+
+typedef struct mii_snap_buf_t {
+	uint8_t *		data;
+	uint32_t		size, alloc;
+} mii_snap_buf_t;
+
+static uint8_t *
+_mii_snap_buf_grow(
+		mii_snap_buf_t *b,
+		uint32_t len)
+{
+	if (b->size + len > b->alloc) {
+		while (b->size + len > b->alloc)
+			b->alloc = b->alloc ? b->alloc * 2 : 4096;
+		b->data = realloc(b->data, b->alloc);
+	}
+	uint8_t *res = b->data + b->size;
+	b->size += len;
+	return res;
+}
+
+static void
+_mii_snap_buf_put(
+		mii_snap_buf_t *b,
+		const void *data,
+		uint32_t len)
+{
+	memcpy(_mii_snap_buf_grow(b, len), data, len);
+}
+
+/*
+ * Encode a ^ b, a control byte is followed by 1-128 literal bytes if
+ * bit 7 is clear, or stands for 1-128 zeroes if set.
+ * Returns the encoded length.
+ */
+static uint32_t
+_mii_snap_rle_xor(
+		mii_snap_buf_t *b,
+		const uint8_t *a,
+		const uint8_t *x,
+		uint32_t len)
+{
+	uint32_t start = b->size;
+	uint32_t i = 0;
+	while (i < len) {
+		uint32_t j = i;
+		if (!(a[i] ^ x[i])) {
+			while (j < len && j - i < 128 && !(a[j] ^ x[j]))
+				j++;
+			*_mii_snap_buf_grow(b, 1) = 0x80 | (j - i - 1);
+		} else {
+			// a single zero is cheaper as a literal
+			while (j < len && j - i < 128 && ((a[j] ^ x[j]) ||
+					(j + 1 < len && (a[j + 1] ^ x[j + 1]))))
+				j++;
+			uint8_t *d = _mii_snap_buf_grow(b, 1 + j - i);
+			*d++ = j - i - 1;
+			for (uint32_t k = i; k < j; k++)
+				*d++ = a[k] ^ x[k];
+		}
+		i = j;
+	}
+	return b->size - start;
+}
+
+/* XOR the encoded 'rle' into 'dst', returns 0 if it was valid */
+static int
+_mii_snap_rle_apply(
+		uint8_t *dst,
+		uint32_t len,
+		const uint8_t *rle,
+		uint32_t rle_len)
+{
+	uint32_t o = 0, i = 0;
+	while (i < rle_len) {
+		uint8_t ctl = rle[i++];
+		uint32_t run = (ctl & 0x7f) + 1;
+		if (o + run > len)
+			return -1;
+		if (!(ctl & 0x80)) {
+			if (i + run > rle_len)
+				return -1;
+			for (uint32_t k = 0; k < run; k++)
+				dst[o + k] ^= rle[i + k];
+			i += run;
+		}
+		o += run;
+	}
+	return o == len ? 0 : -1;
+}
+
+static void
+_mii_snap_delta_header(
+		mii_snap_buf_t *b,
+		const mii_snap_chunk_t *c,
+		uint8_t kind)
+{
+	_mii_snap_buf_put(b, &c->tag, sizeof(c->tag));
+	_mii_snap_buf_put(b, &c->id, sizeof(c->id));
+	_mii_snap_buf_put(b, &kind, 1);
+	uint8_t flags = c->flags;
+	_mii_snap_buf_put(b, &flags, 1);
+	_mii_snap_buf_put(b, &c->size, sizeof(c->size));
+}
+
+uint8_t *
+mii_snapshot_delta(
+		const mii_snapshot_t *snap,
+		const mii_snapshot_t *target,
+		uint32_t *size)
+{
+	mii_snap_buf_t b = {};
+	for (uint32_t i = 0; i < target->count; i++) {
+		const mii_snap_chunk_t *t = &target->chunk[i];
+		// normally both snapshots have the exact same layout
+		const mii_snap_chunk_t *c = i < snap->count &&
+				snap->chunk[i].tag == t->tag && snap->chunk[i].id == t->id ?
+						&snap->chunk[i] : mii_snap_find(snap, t->tag, t->id);
+		if (!c || c->size != t->size || c->flags != t->flags) {
+			_mii_snap_delta_header(&b, t, MII_SNAP_DELTA_FULL);
+			if (t->flags & MII_SNAP_PAGES) {
+				for (uint32_t pi = 0; pi < t->size / 256; pi++)
+					_mii_snap_buf_put(&b, t->page[pi]->data, 256);
+			} else
+				_mii_snap_buf_put(&b, t->data, t->size);
+			continue;
+		}
+		if (!(t->flags & MII_SNAP_PAGES)) {
+			if (!memcmp(c->data, t->data, t->size))
+				continue;
+			_mii_snap_delta_header(&b, t, MII_SNAP_DELTA_XOR);
+			uint32_t lo = b.size;
+			uint32_t len = 0;
+			_mii_snap_buf_put(&b, &len, sizeof(len));
+			len = _mii_snap_rle_xor(&b, c->data, t->data, t->size);
+			memcpy(b.data + lo, &len, sizeof(len));
+			continue;
+		}
+		// shared pages are identical, no need to look at them
+		uint32_t count = 0, co = 0;
+		for (uint32_t pi = 0; pi < t->size / 256; pi++) {
+			if (c->page[pi] == t->page[pi] ||
+					!memcmp(c->page[pi]->data, t->page[pi]->data, 256))
+				continue;
+			if (!count++) {
+				_mii_snap_delta_header(&b, t, MII_SNAP_DELTA_PAGES);
+				co = b.size;
+				_mii_snap_buf_put(&b, &count, sizeof(count));
+			}
+			uint16_t page = pi, len = 0;
+			_mii_snap_buf_put(&b, &page, sizeof(page));
+			uint32_t lo = b.size;
+			_mii_snap_buf_put(&b, &len, sizeof(len));
+			len = _mii_snap_rle_xor(&b, c->page[pi]->data,
+						t->page[pi]->data, 256);
+			memcpy(b.data + lo, &len, sizeof(len));
+		}
+		if (count)
+			memcpy(b.data + co, &count, sizeof(count));
+	}
+	for (uint32_t i = 0; i < snap->count; i++) {
+		const mii_snap_chunk_t *c = &snap->chunk[i];
+		if (!mii_snap_find(target, c->tag, c->id))
+			_mii_snap_delta_header(&b, c, MII_SNAP_DELTA_REMOVE);
+	}
+	*size = b.size;
+	return b.data;
+}
+
+int
+mii_snapshot_apply(
+		mii_snapshot_t *snap,
+		const uint8_t *delta,
+		uint32_t size)
+{
+	const uint8_t *d = delta, *end = delta + size;
+	#define _GET(_v) \
+		if (d + sizeof(_v) > end) goto error; \
+		memcpy(&(_v), d, sizeof(_v)); d += sizeof(_v);
+	while (d < end) {
+		uint32_t tag, csize;
+		uint16_t id;
+		uint8_t kind, flags;
+		_GET(tag); _GET(id); _GET(kind); _GET(flags); _GET(csize);
+		mii_snap_chunk_t *c = (mii_snap_chunk_t *)mii_snap_find(snap, tag, id);
+		switch (kind) {
+			case MII_SNAP_DELTA_XOR: {
+				uint32_t len;
+				_GET(len);
+				if (!c || c->size != csize || (c->flags & MII_SNAP_PAGES) ||
+						d + len > end ||
+						_mii_snap_rle_apply(c->data, c->size, d, len))
+					goto error;
+				d += len;
+			}	break;
+			case MII_SNAP_DELTA_PAGES: {
+				uint32_t count;
+				_GET(count);
+				if (!c || c->size != csize || !(c->flags & MII_SNAP_PAGES))
+					goto error;
+				for (uint32_t i = 0; i < count; i++) {
+					uint16_t page, len;
+					_GET(page); _GET(len);
+					if (page >= c->size / 256 || d + len > end)
+						goto error;
+					// copy on write, the page might be shared
+					mii_snap_page_t *p = malloc(sizeof(*p));
+					p->refcount = 1;
+					memcpy(p->data, c->page[page]->data, 256);
+					if (--c->page[page]->refcount == 0)
+						free(c->page[page]);
+					c->page[page] = p;
+					if (_mii_snap_rle_apply(p->data, 256, d, len))
+						goto error;
+					d += len;
+				}
+			}	break;
+			case MII_SNAP_DELTA_FULL: {
+				if (d + csize > end)
+					goto error;
+				if (c) {
+					_mii_snap_chunk_free(c);
+				} else
+					c = _mii_snap_add(snap, tag, id, 0, 0);
+				c->flags = flags;
+				c->size = csize;
+				if (flags & MII_SNAP_PAGES) {
+					c->page = malloc((csize / 256) * sizeof(*c->page));
+					for (uint32_t pi = 0; pi < csize / 256; pi++) {
+						c->page[pi] = malloc(sizeof(*c->page[pi]));
+						c->page[pi]->refcount = 1;
+						memcpy(c->page[pi]->data, d + (pi * 256), 256);
+					}
+				} else {
+					c->data = malloc(csize);
+					memcpy(c->data, d, csize);
+				}
+				d += csize;
+			}	break;
+			case MII_SNAP_DELTA_REMOVE: {
+				if (!c)
+					goto error;
+				_mii_snap_chunk_free(c);
+				uint32_t ci = c - snap->chunk;
+				memmove(c, c + 1, (snap->count - ci - 1) * sizeof(*c));
+				snap->count--;
+			}	break;
+			default:
+				goto error;
+		}
+	}
+	#undef _GET
+	return 0;
+error:
+	printf("%s: invalid delta at offset %d\n", __func__, (int)(d - delta));
+	return -1;
+}
+
+/*
+ * File format is a header, followed by the chunks, all in host byte order.
+ *	char magic[8], uint32_t version, uint32_t count, uint64_t cycle
+ *	for each chunk:
+ *	uint32_t tag, uint16_t id, uint16_t flags, uint32_t size, data[size]
+ */
+int
+mii_snapshot_write(
+		const mii_snapshot_t *snap,
+		const char *filename)
+{
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+	char magic[8] = MII_SNAP_MAGIC;
+	fwrite(magic, sizeof(magic), 1, f);
+	fwrite(&snap->version, sizeof(snap->version), 1, f);
+	fwrite(&snap->count, sizeof(snap->count), 1, f);
+	fwrite(&snap->cycle, sizeof(snap->cycle), 1, f);
+	for (uint32_t i = 0; i < snap->count; i++) {
+		const mii_snap_chunk_t *c = &snap->chunk[i];
+		fwrite(&c->tag, sizeof(c->tag), 1, f);
+		fwrite(&c->id, sizeof(c->id), 1, f);
+		fwrite(&c->flags, sizeof(c->flags), 1, f);
+		fwrite(&c->size, sizeof(c->size), 1, f);
+		if (c->flags & MII_SNAP_PAGES) {
+			for (uint32_t pi = 0; pi < c->size / 256; pi++)
+				fwrite(c->page[pi]->data, 256, 1, f);
+		} else
+			fwrite(c->data, c->size, 1, f);
+	}
+	int res = ferror(f) ? -1 : 0;
+	fclose(f);
+	if (res)
+		printf("%s: error writing %s\n", __func__, filename);
+	return res;
+}
+
+mii_snapshot_t *
+mii_snapshot_read(
+		const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return NULL;
+	}
+	mii_snapshot_t *snap = calloc(1, sizeof(*snap));
+	char magic[8];
+	uint32_t count = 0;
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+			memcmp(magic, MII_SNAP_MAGIC, sizeof(magic)) ||
+			fread(&snap->version, sizeof(snap->version), 1, f) != 1 ||
+			fread(&count, sizeof(count), 1, f) != 1 ||
+			fread(&snap->cycle, sizeof(snap->cycle), 1, f) != 1) {
+		printf("%s: %s is not a snapshot\n", __func__, filename);
+		goto error;
+	}
+	if (snap->version != MII_SNAP_VERSION) {
+		printf("%s: %s is version %d, expected %d\n", __func__, filename,
+				snap->version, MII_SNAP_VERSION);
+		goto error;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t tag, size;
+		uint16_t id, flags;
+		if (fread(&tag, sizeof(tag), 1, f) != 1 ||
+				fread(&id, sizeof(id), 1, f) != 1 ||
+				fread(&flags, sizeof(flags), 1, f) != 1 ||
+				fread(&size, sizeof(size), 1, f) != 1)
+			goto truncated;
+		mii_snap_chunk_t *c = _mii_snap_add(snap, tag, id, 0, 0);
+		if (flags & MII_SNAP_PAGES) {
+			c->page = calloc(size / 256, sizeof(*c->page));
+			c->flags = flags;	// so _free() knows about the pages
+			c->size = size;
+			for (uint32_t pi = 0; pi < size / 256; pi++) {
+				c->page[pi] = malloc(sizeof(*c->page[pi]));
+				c->page[pi]->refcount = 1;
+				if (fread(c->page[pi]->data, 256, 1, f) != 1) {
+					// make the rest of the pages valid for _free()
+					c->size = (pi + 1) * 256;
+					goto truncated;
+				}
+			}
+		} else {
+			c->data = malloc(size);
+			c->size = size;
+			if (size && fread(c->data, size, 1, f) != 1)
+				goto truncated;
+		}
+	}
+	fclose(f);
+	return snap;
+truncated:
+	printf("%s: %s is truncated\n", __func__, filename);
+error:
+	fclose(f);
+	mii_snapshot_free(snap);
+	return NULL;
+}
@@ -0,0 +1,174 @@
+/*
+ * mii_snapshot.h
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Snapshots of a running mii_t. A snapshot is a list of 'chunks', each with
+ * a tag and an id (slot number, ramworks bank etc). Plain chunks are just
+ * a copy of some state, 'paged' chunks are used for memory, and are made of
+ * reference counted 256 bytes pages. When a snapshot is taken with a previous
+ * one as reference, pages that haven't changed are shared with it, so taking
+ * one every frame is cheap. With MII_SNAP_SAVE_DIRTY, the memory page dirty
+ * maps (see mii_bank_t) are used to skip comparing pages that weren't
+ * written to at all.
+ *
+ * A snapshot only contains *state*: it can only be restored in a machine with
+ * the same configuration (same ROM, same drivers in the same slots), and
+ * mii_snapshot_restore() will refuse to do so otherwise.
+ *
+ * Slot drivers serialize themselves with their 'snapshot' callback, which
+ * is called for both saving and restoring, using the mii_snap_io_*() calls.
+ */
+#define MII_SNAP_VERSION	4
+
+#define MII_SNAP_TAG(_a, _b, _c, _d) \
+		((_a) | ((_b) << 8) | ((_c) << 16) | ((uint32_t)(_d) << 24))
+
+/* Machine configuration chunk, snapshots can only be restored if it matches */
+#define MII_SNAP_CONF		MII_SNAP_TAG('C','O','N','F')
+
+enum {
+	MII_SNAP_PAGES		= (1 << 0),	// chunk is made of shared pages
+};
+
+/* mii_snapshot_save() flags */
+enum {
+	/* Trust (and clear) the page dirty maps. 'prev' has to be the last
+	 * snapshot taken with this flag, otherwise pages written in between
+	 * would be missed. */
+	MII_SNAP_SAVE_DIRTY	= (1 << 0),
+};
+
+typedef struct mii_snap_page_t {
+	uint32_t			refcount;
+	uint8_t				data[256];
+} mii_snap_page_t;
+
+typedef struct mii_snap_chunk_t {
+	uint32_t			tag;
+	uint16_t			id;
+	uint16_t			flags;		// MII_SNAP_*
+	uint32_t			size;		// in bytes
+	union {
+		uint8_t *			data;
+		mii_snap_page_t **	page;	// size / 256 pages
+	};
+} mii_snap_chunk_t;
+
+typedef struct mii_snapshot_t {
+	uint32_t			version;
+	uint64_t			cycle;		// cpu.total_cycle when it was taken
+	uint32_t			count, alloc;
+	mii_snap_chunk_t *	chunk;
+	// statistics, pages that were allocated/shared when it was taken
+	uint32_t			pages_new, pages_shared;
+} mii_snapshot_t;
+
+typedef struct mii_snap_io_t {
+	mii_snapshot_t *		snap;
+	const mii_snapshot_t *	prev;	// when saving, to share pages with
+	bool					save;
+	bool					dirty;	// MII_SNAP_SAVE_DIRTY
+	uint16_t				id;		// id of the chunks being saved/restored
+	uint32_t				index;	// lookup cursor in snap
+	int						error;
+} mii_snap_io_t;
+
+struct mii_t;
+
+/* Take a snapshot, 'prev' is optional, and is another snapshot of the same
+ * machine, unchanged memory pages will be shared with it. 'flags' is a
+ * combination of MII_SNAP_SAVE_* */
+mii_snapshot_t *
+mii_snapshot_save(
+		struct mii_t *mii,
+		const mii_snapshot_t *prev,
+		uint32_t flags);
+/* Restore a snapshot. Returns 0 on success, -1 if the snapshot doesn't match
+ * the machine configuration (nothing is changed in that case) */
+int
+mii_snapshot_restore(
+		struct mii_t *mii,
+		const mii_snapshot_t *snap);
+void
+mii_snapshot_free(
+		mii_snapshot_t *snap);
+/* Returns a copy of 'snap', sharing all its pages */
+mii_snapshot_t *
+mii_snapshot_clone(
+		const mii_snapshot_t *snap);
+/*
+ * Returns a (malloced) buffer of 'size' bytes, that mii_snapshot_apply()
+ * uses to turn 'snap' into 'target'. Only the chunks and pages that differ
+ * are stored, as a XOR of both versions, run length encoded.
+ */
+uint8_t *
+mii_snapshot_delta(
+		const mii_snapshot_t *snap,
+		const mii_snapshot_t *target,
+		uint32_t *size);
+/* Apply a delta to 'snap', returns 0, or -1 if the delta doesn't fit */
+int
+mii_snapshot_apply(
+		mii_snapshot_t *snap,
+		const uint8_t *delta,
+		uint32_t size);
+/* Save/Load a snapshot to/from a file. Return 0/NULL on errors */
+int
+mii_snapshot_write(
+		const mii_snapshot_t *snap,
+		const char *filename);
+mii_snapshot_t *
+mii_snapshot_read(
+		const char *filename);
+
+/*
+ * These are used by the subsystems and drivers to save/restore their state.
+ * When saving, they add a chunk with the current io->id to the snapshot, when
+ * restoring, they copy the chunk back. A missing chunk, or one with the wrong
+ * size sets io->error.
+ */
+void
+mii_snap_io_data(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		void *data,
+		uint32_t size);
+/* Same, for memory, size has to be a multiple of 256. 'dirty' is the
+ * optional page dirty map of 'mem', it is all set when restoring */
+void
+mii_snap_io_pages(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		uint8_t *mem,
+		uint8_t *dirty,
+		uint32_t size);
+/* When saving, adds the chunk, when restoring, checks it matches 'data' */
+void
+mii_snap_io_check(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		const void *data,
+		uint32_t size);
+/* Protothread states are addresses of labels inside 'function', they are
+ * stored as an offset to it (this requires the same binary to restore) */
+void
+mii_snap_io_pt(
+		mii_snap_io_t *io,
+		uint32_t tag,
+		void **state,
+		void *function);
+/* Returns the chunk 'tag' with id 'id', or NULL */
+const mii_snap_chunk_t *
+mii_snap_find(
+		const mii_snapshot_t *snap,
+		uint32_t tag,
+		uint16_t id);
@@ -12,25 +12,36 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <math.h>
 
 #include "mii.h"
 #include "mii_speaker.h"
 
 
 #define MII_SPEAKER_BASE_SAMPLE 	0.5f
-#define MII_SPEAKER_RAMP_ON 		16
-#define MII_SPEAKER_RAMP_OFF 		128
+// samples per batch, this is the latency the timer adds
+#define MII_SPEAKER_BATCH 			256
+// high pass filter, about 14Hz
+#define MII_SPEAKER_LEAK 			(1.0f - (1.0f / 512))
+// stop once the output is this quiet, after the last click
+#define MII_SPEAKER_QUIET 			(1.0f / 1024)
+#define MII_SPEAKER_CUTOFF 			0.45	// of the sample rate
+
+DEFINE_FIFO(uint64_t, mii_speaker_edge_fifo);
+
+/* Band-limited impulses, one per phase, each sums to 1.0 */
+static float _mii_speaker_blep[MII_SPEAKER_BLEP_PHASES][MII_SPEAKER_BLEP_TAPS];
 
 int mii_speaker_debug = 0;
 int mii_speaker_debug_fd = -1;
 
 static inline void
 _mii_speaker_write(
-		mii_audio_frame_t *f,
+		mii_audio_source_t *source,
 		mii_audio_sample_t sample,
 		bool start, bool stop)
 {
-	mii_audio_frame_write(f, sample);
+	mii_audio_source_write(source, &sample);
 	static int mii_speaker_debug_fd = -1;
 	if (!mii_speaker_debug) {
 		if (mii_speaker_debug_fd != -1)
@@ -54,77 +65,150 @@ _mii_speaker_write(
 	#endif
 }
 
+/* Taylor series, this is only for the tables. <math.h> is just for M_PI,
+ * the test binaries (mii_headless etc) are built from the same sources,
+ * and they don't link with -lm */
+static double
+_mii_speaker_sin(
+		double x)
+{
+	while (x > M_PI)
+		x -= 2 * M_PI;
+	while (x < -M_PI)
+		x += 2 * M_PI;
+	double term = x, sum = x;
+	for (int n = 1; n < 12; n++) {
+		term *= -x * x / ((2 * n) * (2 * n + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+/*
+ * Windowed (Blackman) sinc, sampled for an impulse at 'phase' past the
+ * sample MII_SPEAKER_BLEP_TAPS / 2 - 1 of each row.
+ */
+static void
+_mii_speaker_blep_init(void)
+{
+	const int half = MII_SPEAKER_BLEP_TAPS / 2;
+
+	if (_mii_speaker_blep[0][half - 1] != 0)
+		return;
+	for (int p = 0; p < MII_SPEAKER_BLEP_PHASES; p++) {
+		double frac = (double)p / MII_SPEAKER_BLEP_PHASES;
+		double sum = 0;
+		for (int k = 0; k < MII_SPEAKER_BLEP_TAPS; k++) {
+			double t = (k - (half - 1)) - frac;
+			double x = 2 * M_PI * MII_SPEAKER_CUTOFF * t;
+			double sinc = t == 0 ? 1.0 : _mii_speaker_sin(x) / x;
+			double w = (t + half) / MII_SPEAKER_BLEP_TAPS;	// 0..1
+			// cos(a) is sin(a + pi/2)
+			double win = 0.42 -
+					0.5 * _mii_speaker_sin(2 * M_PI * w + M_PI / 2) +
+					0.08 * _mii_speaker_sin(4 * M_PI * w + M_PI / 2);
+			_mii_speaker_blep[p][k] = sinc * win;
+			sum += sinc * win;
+		}
+		for (int k = 0; k < MII_SPEAKER_BLEP_TAPS; k++)
+			_mii_speaker_blep[p][k] /= sum;
+	}
+}
+
+/* Integrate 'count' samples of deltas, and write them to the fifo */
 static void
-_mii_speaker_pad(
+_mii_speaker_output(
 		mii_speaker_t *s,
-		bool click)
+		uint32_t count)
 {
+	const uint32_t size = MII_SPEAKER_BLEP_TAPS * 2;
 	mii_audio_frame_t *f = &s->source.fifo;
-	uint64_t now 	= s->mii->cpu.total_cycle;
-
-//	printf("pad: %d %d\n", s->play_state, click);
-	do {
-		switch(s->source.state) {
-			case MII_AUDIO_IDLE:
-				// nothing to do
-				if (click) {
-					s->source.state = MII_AUDIO_STARTING;
-					continue;
-				} else
-					break;
-			case MII_AUDIO_STARTING: {
-				// we are starting, so we need to pad the start of the frame
-				// with a small attack to soften the beeps
-//				printf("%s started avail W:%5d\n",
-//					__func__, mii_audio_frame_get_write_size(f));
-				mii_audio_sample_t attack = -s->sample;
-				for (int i = MII_SPEAKER_RAMP_ON; i >= 1; i--)
-					_mii_speaker_write(f, (attack / i),
-							i == MII_SPEAKER_RAMP_ON, false);
-				s->source.state = MII_AUDIO_PLAYING;
-				s->last_fill_cycle = now;
-			}	break;
-			case MII_AUDIO_PLAYING: {
-				uint64_t last_click = (now - s->last_click_cycle) /
-											s->source.sink->clk_per_sample;
-				if (last_click > (MII_AUDIO_FREQ / 64)) {
-//					printf("%s stopping\n", __func__);
-					s->source.state = MII_AUDIO_STOPPING;
-			//		continue;
-				}
-				// write padding
-				uint64_t fill_amount = (now - s->last_fill_cycle) /
-											s->source.sink->clk_per_sample;
-//				printf("play %d pad %5ld/%5ld rds %5d\n", click,
-//						fill_amount, last_click,
-//						mii_audio_frame_get_read_size(f));
-				while (fill_amount > 0 && !mii_audio_frame_isfull(f)) {
-					_mii_speaker_write(f, s->sample, false, false);
-					fill_amount--;
-				}
-				s->last_fill_cycle = now;
-//				printf("  fifo state W:%4d R:%4d\n",
-//						mii_audio_frame_get_write_size(f),
-//						mii_audio_frame_get_read_size(f));
-			}	break;
-			case MII_AUDIO_STOPPING: {
-//				printf("%s stopped\n", __func__);
-				// we are stopping, so we need to pad the end of the frame
-				// with a small tailoff to soften the beeps
-				mii_audio_sample_t tail = s->sample;
-				for (int i = 1; i <= MII_SPEAKER_RAMP_OFF; i++)
-					_mii_speaker_write(f, tail / i,
-							false, i == MII_SPEAKER_RAMP_OFF);
-				s->source.state = MII_AUDIO_IDLE;
-			}	break;
-		}
-		break;
-	} while(1);
+	float out = s->output;
+
+	for (uint32_t i = 0; i < count; i++) {
+		out = out * MII_SPEAKER_LEAK + (i < size ? s->delta[i] : 0);
+		if (!mii_audio_frame_isfull(f))
+			_mii_speaker_write(&s->source, out, false, false);
+	}
+	s->output = out;
+	if (count < size) {
+		memmove(s->delta, s->delta + count,
+				(size - count) * sizeof(s->delta[0]));
+		memset(s->delta + size - count, 0, count * sizeof(s->delta[0]));
+	} else
+		memset(s->delta, 0, sizeof(s->delta));
+	s->fill_cycle += count * mii_audio_clk_per_sample(s->source.sink);
+}
+
+/* (Re)start the output so that a click at 'cycle' fits in the impulses */
+static void
+_mii_speaker_start(
+		mii_speaker_t *s,
+		uint64_t cycle)
+{
+	float clk = mii_audio_clk_per_sample(s->source.sink);
+
+	s->fill_cycle = cycle - (MII_SPEAKER_BLEP_TAPS / 2) * clk;
+	memset(s->delta, 0, sizeof(s->delta));
+	if (s->source.state == MII_AUDIO_IDLE) {
+		s->output = 0;
+		_mii_speaker_write(&s->source, 0, true, false);
+	}
+	s->source.state = MII_AUDIO_PLAYING;
+}
+
+/*
+ * Turn the clicks logged since the last call into samples, up to 'now'.
+ * Samples are only final once no later click can reach them, so the
+ * output lags 'now' by half the impulse width.
+ */
+static void
+_mii_speaker_render(
+		mii_speaker_t *s,
+		uint64_t now)
+{
+	const int half = MII_SPEAKER_BLEP_TAPS / 2;
+	float clk = mii_audio_clk_per_sample(s->source.sink);
 
-	if (click) {
-		s->last_click_cycle = now;
+	while (!mii_speaker_edge_fifo_isempty(&s->edges)) {
+		uint64_t cycle = mii_speaker_edge_fifo_read(&s->edges);
+		double pos = (cycle - s->fill_cycle) / clk;
+		// first click, or the cycles jumped (snapshot restored)
+		if (s->source.state == MII_AUDIO_IDLE || pos < 0 ||
+				pos > MII_AUDIO_FREQ / 8) {
+			_mii_speaker_start(s, cycle);
+			pos = half;
+		}
+		// the samples before this impulse are final
+		int first = (int)pos - (half - 1);
+		if (first > 0) {
+			_mii_speaker_output(s, first);
+			pos -= first;
+		}
+		int phase = (pos - (int)pos) * MII_SPEAKER_BLEP_PHASES;
+		int at = (int)pos - (half - 1);		// 0, or below if too late
+		const float * blep = _mii_speaker_blep[phase];
+		float * d = s->delta + (at < 0 ? 0 : at);
 		s->sample = -s->sample;
-		_mii_speaker_write(f, s->sample, false, false);
+		float step = s->sample * 2;
+		for (int k = 0; k < MII_SPEAKER_BLEP_TAPS; k++)
+			d[k] += step * blep[k];
+		s->last_click_cycle = cycle;
+	}
+	if (s->source.state == MII_AUDIO_IDLE)
+		return;
+	double pos = (now - s->fill_cycle) / clk;
+	if (pos < 0 || pos > MII_AUDIO_FREQ / 8) {	// cycles jumped
+		s->source.state = MII_AUDIO_IDLE;
+		return;
+	}
+	if (pos > half)
+		_mii_speaker_output(s, (uint32_t)pos - half);
+	// stop once the last click has died out
+	if ((now - s->last_click_cycle) / clk > MII_AUDIO_FREQ / 64 &&
+			s->output < MII_SPEAKER_QUIET && s->output > -MII_SPEAKER_QUIET) {
+		_mii_speaker_write(&s->source, 0, false, true);
+		s->source.state = MII_AUDIO_IDLE;
 	}
 }
 
@@ -134,9 +218,9 @@ _mii_speaker_timer_cb(
 		void * param )
 {
 	mii_speaker_t *s = (mii_speaker_t*)param;
-	_mii_speaker_pad(s, false);
+	_mii_speaker_render(s, mii->cpu.total_cycle);
 	return s->source.state == MII_AUDIO_IDLE ? 0 :
-				(MII_AUDIO_FRAME_SIZE / 2) * s->source.sink->clk_per_sample;
+				MII_SPEAKER_BATCH * mii_audio_clk_per_sample(s->source.sink);
 }
 
 // Initialize the speaker with the frame size in samples
@@ -145,6 +229,7 @@ mii_speaker_init(
 		struct mii_t * mii,
 		mii_speaker_t *s)
 {
+	_mii_speaker_blep_init();
 	s->mii = mii;
 	s->sample = -MII_SPEAKER_BASE_SAMPLE;
 	s->source.state = MII_AUDIO_IDLE;
@@ -161,13 +246,27 @@ mii_speaker_dispose(
 	mii_timer_set(s->mii, s->timer_id, 0);
 }
 
+// Drop the pending clicks and impulses, the next click starts afresh
+void
+mii_speaker_restart(
+		mii_speaker_t *s)
+{
+	mii_speaker_edge_fifo_reset(&s->edges);
+	memset(s->delta, 0, sizeof(s->delta));
+	s->source.state = MII_AUDIO_IDLE;
+}
 
-// Called when $c030 is touched, place a sample at the 'appropriate' time
+// Called when $c030 is touched, log the click for the next batch
 void
 mii_speaker_click(
 		mii_speaker_t *s)
 {
-	_mii_speaker_pad(s, true);
-	mii_timer_set(s->mii, s->timer_id,
-		(MII_AUDIO_FRAME_SIZE / 2) * s->source.sink->clk_per_sample);
+	mii_t * mii = s->mii;
+	if (mii_speaker_edge_fifo_isfull(&s->edges))
+		_mii_speaker_render(s, mii->cpu.total_cycle);
+	mii_speaker_edge_fifo_write(&s->edges, mii->cpu.total_cycle);
+	if (s->source.state == MII_AUDIO_IDLE &&
+			mii_timer_get(mii, s->timer_id) <= 0)
+		mii_timer_set(mii, s->timer_id,
+			MII_SPEAKER_BATCH * mii_audio_clk_per_sample(s->source.sink));
 }
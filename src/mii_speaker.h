@@ -14,12 +14,29 @@
 
 struct mii_t;
 
+/*
+ * The clicks are only logged, with their cycle, and turned into samples
+ * in batches by the speaker timer. Each click is a band-limited step
+ * (BLEP), added from a table of windowed sinc impulses, then the deltas are
+ * integrated, through a high pass filter, as the real speaker is AC coupled.
+ */
+#define MII_SPEAKER_BLEP_TAPS	16		// width of the impulses, in samples
+#define MII_SPEAKER_BLEP_PHASES	64		// sub-sample positions
+
+DECLARE_FIFO(uint64_t, mii_speaker_edge_fifo, 1024);
+
 typedef struct mii_speaker_t {
 	struct mii_t	  *	mii;
 	uint8_t 			timer_id;
-	mii_audio_sample_t 	sample; // current value for the speaker output
+	mii_audio_sample_t 	sample; // current level of the speaker output
 	mii_audio_source_t 	source;
-	uint64_t		   	last_click_cycle, last_fill_cycle;
+	uint64_t		   	last_click_cycle;
+	// clicks not turned into samples yet
+	mii_speaker_edge_fifo_t edges;
+	double 				fill_cycle;		// cycle of the next sample
+	float 				output;			// integrated, high passed
+	// impulses not integrated yet, [0] is for the next sample
+	float 				delta[MII_SPEAKER_BLEP_TAPS * 2];
 } mii_speaker_t;
 
 // Initialize the speaker with the frame size in samples
@@ -30,7 +47,11 @@ mii_speaker_init(
 void
 mii_speaker_dispose(
 		mii_speaker_t *speaker);
-// Called when $c030 is touched, place a sample at the 'appropriate' time
+// Drop the pending clicks and impulses, the next click starts afresh
+void
+mii_speaker_restart(
+		mii_speaker_t *speaker);
+// Called when $c030 is touched, log the click for the next batch
 void
 mii_speaker_click(
 		mii_speaker_t *speaker);
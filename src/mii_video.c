@@ -11,11 +11,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "mii.h"
 #include "mii_bank.h"
 #include "mii_sw.h"
 #include "minipt.h"
+#include "mii_snapshot.h"
+#include "fifo_declare.h"
 
 
 #if defined(__AVX2__)
@@ -71,11 +75,6 @@ enum {
 		(_b) = ((_rgb) >> 16) & 0xff; \
 	}
 
-/* this 'dims' the colors for every second line of pixels
- * This is a very very cheap filter but it works really well!
- */
-#define C_SCANLINE_MASK 0xffc0c0c0
-
 // these are more or less arbitrary orders really
 enum mii_video_color_mode_e {
 	CI_BLACK = 0,
@@ -222,6 +221,32 @@ _mii_line_to_video_addr(
 	return addr;
 }
 
+/* VRAM address of 'line' for the mode in 'sw'; line 0 is the page base */
+static inline uint16_t
+_mii_video_line_addr(
+		uint32_t sw,
+		uint8_t line)
+{
+	bool page2 	= SWW_GETSTATE(sw, SW80STORE) ? 0 : SWW_GETSTATE(sw, SWPAGE2);
+	if (SWW_GETSTATE(sw, SWTEXT) || !SWW_GETSTATE(sw, SWHIRES)) {
+		int i = line >> 3;
+		return (0x400 + (0x400 * page2)) +
+				(((i & 0x07) << 7) | ((i >> 3) << 5) | ((i >> 3) << 3));
+	}
+	return _mii_line_to_video_addr(0x2000 + (0x2000 * page2), line);
+}
+
+/* softswitches 'line' is drawn with, the bottom of mixed mode is text */
+static inline uint32_t
+_mii_video_line_sw(
+		uint32_t sw,
+		uint8_t line)
+{
+	if (line >= MII_VIDEO_MIXED_LINE && SWW_GETSTATE(sw, SWMIXED))
+		SWW_SETSTATE(sw, SWTEXT, 1);
+	return sw;
+}
+
 static inline int
 _mii_addr_to_line_text_lores(
 		uint16_t a)	// ZERO based, not 0x400 based
@@ -316,17 +341,15 @@ static void
 _mii_line_render_dhires_mono(
 		struct mii_video_t *video,
 		uint32_t 			sw,
+		uint8_t 			line,
 		mii_bank_t * 		main,
 		mii_bank_t * 		aux )
 {
-	bool page2 	= SWW_GETSTATE(sw, SW80STORE) ? 0 : SWW_GETSTATE(sw, SWPAGE2);
-	uint16_t a = (0x2000 + (0x2000 * page2));
-
-	video->base_addr = a;
-	a = _mii_line_to_video_addr(a, video->line);
-	video->line_addr = a;
+	uint16_t a = _mii_video_line_addr(sw, line);
 	uint32_t * screen = video->pixels +
-						(video->line * MII_VIDEO_WIDTH * 2);
+						(line * MII_VIDEO_WIDTH * 2);
+
+	uint8_t * iscreen = video->index_pixels + (line * MII_VIDEO_WIDTH);
 
 	const uint32_t clut[2] = {
 			video->clut.mono[0],
@@ -336,8 +359,10 @@ _mii_line_render_dhires_mono(
 						((mii_bank_peek(main, a + x) & 0x7f) << 7);
 		for (int bi = 0; bi < 14; bi++) {
 			uint8_t pixel = (ext >> bi) & 1;
-			uint32_t col = clut[pixel];
-			*screen++ = col;
+			if (video->indexed)
+				*iscreen++ = mii_base_clut.mono[pixel];
+			else
+				*screen++ = clut[pixel];
 		}
 	}
 }
@@ -359,18 +384,15 @@ static void
 _mii_line_render_dhires_color(
 		struct mii_video_t *video,
 		uint32_t 			sw,
+		uint8_t 			line,
 		mii_bank_t * 		main,
 		mii_bank_t * 		aux )
 {
-	bool page2 	= SWW_GETSTATE(sw, SW80STORE) ? 0 : SWW_GETSTATE(sw, SWPAGE2);
-	uint16_t a = (0x2000 + (0x2000 * page2));
-
-	video->base_addr = a;
-	a = _mii_line_to_video_addr(a, video->line);
-	video->line_addr = a;
+	uint16_t a = _mii_video_line_addr(sw, line);
 	uint32_t * screen = video->pixels +
-						(video->line * MII_VIDEO_WIDTH * 2);
+						(line * MII_VIDEO_WIDTH * 2);
 
+	uint8_t * iscreen = video->index_pixels + (line * MII_VIDEO_WIDTH);
 	uint8_t bits[71] = { 0 };
 
 	for (int x = 0; x < 80; x++) {
@@ -393,8 +415,45 @@ _mii_line_render_dhires_color(
 			(_mii_get_1bits(bits, i + 2) << (3 - ((d + 2) % 4))) +
 			(_mii_get_1bits(bits, i + 1) << (3 - ((d + 1) % 4))) +
 			(_mii_get_1bits(bits, i) << (3 - (d % 4)));
-		uint32_t col = video->clut.dhires[pixel];
-		*screen++ = col;
+		if (video->indexed)
+			*iscreen++ = mii_base_clut.dhires[pixel];
+		else
+			*screen++ = video->clut.dhires[pixel];
+	}
+}
+
+/* Same as below, for the indexed output */
+static void
+_mii_line_render_hires_index(
+		struct mii_video_t *video,
+		uint8_t 			line,
+		const uint8_t *		src )
+{
+	uint8_t * iscreen = video->index_pixels + (line * MII_VIDEO_WIDTH);
+
+	uint8_t b0 = 0;
+	uint8_t b1 = src[0];
+	uint8_t lastcol = 0xff;	// not a color, the first pixel is always dimmed
+	for (int x = 0; x < 40; x++) {
+		uint8_t b2 	= x == 39 ? 0 : src[x + 1];
+		const mii_video_hires_ilut_t * l;
+		if (!video->monochrome) {
+			uint16_t run =  ((b0 & 0x40) >> ( 6 )) |
+							((b1 & 0x7f) << ( 1 )) |
+							((b2 & 0x01) << ( 8 ));
+			l = &video->hires_index[b1 >> 7][x & 1][run];
+		} else
+			l = &video->hires_mono_index[b1 & 0x7f];
+		memcpy(iscreen, l->pixels, sizeof(l->pixels));
+		if (l->pixels[1] != lastcol) {
+			iscreen[0] = l->first_low;
+			if (!video->monochrome)
+				iscreen[1] = l->first_low;
+		}
+		lastcol = l->last;
+		iscreen += 14;
+		b0 = b1;
+		b1 = b2;
 	}
 }
 
@@ -402,72 +461,42 @@ static void
 _mii_line_render_hires(
 		struct mii_video_t *video,
 		uint32_t 			sw,
+		uint8_t 			line,
 		mii_bank_t * 		main,
 		mii_bank_t * 		aux )
 {
-	bool page2 	= SWW_GETSTATE(sw, SW80STORE) ? 0 : SWW_GETSTATE(sw, SWPAGE2);
-	uint16_t a = (0x2000 + (0x2000 * page2));
-
-	video->base_addr = a;
-	a = _mii_line_to_video_addr(a, video->line);
-	video->line_addr = a;
+	uint16_t a = _mii_video_line_addr(sw, line);
 	uint32_t * screen = video->pixels +
-						(video->line * MII_VIDEO_WIDTH * 2);
+						(line * MII_VIDEO_WIDTH * 2);
 	uint8_t *src = main->mem;
 
+	if (video->indexed) {
+		_mii_line_render_hires_index(video, line, src + a);
+		return;
+	}
 	uint8_t b0 = 0;
 	uint8_t b1 = src[a + 0];
 	uint32_t lastcol = 0;
 	for (int x = 0; x < 40; x++) {
 		// last columns are clear, don't wrap around
 		uint8_t b2 	= x == 39 ? 0 : src[a + x + 1];
-		// last 2 pixels, current 7 pixels, next 2 pixels
-		uint16_t run =  ((b0 & 0x60) >> ( 5 )) |
-						((b1 & 0x7f) << ( 2 )) |
-						((b2 & 0x03) << ( 9 ));
-		int odd = (x & 1) << 1;
-		int offset = (b1 & 0x80) >> 5;
+		const mii_video_hires_lut_t * l;
 		if (!video->monochrome) {
-			for (int i = 0; i < 7; i++) {
-				uint8_t left = (run >> (1 + i)) & 1;
-				uint8_t pixel = (run >> (2 + i)) & 1;
-				uint8_t right = (run >> (3 + i)) & 1;
-
-				int idx = 0;	// black
-				if (pixel) {
-					if (left || right) {
-						idx = 9;	// white
-					} else {
-						idx = offset + odd + (i & 1) + 1;
-					}
-				} else {
-					if (left && right) {
-						idx = offset + odd + 1 - (i & 1) + 1;
-					}
-				}
-				uint32_t col = video->clut.hires[idx];
-				if (col != lastcol) {
-					uint32_t nc  = video->clut_low.hires[idx];
-					*screen++ = nc; //col & C_SCANLINE_MASK;
-					*screen++ = nc; //col & C_SCANLINE_MASK;
-					lastcol = col;
-				} else {
-					*screen++ = col;
-					*screen++ = col;
-				}
-			}
-		} else {
-			for (int i = 0; i < 7; i++) {
-				uint8_t pixel = (run >> (2 + i)) & 1;
-				uint32_t col = video->clut.mono[pixel];
-				if (col != lastcol) {
-					*screen++ = col & C_SCANLINE_MASK;
-					lastcol = col;
-				} else
-					*screen++ = col;
-				*screen++ = col;
-			}
+			// last pixel, current 7 pixels, next pixel
+			uint16_t run =  ((b0 & 0x40) >> ( 6 )) |
+							((b1 & 0x7f) << ( 1 )) |
+							((b2 & 0x01) << ( 8 ));
+			l = &video->hires[b1 >> 7][x & 1][run];
+		} else
+			l = &video->hires_mono[b1 & 0x7f];
+		memcpy(screen, l->pixels, sizeof(l->pixels));
+		if (l->pixels[1] != lastcol) {
+			screen[0] = l->first_low;
+			if (!video->monochrome)
+				screen[1] = l->first_low;
 		}
+		lastcol = l->last;
+		screen += 14;
 		b0 = b1;
 		b1 = b2;
 	}
@@ -477,16 +506,11 @@ static void
 _mii_line_render_text(
 		struct mii_video_t *video,
 		uint32_t 			sw,
+		uint8_t 			line,
 		mii_bank_t * 		main,
 		mii_bank_t * 		aux )
 {
-	bool page2 	= SWW_GETSTATE(sw, SW80STORE) ? 0 : SWW_GETSTATE(sw, SWPAGE2);
-	uint16_t a = (0x400 + (0x400 * page2));
-
-	video->base_addr = a;
-	int i = video->line >> 3;
-	a += ((i & 0x07) << 7) | ((i >> 3) << 5) | ((i >> 3) << 3);
-	video->line_addr = a;
+	uint16_t a = _mii_video_line_addr(sw, line);
 	const uint8_t *rom_base = video->rom->rom;
 
 	// International ROMS are 8K, the rom_bank variable allows switching between
@@ -498,26 +522,46 @@ _mii_line_render_text(
 	int 	flash 	= video->frame_count & MII_VIDEO_FLASH_FRAME_MASK ?
 							-0x40 : 0x40;
 	uint32_t * screen = video->pixels +
-						(video->line * MII_VIDEO_WIDTH * 2);
-
-	for (int x = 0; x < 40 + (40 * col80); x++) {
-		uint8_t c = 0;
-		if (col80)
-			c = mii_bank_peek(x & 1 ? main : aux, a + (x >> 1));
-		else
-			c = mii_bank_peek(main, a + x);
-		if (!altset) {
+						(line * MII_VIDEO_WIDTH * 2);
+
+	rom_base += line & 0x07;
+
+	if (altset)		// no flashing, 0x40-0x7f are mousetext
+		flash = 0;
+	if (video->indexed) {
+		uint8_t * iscreen = video->index_pixels +
+						(line * MII_VIDEO_WIDTH);
+		for (int x = 0; x < 40 + (40 * col80); x++) {
+			uint8_t c = col80 ? (x & 1 ? main : aux)->mem[a + (x >> 1)] :
+						main->mem[a + x];
 			if (c >= 0x40 && c <= 0x7f)
 				c = (int)c + flash;
+			uint8_t bits = rom_base[c << 3] & 0x7f;
+			if (col80) {
+				memcpy(iscreen, video->text80_index[bits], 7);
+				iscreen += 7;
+			} else {
+				memcpy(iscreen, video->text40_index[bits], 14);
+				iscreen += 14;
+			}
 		}
-		const uint8_t * rom = rom_base + (c << 3);
-		uint8_t bits = rom[video->line & 0x07];
-		for (int pi = 0; pi < 7; pi++) {
-			uint8_t pixel = (bits >> pi) & 1;
-			uint32_t col = video->clut.mono[!pixel];
-			*screen++ = col;
-			if (!col80)
-				*screen++ = col;
+	} else if (col80) {
+		for (int x = 0; x < 80; x++) {
+			uint8_t c = (x & 1 ? main : aux)->mem[a + (x >> 1)];
+			if (c >= 0x40 && c <= 0x7f)
+				c = (int)c + flash;
+			uint8_t bits = rom_base[c << 3] & 0x7f;
+			memcpy(screen, video->text80[bits], sizeof(video->text80[0]));
+			screen += 7;
+		}
+	} else {
+		for (int x = 0; x < 40; x++) {
+			uint8_t c = main->mem[a + x];
+			if (c >= 0x40 && c <= 0x7f)
+				c = (int)c + flash;
+			uint8_t bits = rom_base[c << 3] & 0x7f;
+			memcpy(screen, video->text40[bits], sizeof(video->text40[0]));
+			screen += 14;
 		}
 	}
 }
@@ -526,20 +570,16 @@ static void
 _mii_line_render_lores(
 		struct mii_video_t *video,
 		uint32_t 			sw,
+		uint8_t 			line,
 		mii_bank_t * 		main,
 		mii_bank_t * 		aux )
 {
-	bool page2 	= SWW_GETSTATE(sw, SW80STORE) ? 0 : SWW_GETSTATE(sw, SWPAGE2);
-	uint16_t a = (0x400 + (0x400 * page2));
-
-	video->base_addr = a;
-	int i = video->line >> 3;
-	a += ((i & 0x07) << 7) | ((i >> 3) << 5) | ((i >> 3) << 3);
-	video->line_addr = a;
+	uint16_t a = _mii_video_line_addr(sw, line);
 
 	bool 	col80 	= SWW_GETSTATE(sw, SW80COL);
 	uint32_t * screen = video->pixels +
-						(video->line * MII_VIDEO_WIDTH * 2);
+						(line * MII_VIDEO_WIDTH * 2);
+	uint8_t * iscreen = video->index_pixels + (line * MII_VIDEO_WIDTH);
 	mii_video_clut_t * clut = &video->clut;
 	mii_video_clut_t * clut_low = &video->clut_low;
 	uint32_t lastcolor = 0;
@@ -550,40 +590,47 @@ _mii_line_render_lores(
 		else
 			c = mii_bank_peek(main, a + x);
 
-		int lo_line = video->line / 4;
+		int lo_line = line / 4;
 		c = (c >> ((lo_line & 1) * 4)) & 0xf;
 //		c |= (c << 4);
 		uint32_t color = clut->lores[(x & col80) ^ col80][c & 0x0f];
 		uint32_t dim = clut_low->lores[(x & col80) ^ col80][c & 0x0f];
+		// the edges are always decided on the actual color
+		uint32_t key = color;
+		if (video->indexed) {
+			color = mii_base_clut.lores[(x & col80) ^ col80][c & 0x0f];
+			dim = color | MII_VIDEO_INDEX_LOW;
+		}
+		// 7 double pixels in 40 columns, 7 pixels in 80 columns
+		const int count = col80 ? 7 : 14;
+		uint32_t px[14];
 		if (!video->monochrome) {
 			for (int pi = 0; pi < 7; pi++) {
 				uint32_t pixel = color;
-				if (pixel != lastcolor) {
+				if (key != lastcolor) {
 					pixel = dim;
-					lastcolor = color;
+					lastcolor = key;
 				}
-				*screen++ = pixel;
-				if (!col80)
-					*screen++ = pixel;
+				if (col80)
+					px[pi] = pixel;
+				else
+					px[pi * 2] = px[(pi * 2) + 1] = pixel;
 			}
 		} else {
 			c = reverse4(c);
 			c |= c << 4;
 			c |= c << 8;
-			if (col80) {
-				for (int pi = 0; pi < 7; pi++) {
-					uint8_t b = (c >> pi) & 1;
-					uint32_t pixel = b ? color : dim;
-					*screen++ = pixel;
-				}
-			} else {
-				if (x & 1) c >>= 2;
-				for (int pi = 0; pi < 14; pi++) {
-					uint8_t b = (c >> pi) & 1;
-					uint32_t pixel = b ? color : dim;
-					*screen++ = pixel;
-				}
-			}
+			if (!col80 && (x & 1))
+				c >>= 2;
+			for (int pi = 0; pi < count; pi++)
+				px[pi] = (c >> pi) & 1 ? color : dim;
+		}
+		if (video->indexed) {
+			for (int pi = 0; pi < count; pi++)
+				*iscreen++ = px[pi];
+		} else {
+			memcpy(screen, px, count * sizeof(px[0]));
+			screen += count;
 		}
 	}
 }
@@ -668,6 +715,626 @@ mii_video_OOB_write_check(
 		mii->video.line_cb.check(&mii->video, mii->sw_state, addr + i);
 }
 
+/* Make the second line of pixels, a dimmed copy of the one we just drew */
+static void
+_mii_video_scanline(
+		mii_video_t *video,
+		uint8_t line)
+{
+	uint32_t * screen = video->pixels +
+						(line * MII_VIDEO_WIDTH * 2);
+	uint32_t * l2 = screen + MII_VIDEO_WIDTH;
+
+#if defined(__AVX2__)
+	const __m256i mask = _mm256_set1_epi32(C_SCANLINE_MASK);
+	// Process scanline using AVX GCC intrinsic
+	for (int i = 0; i < MII_VIDEO_WIDTH; i += 8) {
+		__m256i src = _mm256_loadu_si256((__m256i *)(screen + i));
+		__m256i result = _mm256_and_si256(src, mask);
+		_mm256_storeu_si256((__m256i *)(l2 + i), result);
+	}
+#elif defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi32(C_SCANLINE_MASK);
+	// Process scanline using SSE GCC intrinsic
+	for (int i = 0; i < MII_VIDEO_WIDTH; i += 4) {
+		__m128i src = _mm_loadu_si128((__m128i *)(screen + i));
+		__m128i result = _mm_and_si128(src, mask);
+		_mm_storeu_si128((__m128i *)(l2 + i), result);
+	}
+#else
+#if 1	// generic vector code -- NEON and wasm?
+	const u32_v mask = C_SCANLINE_MASK - (u32_v){};	// broadcast
+	for (int i = 0; i < MII_VIDEO_WIDTH; i += VEC_ECOUNT,
+					screen += VEC_ECOUNT, l2 += VEC_ECOUNT) {
+		u32_v s = *(u32_v *)screen;
+		s &= mask;
+		*(u32_v *)l2 = s;
+	}
+#else
+	for (int i = 0; i < MII_VIDEO_WIDTH; i++)
+		*l2++ = *screen++ & C_SCANLINE_MASK;
+#endif
+#endif
+}
+
+/* XXH64, for a 'len' that is a multiple of 8 */
+#define XXH_P1	0x9E3779B185EBCA87ULL
+#define XXH_P2	0xC2B2AE3D27D4EB4FULL
+#define XXH_P3	0x165667B19E3779F9ULL
+#define XXH_P4	0x85EBCA77C2B2AE63ULL
+#define XXH_P5	0x27D4EB2F165667C5ULL
+#define XXH_ROTL(_x, _r)	(((_x) << (_r)) | ((_x) >> (64 - (_r))))
+
+static inline uint64_t
+_mii_xxh64_round(
+		uint64_t acc,
+		uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = XXH_ROTL(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t
+_mii_xxh64_merge(
+		uint64_t acc,
+		uint64_t val)
+{
+	acc ^= _mii_xxh64_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t
+_mii_xxh64(
+		const void *data,
+		size_t len,
+		uint64_t seed)
+{
+	const uint8_t * p = data, * end = p + len;
+	uint64_t h, k;
+
+	if (len >= 32) {
+		uint64_t v[4] = {
+			seed + XXH_P1 + XXH_P2, seed + XXH_P2, seed, seed - XXH_P1 };
+		do {
+			for (int i = 0; i < 4; i++, p += 8) {
+				memcpy(&k, p, 8);
+				v[i] = _mii_xxh64_round(v[i], k);
+			}
+		} while (p + 32 <= end);
+		h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7) +
+				XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+		for (int i = 0; i < 4; i++)
+			h = _mii_xxh64_merge(h, v[i]);
+	} else
+		h = seed + XXH_P5;
+	h += len;
+	for (; p + 8 <= end; p += 8) {
+		memcpy(&k, p, 8);
+		h ^= _mii_xxh64_round(0, k);
+		h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Hash the lines drawn this frame, then the frame from the line hashes.
+ * Only the first row of each line is used, the second one is derived from
+ * it. Indexed lines are hashed as their colors, so both outputs match.
+ */
+static void
+_mii_video_frame_hash(
+		mii_video_t *video,
+		const mii_color_t *palette)
+{
+	bool all = __atomic_exchange_n(&video->hash.rehash, 0, __ATOMIC_ACQ_REL);
+	uint32_t row[MII_VIDEO_WIDTH];
+
+	for (int l = 0; l < 192; l++) {
+		if (!all && !(video->frame_lines[l / 64] & (1ULL << (l & 63))))
+			continue;
+		const uint32_t * src = video->pixels + (l * MII_VIDEO_WIDTH * 2);
+		if (video->indexed) {
+			const uint8_t * ip = video->index_pixels + (l * MII_VIDEO_WIDTH);
+			for (int x = 0; x < MII_VIDEO_WIDTH; x++)
+				row[x] = palette[ip[x] & 63];
+			src = row;
+		}
+		video->hash.line[l] = _mii_xxh64(src, sizeof(row), 0);
+	}
+	video->hash.frame = _mii_xxh64(video->hash.line,
+							sizeof(video->hash.line), 0);
+}
+
+/* Bring the 'back' frame up to date with the lines it is missing */
+static void
+_mii_video_frame_copy(
+		mii_video_t *video,
+		mii_video_frame_t *f)
+{
+	if (f->indexed != video->indexed) {
+		f->indexed = video->indexed;
+		f->stale[0] = f->stale[1] = f->stale[2] = -1LL;
+	}
+	for (int l = 0; l < 192; l++) {
+		if (!(f->stale[l / 64] & (1ULL << (l & 63))))
+			continue;
+		int e = l + 1;
+		while (e < 192 && (f->stale[e / 64] & (1ULL << (e & 63))))
+			e++;
+		if (f->indexed)
+			memcpy(f->index_pixels + (l * MII_VIDEO_WIDTH),
+					video->index_pixels + (l * MII_VIDEO_WIDTH),
+					(e - l) * MII_VIDEO_WIDTH);
+		else
+			memcpy(f->pixels + (l * MII_VIDEO_WIDTH * 2),
+					video->pixels + (l * MII_VIDEO_WIDTH * 2),
+					(e - l) * MII_VIDEO_WIDTH * 2 * sizeof(video->pixels[0]));
+		l = e;
+	}
+	f->stale[0] = f->stale[1] = f->stale[2] = 0;
+}
+
+/*
+ * End of frame, on the thread that draws the lines. Copy the frame to the
+ * 'back' buffer and make it the 'ready' one, then bump frame_seed if it
+ * changed.
+ */
+static void
+_mii_video_frame_publish(
+		mii_video_t *video,
+		bool dirty,
+		uint64_t cycle)
+{
+	mii_video_frame_t ** frame = video->frames.frame;
+	mii_video_frame_t * f = frame[video->frames.back];
+
+	// all the copies are now missing the lines drawn this frame
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 192 / 64; j++)
+			frame[i]->stale[j] |= video->frame_lines[j];
+	_mii_video_frame_copy(video, f);
+	uint32_t ps = __atomic_load_n(&video->palette_seq, __ATOMIC_ACQUIRE);
+	if (f->palette_seq != ps) {
+		memcpy(f->palette, video->palette, sizeof(f->palette));
+		f->palette_seq = ps;
+	}
+	if (video->hash.enabled)
+		_mii_video_frame_hash(video, f->palette);
+	for (int j = 0; j < 192 / 64; j++) {
+		f->lines[j] = video->frame_lines[j];
+		video->frame_lines[j] = 0;
+	}
+	/* If the host hasn't taken the current 'ready' frame, its lines have to
+	 * be in this one. If it takes it meanwhile, it just uploads too much */
+	uint8_t ready = __atomic_load_n(&video->frames.ready, __ATOMIC_ACQUIRE);
+	if (ready & MII_VIDEO_FRAME_NEW)
+		for (int j = 0; j < 192 / 64; j++)
+			f->lines[j] |= frame[ready & 3]->lines[j];
+	f->seq = ++video->frames.seq;
+	f->cycle = cycle;
+	f->hash = video->hash.frame;
+	video->hash.seq = f->seq;
+	if (video->frame_hook.cb)
+		video->frame_hook.cb(video, f, video->frame_hook.param);
+	ready = __atomic_exchange_n(&video->frames.ready,
+				video->frames.back | MII_VIDEO_FRAME_NEW, __ATOMIC_ACQ_REL);
+	video->frames.back = ready & 3;
+	if ((ready & MII_VIDEO_FRAME_NEW) && video->frames.host)
+		video->frames.dropped++;
+	if (dirty)
+		video->frame_seed++;
+}
+
+/* Draw columns x0 to x1 (excluded) of 'line', leave the others alone */
+static void
+_mii_video_render_columns(
+		mii_video_t *video,
+		mii_video_line_drawing_cb render,
+		uint32_t sw,
+		uint8_t line,
+		uint8_t x0,
+		uint8_t x1,
+		mii_bank_t *main,
+		mii_bank_t *aux)
+{
+	video->frame_lines[line / 64] |= 1ULL << (line & 63);
+	if (x0 == 0 && x1 == 40) {
+		render(video, sw, line, main, aux);
+		return;
+	}
+	// 14 pixels per column, of 1 or 4 bytes
+	size_t px = video->indexed ? 1 : sizeof(video->pixels[0]);
+	uint8_t * row = video->indexed ?
+			video->index_pixels + (line * MII_VIDEO_WIDTH) :
+			(uint8_t*)(video->pixels + (line * MII_VIDEO_WIDTH * 2));
+	uint8_t save[MII_VIDEO_WIDTH * sizeof(video->pixels[0])];
+
+	memcpy(save, row, MII_VIDEO_WIDTH * px);
+	render(video, sw, line, main, aux);
+	memcpy(row, save, x0 * 14 * px);
+	memcpy(row + (x1 * 14 * px), save + (x1 * 14 * px), (40 - x1) * 14 * px);
+}
+
+/*
+ * Render thread. When enabled, the video timer doesn't draw anything, it
+ * only queues the dirty lines, with a copy of the VRAM bytes they read.
+ * The thread keeps its own copy of VRAM up to date with these, and calls
+ * the same line renderers with it. The end of the frame is queued too,
+ * so frame_seed only changes once the pixels are there.
+ */
+#define MII_VIDEO_JOB_FRAME		0xff	// 'line' of the end of frame job
+
+typedef struct mii_video_job_t {
+	mii_video_line_drawing_cb	render;
+	uint32_t 			sw;
+	uint16_t 			addr;
+	uint8_t 			line;
+	uint8_t 			x0, x1;		// columns to draw
+	uint8_t 			dirty;		// end of frame: frame has changed
+	uint64_t 			cycle;		// end of frame: CPU cycle
+	uint8_t 			main[40], aux[40];
+} mii_video_job_t;
+
+DECLARE_FIFO(mii_video_job_t, mii_video_job_fifo, 512);
+DEFINE_PTR_FIFO(mii_video_job_t, mii_video_job_fifo);
+
+typedef struct mii_video_worker_t {
+	pthread_t 			thread;
+	sem_t 				wake;
+	sem_t 				done;		// a job was released, if 'waiting'
+	volatile int 		quit, waiting;
+	mii_video_job_fifo_t fifo;
+	mii_bank_t 			main, aux;	// on the VRAM copies below
+	uint8_t 			vram[2][0x6000];
+} mii_video_worker_t;
+
+static void *
+_mii_video_worker_thread(
+		void *param)
+{
+	mii_video_t * video = param;
+	mii_video_worker_t * w = video->worker;
+
+	do {
+		while (!mii_video_job_fifo_isempty(&w->fifo)) {
+			mii_video_job_t * j = mii_video_job_fifo_read_ptr(&w->fifo);
+			if (j->line == MII_VIDEO_JOB_FRAME)
+				_mii_video_frame_publish(video, j->dirty, j->cycle);
+			else {
+				memcpy(w->vram[0] + j->addr, j->main, sizeof(j->main));
+				memcpy(w->vram[1] + j->addr, j->aux, sizeof(j->aux));
+				_mii_video_render_columns(video, j->render, j->sw, j->line,
+						j->x0, j->x1, &w->main, &w->aux);
+				if (j->x1 == 40 && !video->indexed)
+					_mii_video_scanline(video, j->line);
+			}
+			// only release the job once it's done, see mii_video_sync()
+			mii_video_job_fifo_read_offset(&w->fifo, 1);
+			__sync_synchronize();
+			if (w->waiting)
+				sem_post(&w->done);
+		}
+		// the last frame queued before stopping still gets published
+		if (w->quit)
+			break;
+		sem_wait(&w->wake);
+	} while (1);
+	return NULL;
+}
+
+/* Block until the render thread has released some jobs, or all of them */
+static void
+_mii_video_worker_wait(
+		mii_video_worker_t *w,
+		bool all)
+{
+	while (sem_trywait(&w->done) == 0)	// stale posts
+		;
+	w->waiting = 1;
+	__sync_synchronize();
+	while (all ? !mii_video_job_fifo_isempty(&w->fifo) :
+				mii_video_job_fifo_isfull(&w->fifo)) {
+		sem_post(&w->wake);
+		sem_wait(&w->done);
+	}
+	w->waiting = 0;
+}
+
+static mii_video_job_t *
+_mii_video_worker_job(
+		mii_video_worker_t *w)
+{
+	if (mii_video_job_fifo_isfull(&w->fifo))
+		_mii_video_worker_wait(w, false);
+	return mii_video_job_fifo_write_ptr(&w->fifo);
+}
+
+static void
+_mii_video_worker_push(
+		mii_video_t *video,
+		mii_video_line_drawing_cb render,
+		uint32_t sw,
+		uint8_t line,
+		uint8_t x0,
+		uint8_t x1,
+		mii_bank_t *main,
+		mii_bank_t *aux)
+{
+	mii_video_worker_t * w = video->worker;
+	mii_video_job_t * j = _mii_video_worker_job(w);
+
+	j->render = render;
+	j->sw = sw;
+	j->line = line;
+	j->x0 = x0;
+	j->x1 = x1;
+	j->addr = _mii_video_line_addr(sw, line);
+	mii_bank_read(main, j->addr, j->main, sizeof(j->main));
+	mii_bank_read(aux, j->addr, j->aux, sizeof(j->aux));
+	mii_video_job_fifo_write_offset(&w->fifo, 1);
+}
+
+static void
+_mii_video_worker_frame(
+		mii_video_t *video,
+		uint64_t cycle)
+{
+	mii_video_worker_t * w = video->worker;
+	mii_video_job_t * j = _mii_video_worker_job(w);
+
+	j->line = MII_VIDEO_JOB_FRAME;
+	j->dirty = video->frame_dirty;
+	j->cycle = cycle;
+	mii_video_job_fifo_write_offset(&w->fifo, 1);
+	sem_post(&w->wake);
+}
+
+/* Start/stop the render thread, has to be called from the emulation thread */
+static void
+_mii_video_set_worker(
+		mii_t *mii,
+		bool on)
+{
+	mii_video_t * video = &mii->video;
+	mii_video_worker_t * w = video->worker;
+
+	if (on == !!w)
+		return;
+	if (on) {
+		w = calloc(1, sizeof(*w));
+		w->main = (mii_bank_t) { .name = "VRAM", .size = 0x60,
+						.no_alloc = 1, .mem = w->vram[0] };
+		w->aux = (mii_bank_t) { .name = "VRAM aux", .size = 0x60,
+						.no_alloc = 1, .mem = w->vram[1] };
+		sem_init(&w->wake, 0, 0);
+		sem_init(&w->done, 0, 0);
+		video->worker = w;
+		if (pthread_create(&w->thread, NULL,
+					_mii_video_worker_thread, video)) {
+			perror(__func__);
+			sem_destroy(&w->wake);
+			sem_destroy(&w->done);
+			free(w);
+			video->worker = NULL;
+			video->threaded = 0;
+			return;
+		}
+	} else {
+		w->quit = 1;
+		sem_post(&w->wake);
+		pthread_join(w->thread, NULL);
+		sem_destroy(&w->wake);
+		sem_destroy(&w->done);
+		free(w);
+		video->worker = NULL;
+	}
+	// the thread's VRAM copy (or the pixels) are stale
+	_mii_video_mark_dirty(video);
+}
+
+/* Update the text_flash bit of a line about to be drawn */
+static void
+_mii_video_text_flash_check(
+		mii_video_t *video,
+		mii_video_line_drawing_cb render,
+		uint32_t sw,
+		uint8_t line,
+		uint8_t x0,
+		uint8_t x1,
+		mii_bank_t *main,
+		mii_bank_t *aux)
+{
+	uint64_t bit = 1ULL << (line & 63);
+	// segments only add to it, the whole line has to be drawn to clear it
+	if (x0 == 0 && x1 == 40)
+		video->text_flash[line / 64] &= ~bit;
+	if (render != _mii_line_render_text)
+		return;
+	uint16_t a = _mii_video_line_addr(sw, line);
+	bool col80 = SWW_GETSTATE(sw, SW80COL);
+	for (int x = x0; x < x1; x++) {
+		if ((main->mem[a + x] & 0xc0) == 0x40 ||
+				(col80 && (aux->mem[a + x] & 0xc0) == 0x40)) {
+			video->text_flash[line / 64] |= bit;
+			break;
+		}
+	}
+}
+
+/* Mark the lines that have flashing, or alt charset characters */
+static void
+_mii_video_mark_text_flash(
+		mii_video_t *video)
+{
+	uint64_t any = 0;
+	for (int i = 0; i < 192 / 64; i++) {
+		video->lines_dirty[i] |= video->text_flash[i];
+		any |= video->text_flash[i];
+	}
+	if (any)
+		video->frame_dirty = 1;
+}
+
+/* Draw columns x0 to x1 of 'line', here or on the render thread */
+static void
+_mii_video_draw_line(
+		mii_video_t *video,
+		mii_video_line_drawing_cb render,
+		uint32_t sw,
+		uint8_t line,
+		uint8_t x0,
+		uint8_t x1,
+		mii_bank_t *main,
+		mii_bank_t *aux)
+{
+	_mii_video_text_flash_check(video, render, sw, line, x0, x1, main, aux);
+	if (video->worker) {
+		_mii_video_worker_push(video, render, sw, line, x0, x1, main, aux);
+		return;
+	}
+	_mii_video_render_columns(video, render, sw, line, x0, x1, main, aux);
+	// the host does the scanlines for the indexed output
+	if (x1 == 40 && !video->indexed)
+		_mii_video_scanline(video, line);
+}
+
+/*
+ * Called by the softswitches that change the video mode. If the beam is
+ * on the visible part of a line, log the change, with its column.
+ */
+static void
+_mii_video_mode_log(
+		mii_t *mii)
+{
+	mii_video_t * video = &mii->video;
+
+	if (video->beam_line == MII_VIDEO_NO_LINE)
+		return;
+	int64_t x = (int64_t)(mii->timer.now - video->beam_cycle) / mii->speed;
+	if (x < 0 || x >= MII_VIDEO_H_CYCLES)
+		return;
+	uint8_t n = video->mode_log_count;
+	// softswitches are often just read, only log actual changes
+	if (mii->sw_state == (n ? video->mode_log[n - 1].sw : video->beam_sw))
+		return;
+	if (n && video->mode_log[n - 1].x == x)
+		n--;	// several changes on the same column, last one wins
+	else if (n == MII_VIDEO_MODE_LOG_SIZE)
+		return;
+	video->mode_log[n].x = x;
+	video->mode_log[n].sw = mii->sw_state;
+	video->mode_log_count = n + 1;
+}
+
+/* Draw the line the beam just left again, in segments, if its mode changed */
+static void
+_mii_video_mode_log_flush(
+		mii_video_t *video,
+		mii_bank_t *main,
+		mii_bank_t *aux)
+{
+	if (!video->mode_log_count)
+		return;
+	uint8_t line = video->beam_line;
+	uint32_t sw = video->beam_sw;
+	uint8_t x0 = 0;
+
+	for (int i = 0; i <= video->mode_log_count; i++) {
+		uint8_t x1 = i < video->mode_log_count ? video->mode_log[i].x : 40;
+		if (x1 > x0) {
+			uint32_t line_sw = _mii_video_line_sw(sw, line);
+			_mii_video_draw_line(video,
+					_mii_video_get_line_render_cb(video, line_sw).render,
+					line_sw, line, x0, x1, main, aux);
+		}
+		if (i < video->mode_log_count)
+			sw = video->mode_log[i].sw;
+		x0 = x1;
+	}
+	video->mode_log_count = 0;
+	video->frame_dirty = 1;
+}
+
+/*
+ * Recolor the RGBA pixels from 'recolor_from' to the current palette, in
+ * place. A hash of the old colors gives the new ones, and runs of the same
+ * color only need one lookup. Returns false if an old color now has two
+ * different ones, the pixels can't tell which one they are then.
+ */
+#define MII_RECOLOR_HASH(_c)	((((_c) * 0x9E3779B1u) >> 24) & 127)
+
+static bool
+_mii_video_recolor_pixels(
+		mii_video_t *video)
+{
+	struct {
+		mii_color_t from, to;
+		uint8_t used;
+	} map[128] = {};
+
+	for (int i = 0; i < 64; i++) {
+		mii_color_t c = video->recolor_from[i];
+		int h = MII_RECOLOR_HASH(c);
+		while (map[h].used && map[h].from != c)
+			h = (h + 1) & 127;
+		if (map[h].used && map[h].to != video->palette[i])
+			return false;
+		map[h].used = 1;
+		map[h].from = c;
+		map[h].to = video->palette[i];
+	}
+	for (int l = 0; l < 192; l++) {
+		uint64_t bit = 1ULL << (l & 63);
+		/* Drawn this frame, maybe before the change, maybe after; these
+		 * are drawn again instead */
+		if (video->frame_lines[l / 64] & bit) {
+			video->lines_dirty[l / 64] |= bit;
+			continue;
+		}
+		uint32_t * p = video->pixels + (l * MII_VIDEO_WIDTH * 2);
+		mii_color_t last = p[0] ^ 1, to = 0;
+		for (int x = 0; x < MII_VIDEO_WIDTH * 2; x++, p++) {
+			if (*p != last) {
+				last = *p;
+				int h = MII_RECOLOR_HASH(last);
+				while (map[h].used && map[h].from != last)
+					h = (h + 1) & 127;
+				to = map[h].used ? map[h].to : last;
+			}
+			*p = to;
+		}
+	}
+	return true;
+}
+
+/* At the end of the frame, on the emulation thread */
+static void
+_mii_video_recolor(
+		mii_t *mii)
+{
+	mii_video_t * video = &mii->video;
+
+	// the render thread owns the pixels and frame_lines
+	mii_video_sync(mii);
+	// the host applies the colors to the indexed output
+	if (video->indexed)
+		return;
+	if (!_mii_video_recolor_pixels(video)) {
+		_mii_video_mark_dirty(video);
+		return;
+	}
+	// all of it changed, as far as the frames and the host are concerned
+	video->frame_lines[0] = video->frame_lines[1] =
+			video->frame_lines[2] = -1LL;
+	video->frame_dirty = 1;
+}
+
 /*
  * This is the state machine to draw a line of the video output
  * All timings lifted from https://rich12345.tripod.com/aiivideo/vbl.html
@@ -711,58 +1378,26 @@ mii_video_timer_cb(
 	do {
 		// 'clear' VBL flag. Flag is 0 during retrace
 		mii_bank_poke(sw, SWVBL, 0x80);
+		_mii_video_mode_log_flush(video, main, aux);
 
 		mii_video_line_drawing_cb line_drawing = video->line_cb.render;
 		/* If we are in mixed mode past line 160, check if we need to
 		 * switch from the 'main mode' callback to the text callback */
-		if (video->line >= MII_VIDEO_MIXED_LINE) {
-			bool	mixed	= SWW_GETSTATE(sw_state, SWMIXED);
-			if (mixed) {
-				uint32_t sw 	= sw_state;
-				SWW_SETSTATE(sw, SWTEXT, 1);
-				if (sw != sw_state)
-					line_drawing = _mii_video_get_line_render_cb(video, sw).render;
-			}
-		}
+		uint32_t line_sw = _mii_video_line_sw(sw_state, video->line);
+		if (line_sw != sw_state)
+			line_drawing = _mii_video_get_line_render_cb(
+									video, line_sw).render;
+		video->base_addr = _mii_video_line_addr(line_sw, 0);
+		video->line_addr = _mii_video_line_addr(line_sw, video->line);
+		video->beam_line = video->line;
+		video->beam_sw = sw_state;
+		// when the timer was due, it might have been late
+		video->beam_cycle = mii->timer.now +
+								mii_timer_get(mii, video->timer_id);
 		if (video->lines_dirty[video->line / 64] &
 								(1ULL << (video->line & 63))) {
-			line_drawing(video, sw_state, main, aux);
-
-			uint32_t * screen = video->pixels +
-								(video->line * MII_VIDEO_WIDTH * 2);
-			uint32_t * l2 = screen + MII_VIDEO_WIDTH;
-
-#if defined(__AVX2__)
-			const __m256i mask = _mm256_set1_epi32(C_SCANLINE_MASK);
-			// Process scanline using AVX GCC intrinsic
-			for (int i = 0; i < MII_VIDEO_WIDTH; i += 8) {
-				__m256i src = _mm256_loadu_si256((__m256i *)(screen + i));
-				__m256i result = _mm256_and_si256(src, mask);
-				_mm256_storeu_si256((__m256i *)(l2 + i), result);
-			}
-#elif defined(__SSE2__)
-			const __m128i mask = _mm_set1_epi32(C_SCANLINE_MASK);
-			// Process scanline using SSE GCC intrinsic
-			for (int i = 0; i < MII_VIDEO_WIDTH; i += 4) {
-				__m128i src = _mm_loadu_si128((__m128i *)(screen + i));
-				__m128i result = _mm_and_si128(src, mask);
-				_mm_storeu_si128((__m128i *)(l2 + i), result);
-			}
-#else
-#if 1	// generic vector code -- NEON and wasm?
-			const u32_v mask = C_SCANLINE_MASK - (u32_v){};	// broadcast
-			for (int i = 0; i < MII_VIDEO_WIDTH; i += VEC_ECOUNT,
-							screen += VEC_ECOUNT, l2 += VEC_ECOUNT) {
-				u32_v s = *(u32_v *)screen;
-				s &= mask;
-				*(u32_v *)l2 = s;
-			}
-#else
-			for (int i = 0; i < MII_VIDEO_WIDTH; i++)
-				*l2++ = *screen++ & C_SCANLINE_MASK;
-#endif
-#endif
-
+			_mii_video_draw_line(video, line_drawing, line_sw, video->line,
+					0, 40, main, aux);
 			video->lines_dirty[video->line / 64] &=
 								~(1ULL << (video->line & 63));
 			video->frame_dirty = 1;
@@ -778,6 +1413,8 @@ mii_video_timer_cb(
 			res = video->timer_max * mii->speed;
 			pt_yield(video->state);
 			mii_bank_poke(sw, SWVBL, 0x00);
+			_mii_video_mode_log_flush(video, main, aux);
+			video->beam_line = MII_VIDEO_NO_LINE;
 			video->timer_max = MII_VBL_UP_CYCLES;
 			res = video->timer_max * mii->speed;
 			/*
@@ -792,16 +1429,24 @@ mii_video_timer_cb(
 			if ((new_frame & MII_VIDEO_FLASH_FRAME_MASK) !=
 					(video->frame_count & MII_VIDEO_FLASH_FRAME_MASK)) {
 				if (!SW_GETSTATE(mii, SWALTCHARSET))
-					_mii_video_mark_dirty(video);
+					_mii_video_mark_text_flash(video);
 			}
 			video->frame_count = new_frame;
 			pt_yield(video->state);
 			// check if we need to switch the video mode, in case the UI switches
 			// Color/mono palette etc
 			mii->cpu.instruction_run = 0;	// stop current instruction run!
-			if (video->frame_dirty)
-				video->frame_seed++;
+			if (__atomic_exchange_n(&video->recolor, 0, __ATOMIC_ACQ_REL))
+				_mii_video_recolor(mii);
+			if (video->worker)	// the worker bumps frame_seed when it's done
+				_mii_video_worker_frame(video, mii->cpu.total_cycle);
+			else
+				_mii_video_frame_publish(video, video->frame_dirty,
+						mii->cpu.total_cycle);
 			video->frame_dirty = 0;
+			// start/stop the render thread, from this thread
+			if (video->threaded != !!video->worker)
+				_mii_video_set_worker(mii, video->threaded);
 		} else {
 			video->timer_max = MII_VIDEO_H_CYCLES + MII_VIDEO_HB_CYCLES;
 			res = video->timer_max * mii->speed;
@@ -813,30 +1458,27 @@ mii_video_timer_cb(
 }
 
 /*
- * TODO: this doesn't work yet. Don't get overexcited about this.
- * Or, get overexcited about this and fix it! :-)
- *
- * This is mostly how it's supposed to work anyway. Any 'read' access should
- * be able to deduce where the 'beam' is by looking at what the remaining
- * timer cycles are, and the current line.
- * And then deduce the exact position horizontally on the screen.
- *
- * But, it doesn't really work for now.
+ * 'Floating bus' value, the byte the video is reading. The beam position
+ * is the same one the mode log uses; on the visible part of a line this is
+ * the byte under the beam. The blanking periods are approximated, they
+ * return the first byte of the line (or of the page, in vertical blanking)
+ * where the real scanner reads somewhere else.
  */
 uint8_t
 mii_video_get_vapor(
 		mii_t *mii)
 {
-	uint8_t res = 0;
-	int64_t timer = mii_timer_get(mii, mii->video.timer_id);
-	timer = timer / mii->speed;
-	uint16_t addr = mii->video.line_addr;
-	int64_t current = mii->video.timer_max - timer;
-	addr += current - 25;
-	res = mii_bank_peek(&mii->bank[MII_BANK_MAIN], addr);
-//	printf("VAPOR %5ld/%5ld %04x->%04x %02x\n",
-//			current, mii->video.timer_max, mii->video.line_addr, addr, res);
-	return res;
+	mii_video_t * video = &mii->video;
+	mii_bank_t * main = &mii->bank[MII_BANK_MAIN];
+
+	if (video->beam_line == MII_VIDEO_NO_LINE)
+		return mii_bank_peek(main, video->base_addr);
+	int64_t x = (int64_t)(mii->timer.now - video->beam_cycle) / mii->speed;
+	if (x < 0 || x >= MII_VIDEO_H_CYCLES)
+		x = 0;
+	uint32_t sw = _mii_video_line_sw(mii->sw_state, video->beam_line);
+	return mii_bank_peek(main,
+				_mii_video_line_addr(sw, video->beam_line) + x);
 }
 
 bool
@@ -855,10 +1497,12 @@ mii_access_video(
 		case SWALTCHARSETON:
 			if (!write) break;
 			res = true;
+			// only the lines with characters 0x40-0x7f change
+			if (SW_GETSTATE(mii, SWALTCHARSET) != (addr & 1))
+				_mii_video_mark_text_flash(&mii->video);
 			SW_SETSTATE(mii, SWALTCHARSET, addr & 1);
 			mii_bank_poke(sw, SWALTCHARSET, (addr & 1) << 7);
-			// in case there is some blinking text, we need to redraw
-			_mii_video_mark_dirty(&mii->video);
+			_mii_video_mode_log(mii);
 			break;
 		case SWVBL:
 		case SW80COL:
@@ -879,6 +1523,7 @@ mii_access_video(
 			SW_SETSTATE(mii, SWHIRES, addr & 1);
 			mii_bank_poke(sw, SWHIRES, (addr & 1) << 7);
 			_mii_video_mode_changed(&mii->video, mii->sw_state);
+			_mii_video_mode_log(mii);
 			break;
 		case SWPAGE2OFF:
 		case SWPAGE2ON:
@@ -890,6 +1535,7 @@ mii_access_video(
 			// 80STORE completely changes the meaning of PAGE2
 			if (!SW_GETSTATE(mii, SW80STORE)) {
 				_mii_video_mode_changed(&mii->video, mii->sw_state);
+				_mii_video_mode_log(mii);
 				_mii_video_mark_dirty(&mii->video);
 			}
 		 	break;
@@ -900,6 +1546,7 @@ mii_access_video(
 			SW_SETSTATE(mii, SW80COL, addr & 1);
 			mii_bank_poke(sw, SW80COL, (addr & 1) << 7);
 			_mii_video_mode_changed(&mii->video, mii->sw_state);
+			_mii_video_mode_log(mii);
 			break;
 		case SWDHIRESOFF: 	//  0xc05f,
 		case SWDHIRESON: { 	// = 0xc05e,
@@ -921,6 +1568,7 @@ mii_access_video(
 			mii_bank_poke(sw, SWRDDHIRES, (!(addr & 1)) << 7);
 			_mii_video_mark_dirty(video);
 			_mii_video_mode_changed(&mii->video, mii->sw_state);
+			_mii_video_mode_log(mii);
 		}	break;
 		case SWTEXTOFF:
 		case SWTEXTON:
@@ -928,6 +1576,7 @@ mii_access_video(
 			SW_SETSTATE(mii, SWTEXT, addr & 1);
 			mii_bank_poke(sw, SWTEXT, (addr & 1) << 7);
 			_mii_video_mode_changed(&mii->video, mii->sw_state);
+			_mii_video_mode_log(mii);
 			if (!write)
 				*byte = mii_video_get_vapor(mii);
 			break;
@@ -937,6 +1586,7 @@ mii_access_video(
 			SW_SETSTATE(mii, SWMIXED, addr & 1);
 			mii_bank_poke(sw, SWMIXED, (addr & 1) << 7);
 			_mii_video_mode_changed(&mii->video, mii->sw_state);
+			_mii_video_mode_log(mii);
 			if (!write)
 				*byte = mii_video_get_vapor(mii);
 			break;
@@ -966,6 +1616,119 @@ mii_video_full_refresh(
 	do {
 		mii_video_timer_cb(mii, NULL);
 	} while (!mii_bank_peek(sw, SWVBL));
+	mii_video_sync(mii);
+}
+
+mii_video_frame_t *
+mii_video_get_frame(
+		mii_t *mii)
+{
+	mii_video_t * video = &mii->video;
+
+	video->frames.host = 1;
+	// only the video side sets MII_VIDEO_FRAME_NEW, it can't go away
+	if (!(__atomic_load_n(&video->frames.ready, __ATOMIC_ACQUIRE) &
+				MII_VIDEO_FRAME_NEW)) {
+		if (mii->state == MII_RUNNING)
+			video->frames.duplicated++;
+		return NULL;
+	}
+	uint8_t ready = __atomic_exchange_n(&video->frames.ready,
+						video->frames.front, __ATOMIC_ACQ_REL);
+	video->frames.front = ready & 3;
+	return video->frames.frame[video->frames.front];
+}
+
+void
+mii_video_set_hash(
+		mii_t *mii,
+		bool enabled)
+{
+	mii_video_t * video = &mii->video;
+
+	mii_video_sync(mii);
+	video->hash.enabled = enabled;
+	video->hash.frame = 0;
+	__atomic_store_n(&video->hash.rehash, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t
+mii_video_get_hash(
+		mii_t *mii,
+		uint32_t *seq)
+{
+	mii_video_t * video = &mii->video;
+
+	if (seq)
+		*seq = video->hash.seq;
+	return video->hash.frame;
+}
+
+void
+mii_video_sync(
+		mii_t *mii)
+{
+	mii_video_worker_t * w = mii->video.worker;
+	if (!w)
+		return;
+	_mii_video_worker_wait(w, true);
+}
+
+void
+mii_video_set_threaded(
+		mii_t *mii,
+		bool threaded)
+{
+	mii->video.threaded = threaded;
+}
+
+void
+mii_video_dispose(
+		mii_t *mii)
+{
+	_mii_video_set_worker(mii, false);
+	for (int i = 0; i < 3; i++) {
+		free(mii->video.frames.frame[i]);
+		mii->video.frames.frame[i] = NULL;
+	}
+}
+
+void
+mii_video_snapshot(
+		mii_t *mii,
+		mii_snap_io_t *io)
+{
+	mii_video_t * video = &mii->video;
+	struct {
+		uint8_t 	line, an3_mode;
+		uint16_t 	base_addr, line_addr;
+		uint64_t 	timer_max;
+		uint32_t	frame_count;
+	} v = {
+		.line = video->line,
+		.an3_mode = video->an3_mode, .base_addr = video->base_addr,
+		.line_addr = video->line_addr, .timer_max = video->timer_max,
+		.frame_count = video->frame_count,
+	};
+	mii_snap_io_data(io, MII_SNAP_TAG('V','I','D','S'), &v, sizeof(v));
+	mii_snap_io_pt(io, MII_SNAP_TAG('V','I','D','T'), &video->state,
+			mii_video_timer_cb);
+	if (io->save || io->error)
+		return;
+	video->line = v.line;
+	video->an3_mode = v.an3_mode;
+	video->base_addr = v.base_addr;
+	video->line_addr = v.line_addr;
+	video->timer_max = v.timer_max;
+	video->frame_count = v.frame_count;
+	/* frame_seed isn't restored, it only tells the UI there are new pixels,
+	 * going back would have it skip the redrawn frame below */
+	// the beam position isn't saved, a split on the current line is lost
+	video->beam_line = MII_VIDEO_NO_LINE;
+	video->mode_log_count = 0;
+	// redraw everything, in whatever mode the soft switches say
+	_mii_video_mode_changed(video, mii->sw_state);
+	_mii_video_mark_dirty(video);
 }
 
 void
@@ -975,6 +1738,16 @@ mii_video_init(
 	mii_video_t * video = &mii->video;
 	video->rom = mii_rom_get(
 			mii->emu == MII_EMU_IIC ? "iic_video" : "iiee_video");
+	video->beam_line = MII_VIDEO_NO_LINE;
+	for (int i = 0; i < 3; i++) {
+		if (!video->frames.frame[i])
+			video->frames.frame[i] = calloc(1, sizeof(mii_video_frame_t));
+		memset(video->frames.frame[i]->stale, 0xff,
+				sizeof(video->frames.frame[i]->stale));
+	}
+	video->frames.back = 0;
+	video->frames.ready = 1;
+	video->frames.front = 2;
 	mii->video.timer_id = mii_timer_register(mii,
 				mii_video_timer_cb, NULL, MII_VIDEO_H_CYCLES, __func__);
 	// start the DHRES in color
@@ -1119,6 +1892,120 @@ _mii_rgb_to_lumed_color(
  * It calculates a 'dimmed' version of the colors, and stores them in the
  * clut_low structure, the 'dimmed' colors are used for creating artifacts.
  */
+/*
+ * Pre-render every possible hires byte for the current cluts, this is what
+ * _mii_line_render_hires() copies to the screen. The only thing that crosses
+ * a byte boundary is the 'color changed' dimming of the first pixel, which
+ * the renderer does itself.
+ */
+static void
+_mii_video_hires_lut_build(
+		mii_video_t *video)
+{
+	for (int pal = 0; pal < 2; pal++) {
+		for (int odd = 0; odd < 2; odd++) {
+			for (int run = 0; run < 512; run++) {
+				mii_video_hires_lut_t * l = &video->hires[pal][odd][run];
+				mii_video_hires_ilut_t * il = &video->hires_index[pal][odd][run];
+				uint32_t lastcol = 0;
+				uint8_t lastci = 0;
+				for (int i = 0; i < 7; i++) {
+					uint8_t left = (run >> i) & 1;
+					uint8_t pixel = (run >> (1 + i)) & 1;
+					uint8_t right = (run >> (2 + i)) & 1;
+
+					int idx = 0;	// black
+					if (pixel) {
+						if (left || right) {
+							idx = 9;	// white
+						} else {
+							idx = (pal << 2) + (odd << 1) + (i & 1) + 1;
+						}
+					} else {
+						if (left && right) {
+							idx = (pal << 2) + (odd << 1) + 1 - (i & 1) + 1;
+						}
+					}
+					uint32_t col = video->clut.hires[idx];
+					uint32_t nc = video->clut_low.hires[idx];
+					uint8_t ci = mii_base_clut.hires[idx];
+					uint8_t nci = ci | MII_VIDEO_INDEX_LOW;
+					if (i == 0) {
+						l->first_low = nc;
+						lastcol = col;
+						il->first_low = nci;
+						lastci = ci;
+					}
+					if (col != lastcol) {
+						lastcol = col;
+						col = nc;
+					}
+					if (ci != lastci) {
+						lastci = ci;
+						ci = nci;
+					}
+					l->pixels[i * 2] = l->pixels[i * 2 + 1] = col;
+					il->pixels[i * 2] = il->pixels[i * 2 + 1] = ci;
+				}
+				l->last = lastcol;
+				il->last = lastci;
+			}
+		}
+	}
+	for (int bits = 0; bits < 128; bits++) {
+		mii_video_hires_lut_t * l = &video->hires_mono[bits];
+		uint32_t lastcol = video->clut.mono[bits & 1];
+		l->first_low = lastcol & C_SCANLINE_MASK;
+		for (int i = 0; i < 7; i++) {
+			uint32_t col = video->clut.mono[(bits >> i) & 1];
+			if (col != lastcol) {
+				l->pixels[i * 2] = col & C_SCANLINE_MASK;
+				lastcol = col;
+			} else
+				l->pixels[i * 2] = col;
+			l->pixels[i * 2 + 1] = col;
+		}
+		l->last = lastcol;
+
+		mii_video_hires_ilut_t * il = &video->hires_mono_index[bits];
+		uint8_t lastci = mii_base_clut.mono[bits & 1];
+		il->first_low = lastci | MII_VIDEO_INDEX_MASK;
+		for (int i = 0; i < 7; i++) {
+			uint8_t ci = mii_base_clut.mono[(bits >> i) & 1];
+			if (ci != lastci) {
+				il->pixels[i * 2] = ci | MII_VIDEO_INDEX_MASK;
+				lastci = ci;
+			} else
+				il->pixels[i * 2] = ci;
+			il->pixels[i * 2 + 1] = ci;
+		}
+		il->last = lastci;
+	}
+}
+
+/*
+ * Same for the text modes; the glyph rows only have 7 useful bits, so that's
+ * all the cache needs, whatever character/ROM bank they came from.
+ */
+static void
+_mii_video_text_lut_build(
+		mii_video_t *video)
+{
+	for (int bits = 0; bits < 128; bits++) {
+		for (int pi = 0; pi < 7; pi++) {
+			uint8_t pixel = (bits >> pi) & 1;
+			uint32_t col = video->clut.mono[!pixel];
+			video->text40[bits][pi * 2] = col;
+			video->text40[bits][pi * 2 + 1] = col;
+			video->text80[bits][pi] = col;
+			uint8_t ci = mii_base_clut.mono[!pixel];
+			video->text40_index[bits][pi * 2] = ci;
+			video->text40_index[bits][pi * 2 + 1] = ci;
+			video->text80_index[bits][pi] = ci;
+		}
+	}
+}
+
 void
 mii_video_set_mode(
 		mii_t *mii,
@@ -1131,8 +2018,12 @@ mii_video_set_mode(
 //	printf("%s mode %d\n", __func__, mode);
 	video->color_mode = mode;
 	mii_video_clut_t * clut = &video->clut;
+	mii_color_t old[64];
+	memcpy(old, video->palette, sizeof(old));
 
 	uint32_t base = palettes[mode].mono_color;
+	bool was_mono = video->monochrome;
+	bool was_gray = video->palette[CI_GRAY1] == video->palette[CI_GRAY2];
 	video->monochrome = base != 0;
 	if (video->monochrome) {
 		// convert one set of RGB colors to monochrome. arbitrarily 0
@@ -1185,6 +2076,44 @@ mii_video_set_mode(
 			clut->colors[i] = HI_RGB(br, bg, bb);
 		}
 	}
+	// same colors, by palette index, for the indexed output
+	clut = &video->clut;
+	for (uint i = 0; i < sizeof(clut->colors) / sizeof(clut->colors[0]); i++) {
+		uint8_t ci = mii_base_clut.colors[i];
+		video->palette[ci] = video->clut.colors[i];
+		video->palette[ci | MII_VIDEO_INDEX_LOW] = video->clut_low.colors[i];
+	}
+	for (int i = 0; i < 32; i++)
+		video->palette[i | MII_VIDEO_INDEX_MASK] =
+				video->palette[i] & C_SCANLINE_MASK;
+	__atomic_add_fetch(&video->palette_seq, 1, __ATOMIC_RELEASE);
+	_mii_video_hires_lut_build(video);
+	_mii_video_text_lut_build(video);
+	/* The pixels don't depend on the colors, but monochrome is rendered
+	 * differently, and lores only has an edge between the two grays if they
+	 * are different colors. Setting the same mode redraws it all too */
+	bool gray = video->palette[CI_GRAY1] == video->palette[CI_GRAY2];
+	if (video->monochrome != was_mono || gray != was_gray ||
+			mii->state != MII_RUNNING ||
+			!memcmp(old, video->palette, sizeof(old)))
+		mii_video_full_refresh(mii);
+	else if (video->indexed) {
+		video->frame_seed++;
+		__atomic_store_n(&video->hash.rehash, 1, __ATOMIC_RELEASE);
+	} else {
+		// the oldest colors, if the previous change is still pending
+		if (!__atomic_load_n(&video->recolor, __ATOMIC_ACQUIRE))
+			memcpy(video->recolor_from, old, sizeof(old));
+		__atomic_store_n(&video->recolor, 1, __ATOMIC_RELEASE);
+	}
+}
+
+void
+mii_video_set_indexed(
+		mii_t *mii,
+		bool indexed)
+{
+	mii->video.indexed = indexed;
 	mii_video_full_refresh(mii);
 }
 
@@ -1204,6 +2133,48 @@ _mii_mish_video(
 		printf(" ROM bank %s\n", video->rom_bank ? "ON" : "OFF");
 		printf(" AN3 mode %d\n", video->an3_mode);
 		printf(" Monochrome %s\n", video->monochrome ? "ON" : "OFF");
+		printf(" Indexed %s\n", video->indexed ? "ON" : "OFF");
+		printf(" Render thread %s\n", video->worker ? "ON" : "OFF");
+		printf(" Frames %u, dropped %u, duplicated %u\n",
+				video->frames.seq, video->frames.dropped,
+				video->frames.duplicated);
+		return;
+	}
+	if (!strcmp(argv[1], "frames")) {
+		printf("Frames %u, dropped %u, duplicated %u, cleared\n",
+				video->frames.seq, video->frames.dropped,
+				video->frames.duplicated);
+		video->frames.dropped = video->frames.duplicated = 0;
+		return;
+	}
+	if (!strcmp(argv[1], "hash")) {
+		if (argv[2])
+			mii_video_set_hash(mii,
+					!strcmp(argv[2], "on") || !strcmp(argv[2], "1"));
+		if (!video->hash.enabled) {
+			printf("Frame hash OFF\n");
+			return;
+		}
+		mii_video_sync(mii);
+		uint32_t seq;
+		uint64_t hash = mii_video_get_hash(mii, &seq);
+		printf("Frame %u hash %016lx\n", seq, (unsigned long)hash);
+		return;
+	}
+	if (!strcmp(argv[1], "thread")) {
+		bool on = !video->threaded;
+		if (argv[2])
+			on = !strcmp(argv[2], "on") || !strcmp(argv[2], "1");
+		mii_video_set_threaded(mii, on);
+		printf("Render thread %s\n", on ? "ON" : "OFF");
+		return;
+	}
+	if (!strcmp(argv[1], "indexed")) {
+		bool on = !video->indexed;
+		if (argv[2])
+			on = !strcmp(argv[2], "on") || !strcmp(argv[2], "1");
+		mii_video_set_indexed(mii, on);
+		printf("Indexed output %s\n", video->indexed ? "ON" : "OFF");
 		return;
 	}
 	if (!strcmp(argv[1], "clut")) {
@@ -1290,6 +2261,10 @@ _mii_mish_video(
 	fprintf(stderr, " dirty: force full refresh\n");
 	fprintf(stderr, " rom <name>: set video rom\n");
 	fprintf(stderr, " bank: toggle video rom bank\n");
+	fprintf(stderr, " indexed [on|off]: toggle indexed output\n");
+	fprintf(stderr, " thread [on|off]: toggle the render thread\n");
+	fprintf(stderr, " hash [on|off]: show (or enable) the frame digest\n");
+	fprintf(stderr, " frames: show and clear the dropped/duplicated counters\n");
 }
 
 #include "mish.h"
@@ -1303,6 +2278,10 @@ MISH_CMD_HELP(video,
 		" clut: dump color tables",
 		" color: set color mode",
 		" mono: set mono mode",
-		" dirty: force full refresh"
+		" dirty: force full refresh",
+		" indexed [on|off]: toggle indexed output",
+		" thread [on|off]: toggle the render thread",
+		" hash [on|off]: show (or enable) the frame digest",
+		" frames: show and clear the dropped/duplicated counters"
 		);
 MII_MISH(video, _mii_mish_video);
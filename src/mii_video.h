@@ -23,12 +23,28 @@
 #define MII_VIDEO_WIDTH		(280 * 2)
 #define MII_VIDEO_HEIGHT	(192 * 2)
 
+/* this 'dims' the colors for every second line of pixels
+ * This is a very very cheap filter but it works really well!
+ */
+#define C_SCANLINE_MASK 0xffc0c0c0
+
+/*
+ * Indexed output; when mii_video_t.indexed is set, the line renderers write
+ * one byte per pixel in 'index_pixels' (no scanlines) instead of 'pixels'.
+ * The low 4 bits are a palette color, the flags pick the variant, and
+ * mii_video_t.palette holds the matching 64 colors. The host applies the
+ * palette and the scanlines itself.
+ */
+#define MII_VIDEO_INDEX_LOW		0x10	// low luminance edge color
+#define MII_VIDEO_INDEX_MASK	0x20	// C_SCANLINE_MASK'ed color
+
 struct mii_t;
 struct mii_video_t;
 
 typedef void (*mii_video_line_drawing_cb)(
 					struct mii_video_t *video,
 					uint32_t 			sw,
+					uint8_t 			line,
 					mii_bank_t * 		main,
 					mii_bank_t * 		aux );
 typedef void (*mii_video_line_check_cb)(
@@ -59,6 +75,58 @@ typedef union mii_video_clut_t {
 	mii_color_t 		colors[(2*16) + 16 + 10 /*+ 8*/ + 2 + 2];
 } mii_video_clut_t;
 
+/*
+ * Pre-rendered hires byte; the 7 pixels (doubled) of one byte, for a given
+ * palette bit, column parity and the neighbouring pixels. The first pixel
+ * pair is stored as if the color did not change, the renderer substitutes
+ * 'first_low' if the previous byte ended with another color.
+ */
+typedef struct mii_video_hires_lut_t {
+	mii_color_t 		pixels[14];
+	mii_color_t 		first_low;	// first pixel when dimmed
+	mii_color_t 		last;		// color of the last pixel
+} mii_video_hires_lut_t;
+
+// same, for the indexed output
+typedef struct mii_video_hires_ilut_t {
+	uint8_t 			pixels[14];
+	uint8_t 			first_low;
+	uint8_t 			last;
+} mii_video_hires_ilut_t;
+
+/*
+ * Mode changes made while the beam is on the visible part of a line; that
+ * line is drawn again in segments, with the mode each segment had, when
+ * the beam reaches the next line.
+ */
+#define MII_VIDEO_MODE_LOG_SIZE	16
+#define MII_VIDEO_NO_LINE		0xff	// beam is in vertical blanking
+
+typedef struct mii_video_mode_log_t {
+	uint8_t 			x;			// column (cycle) of the change, 0-39
+	uint32_t 			sw;			// sw_state from that column on
+} mii_video_mode_log_t;
+
+/* A complete frame, handed to the host by mii_video_get_frame() */
+typedef struct mii_video_frame_t {
+	uint32_t 			seq;		// frame number
+	uint64_t 			cycle;		// CPU cycle at the end of the frame
+	uint8_t 			indexed;	// index_pixels is valid, not pixels
+	uint64_t 			hash;		// digest, when mii_video_t.hash is enabled
+	// lines that changed since the previous frame the host got
+	uint64_t 			lines[192 / 64];
+	// lines this copy is missing, for the video side only
+	uint64_t 			stale[192 / 64];
+	/* Copy of mii_video_t.palette, for the index_pixels; that one can
+	 * change at any time, from the UI */
+	uint32_t 			palette_seq;
+	mii_color_t 		palette[64];
+	uint32_t 			pixels[MII_VIDEO_WIDTH * MII_VIDEO_HEIGHT];
+	uint8_t 			index_pixels[MII_VIDEO_WIDTH * (MII_VIDEO_HEIGHT / 2)];
+} mii_video_frame_t;
+
+#define MII_VIDEO_FRAME_NEW		0x80	// in frames.ready
+
 typedef struct mii_video_t {
 	void *				state;		// protothread state in mii_video.c
 	mii_rom_t *			rom;		// video ROM
@@ -72,8 +140,36 @@ typedef struct mii_video_t {
 	uint32_t			frame_count; // incremented every frame
 	uint8_t 			color_mode;	// color palette index
 	uint8_t   			monochrome;	// monochrome mode
+	uint8_t 			indexed;	// render to index_pixels, not pixels
+	uint8_t 			threaded;	// lines are rendered by 'worker'
+	struct mii_video_worker_t * worker;	// render thread, in mii_video.c
 	mii_video_clut_t 	clut;		// current color table
 	mii_video_clut_t	clut_low; 	// low luminance version
+	/*
+	 * Rebuilt from the cluts by mii_video_set_mode(). hires is indexed by
+	 * [palette bit][column parity][previous pixel, 7 pixels, next pixel],
+	 * hires_mono only by the 7 pixels.
+	 */
+	mii_video_hires_lut_t	hires[2][2][512];
+	mii_video_hires_lut_t	hires_mono[128];
+	// text glyph rows (7 bits) expanded for 40 and 80 columns
+	mii_color_t 		text40[128][14];
+	mii_color_t 		text80[128][7];
+	// same tables, for the indexed output
+	mii_video_hires_ilut_t	hires_index[2][2][512];
+	mii_video_hires_ilut_t	hires_mono_index[128];
+	uint8_t 			text40_index[128][14];
+	uint8_t 			text80_index[128][7];
+	// colors for the index_pixels, see MII_VIDEO_INDEX_*
+	mii_color_t 		palette[64];
+	// bumped once 'palette' is updated, the frames copy it when it changes
+	uint32_t 			palette_seq;
+	// line the beam is on, when it started, and the sw_state it had then
+	uint8_t 			beam_line;
+	uint64_t 			beam_cycle;
+	uint32_t 			beam_sw;
+	uint8_t 			mode_log_count;
+	mii_video_mode_log_t	mode_log[MII_VIDEO_MODE_LOG_SIZE];
 	// function pointer to the line drawing function
 	mii_video_cb_t		line_cb;
 	uint8_t 			frame_dirty;
@@ -84,6 +180,54 @@ typedef struct mii_video_t {
 	 * by the video thread when the line is updated (converted to pixels)
 	 */
 	uint64_t 			lines_dirty[192 / 64]; // 192 lines / 64 bits
+	// lines drawn this frame, published at the end of it
+	uint64_t 			frame_lines[192 / 64];
+	// lines with characters 0x40-0x7f when they were drawn; the ones that
+	// flash, or change with the alt charset
+	uint64_t 			text_flash[192 / 64];
+	/*
+	 * Set by mii_video_set_mode() when only the colors changed; the RGBA
+	 * pixels are recolored from 'recolor_from' at the end of the frame
+	 * instead of being drawn again.
+	 */
+	uint8_t 			recolor;
+	mii_color_t 		recolor_from[64];
+	/*
+	 * Completed frames, triple buffered. The video copies the lines it drew
+	 * to 'back' at the end of each frame, and swaps it with 'ready'. The
+	 * host swaps 'ready' with its 'front' in mii_video_get_frame(). Neither
+	 * side ever waits for the other.
+	 */
+	struct {
+		mii_video_frame_t *	frame[3];
+		uint8_t 			back, front;
+		uint8_t 			ready;		// | MII_VIDEO_FRAME_NEW
+		uint8_t 			host;		// the host has asked for a frame
+		uint32_t 			seq;
+		uint32_t 			dropped;	// never seen by the host
+		uint32_t 			duplicated;	// host asked, there was no new one
+	}					frames;
+	// optional, called with each frame as it is published, on the thread
+	// that draws the lines
+	struct {
+		void (*cb)(
+				struct mii_video_t *video,
+				const mii_video_frame_t *frame,
+				void *param);
+		void *				param;
+	}					frame_hook;
+	/*
+	 * Digest of each published frame, see mii_video_set_hash(). Only the
+	 * lines drawn during the frame are hashed again, the frame digest is
+	 * the hash of the 192 line hashes.
+	 */
+	struct {
+		uint8_t 			enabled;
+		uint8_t 			rehash;		// all lines, at the next frame
+		uint32_t 			seq;		// frame the digest is for
+		uint64_t 			frame;
+		uint64_t 			line[192];
+	}					hash;
 
 #if MII_VIDEO_DEBUG_HEAPMAP
 	uint8_t 			video_hmap[192]
@@ -92,6 +236,8 @@ typedef struct mii_video_t {
 	// alignment is required for vector extensions
 	uint32_t 			pixels[MII_VIDEO_WIDTH * MII_VIDEO_HEIGHT]
 			__attribute__((aligned(32)));
+	uint8_t 			index_pixels[MII_VIDEO_WIDTH * (MII_VIDEO_HEIGHT / 2)]
+			__attribute__((aligned(32)));
 } mii_video_t;
 
 bool
@@ -108,6 +254,48 @@ void
 mii_video_set_mode(
 		struct mii_t *mii,
 		uint8_t mode);
+/* Switch between the RGBA 'pixels' and the indexed 'index_pixels' output */
+void
+mii_video_set_indexed(
+		struct mii_t *mii,
+		bool indexed);
+/*
+ * Render the lines on a separate thread; the emulation thread only queues
+ * the dirty lines. This takes effect at the end of the current frame.
+ */
+void
+mii_video_set_threaded(
+		struct mii_t *mii,
+		bool threaded);
+/*
+ * Return the latest complete frame, or NULL if there hasn't been a new one
+ * since the last call. The frame stays valid until the next call.
+ */
+mii_video_frame_t *
+mii_video_get_frame(
+		struct mii_t *mii);
+/*
+ * Hash each frame as it is published, for regression tests. The digest is
+ * the same for the RGBA and the indexed output, the scanlines aren't part
+ * of it. See mii_video_get_hash().
+ */
+void
+mii_video_set_hash(
+		struct mii_t *mii,
+		bool enabled);
+/* Return the digest of the latest published frame, and its number in 'seq'
+ * (if not NULL). Call mii_video_sync() first if the render thread is on */
+uint64_t
+mii_video_get_hash(
+		struct mii_t *mii,
+		uint32_t *seq);
+/* Wait for the render thread to have drawn all the queued lines */
+void
+mii_video_sync(
+		struct mii_t *mii);
+void
+mii_video_dispose(
+		struct mii_t *mii);
 /*
  * Out of bounds write check. This allow SmartPort DMA drive to pass down the
  * range it writes buffers to, so the video gets a chance to check if the
@@ -122,3 +310,9 @@ mii_video_OOB_write_check(
 uint8_t
 mii_video_get_vapor(
 		struct mii_t *mii);
+struct mii_snap_io_t;
+/* save/restore the video state, see mii_snapshot.h */
+void
+mii_video_snapshot(
+		struct mii_t *mii,
+		struct mii_snap_io_t *io);
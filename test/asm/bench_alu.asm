@@ -0,0 +1,22 @@
+; Benchmark: tight ALU loop on zero page, never ends
+			.org	$0800
+start		LDX		#$00
+			LDY		#$00
+			CLC
+loop		TXA
+			ADC		#$35
+			EOR		$10
+			STA		$10
+			ASL
+			ROR		$11
+			INC		$12
+			AND		#$7F
+			ORA		$13
+			STA		$13
+			DEX
+			BNE		loop
+			INY
+			CMP		$10
+			BCS		skip
+			SBC		#$01
+skip		BRA		loop
@@ -0,0 +1,23 @@
+; Benchmark: fills HIRES page 1 over and over, with a pattern that changes
+; every pass, never ends
+			.org	$0800
+			LDA		$C050	; graphics
+			LDA		$C052	; full screen
+			LDA		$C054	; page 1
+			LDA		$C057	; hires
+			STZ		$02
+frame		LDA		#$20
+			STA		$01
+			STZ		$00
+			LDY		#$00
+			LDA		$02
+fill		STA		($00),Y
+			INY
+			BNE		fill
+			LDX		$01
+			INX
+			STX		$01
+			CPX		#$40
+			BNE		fill
+			INC		$02
+			BRA		frame
@@ -0,0 +1,320 @@
+/*
+ * mii_bench.c
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * Host side throughput benchmark. This runs a fixed set of workloads, some
+ * on the bare CPU core with a flat 64KB of RAM, the others on a full machine
+ * with mii_run_cycles(), and prints the emulated MHz and the host ns per
+ * emulated cycle of each of them as JSON, so the results can be compared
+ * across commits. The workloads are all in test/asm/ and disks/, and have a
+ * fixed cycle budget, so they are repeatable.
+ *
+ *   make bench
+ *   build-x86_64-linux-gnu/bin/mii_bench --repeat 5 --only dos33_boot
+ *
+ * Anything the emulator prints goes to stderr, only the JSON goes to stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mii.h"
+#include "mii_65c02_asm.h"
+#include "mii_65c02_ops.h"
+
+// so mii_mish_cmd can access the global mii_t
+mii_t g_mii;
+
+enum {
+	MII_BENCH_CPU = 0,		// bare CPU core, flat RAM
+	MII_BENCH_MACHINE,		// full machine, mii_run_cycles()
+};
+
+typedef struct mii_bench_t {
+	const char *	name;
+	uint8_t 		kind;
+	/* .asm file is assembled and loaded at its .org, .bin is loaded at 0 and
+	 * starts at $400, like the functional tests */
+	const char *	file;
+	const char *	args;		// mii_argv_parse() arguments, for machines
+	uint64_t		cycles;		// cycle budget
+} mii_bench_t;
+
+static const mii_bench_t _mii_bench[] = {
+	{ .name = "alu", .kind = MII_BENCH_CPU,
+		.file = "test/asm/bench_alu.asm",
+		.cycles = 100000000, },
+	{ .name = "functional", .kind = MII_BENCH_CPU,
+		.file = "test/asm/6502_functional_test.bin",
+		.cycles = 200000000, },	// ends on its own, at ~96M cycles
+	{ .name = "hgr_fill", .kind = MII_BENCH_MACHINE,
+		.file = "test/asm/bench_hgr.asm",
+		.args = "",
+		.cycles = 20000000, },
+	{ .name = "dos33_boot", .kind = MII_BENCH_MACHINE,
+		.args = "-def -d 6:1 disks/dos33master.nib",
+		.cycles = 10000000, },
+	{ .name = "prodos_boot", .kind = MII_BENCH_MACHINE,
+		.args = "-def -d 7:1 disks/GamesWithFirmware.po",
+		.cycles = 10000000, },
+	{ },
+};
+
+typedef struct mii_bench_result_t {
+	uint64_t		cycles;
+	uint16_t		pc;			// where the CPU ended up, as a sanity check
+	double			best;		// seconds
+	double			runs[16];
+} mii_bench_result_t;
+
+static double
+_mii_bench_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/*
+ * Load a workload file in 'ram', returns the start address, or -1
+ */
+static int
+_mii_bench_load(
+		const char *file,
+		uint8_t *ram)
+{
+	FILE *f = fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	const char *ext = strrchr(file, '.');
+	if (ext && !strcmp(ext, ".bin")) {
+		fread(ram, 1, 0x10000 - 0x400, f);
+		fclose(f);
+		return 0x400;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *src = calloc(1, size + 1);
+	fread(src, 1, size, f);
+	fclose(f);
+
+	mii_cpu_asm_program_t p = {};
+	int res = mii_cpu_asm(&p, src);
+	free(src);
+	if (res != 0) {
+		fprintf(stderr, "%s: assembly failed\n", file);
+		mii_cpu_asm_free(&p);
+		return -1;
+	}
+	memcpy(ram + p.org, p.output, p.output_len);
+	res = p.org;
+	mii_cpu_asm_free(&p);
+	return res;
+}
+
+static mii_cpu_state_t
+_mii_bench_access(
+		mii_cpu_t *cpu,
+		mii_cpu_state_t s)
+{
+	uint8_t *ram = cpu->access_param;
+	if (s.w)	ram[s.addr] = s.data;
+	else 		s.data = ram[s.addr];
+	return s;
+}
+
+/* A JMP to itself is how the functional tests signal they are done */
+static int
+_mii_bench_stuck(
+		const uint8_t *ram,
+		uint16_t pc)
+{
+	return ram[pc] == 0x4c &&
+			(ram[(uint16_t)(pc + 1)] | (ram[(uint16_t)(pc + 2)] << 8)) == pc;
+}
+
+static int
+_mii_bench_run_cpu(
+		const mii_bench_t *b,
+		mii_bench_result_t *r,
+		double *elapsed)
+{
+	uint8_t *ram = calloc(1, 0x10000);
+	int pc = _mii_bench_load(b->file, ram);
+	if (pc < 0) {
+		free(ram);
+		return -1;
+	}
+	mii_cpu_t cpu = {};
+	mii_cpu_state_t s = {};
+	cpu.access = _mii_bench_access;
+	cpu.access_param = ram;
+	MII_SET_P(&cpu, (1 << B_X) | (1 << B_I));
+	cpu.S = 0xff;
+	cpu.PC = pc;
+
+	double start = _mii_bench_time();
+	do {
+		cpu.instruction_run = 10000;
+		s = mii_cpu_run(&cpu, s);
+	} while (cpu.total_cycle < b->cycles && !_mii_bench_stuck(ram, cpu.PC));
+	*elapsed = _mii_bench_time() - start;
+
+	r->cycles = cpu.total_cycle;
+	r->pc = cpu.PC;
+	free(ram);
+	return 0;
+}
+
+static int
+_mii_bench_run_machine(
+		const mii_bench_t *b,
+		mii_bench_result_t *r,
+		double *elapsed)
+{
+	mii_t *mii = &g_mii;
+	const char *argv[16] = { "mii_bench" };
+	int argc = 1;
+	char *args = strdup(b->args);
+	for (char *a = args, *w; (w = strsep(&a, " ")) && argc < 15; )
+		if (*w)
+			argv[argc++] = w;
+	argv[argc] = NULL;
+
+	mii_init(mii);
+	int idx = 1;
+	uint32_t flags = MII_INIT_DEFAULT | MII_INIT_SILENT;
+	int res = mii_argv_parse(mii, argc, argv, &idx, &flags);
+	free(args);
+	if (res != 1) {
+		mii_dispose(mii);
+		return -1;
+	}
+	mii->audio.drv = NULL;
+	mii_prepare(mii, flags);
+	mii_reset(mii, true);
+
+	if (b->file) {
+		// let the ROM initialize the machine first, this isn't timed
+		mii_run_cycles(mii, 1000000, 0);
+		uint8_t *ram = calloc(1, 0x10000);
+		int pc = _mii_bench_load(b->file, ram);
+		if (pc < 0) {
+			free(ram);
+			mii_dispose(mii);
+			return -1;
+		}
+		for (int i = 0; i < 0x10000; i++)
+			if (ram[i])
+				mii_mem_access(mii, i, ram + i, true, false);
+		free(ram);
+		mii->cpu.PC = pc;
+	}
+	uint64_t start_cycle = mii->cpu.total_cycle;
+	double start = _mii_bench_time();
+	while (mii->state == MII_RUNNING &&
+			mii->cpu.total_cycle - start_cycle < b->cycles)
+		mii_run_cycles(mii,
+				b->cycles - (mii->cpu.total_cycle - start_cycle), 0);
+	*elapsed = _mii_bench_time() - start;
+
+	r->cycles = mii->cpu.total_cycle - start_cycle;
+	r->pc = mii->cpu.PC;
+	mii_dispose(mii);
+	return 0;
+}
+
+static void
+_mii_bench_usage(
+		const char *progname)
+{
+	fprintf(stderr, "Usage: %s [--repeat <count>] [--only <name>]\n",
+			progname);
+	fprintf(stderr, "  Runs each workload <count> times (default 3), the "
+			"best run is used\n");
+	fprintf(stderr, "  Workloads:");
+	for (int i = 0; _mii_bench[i].name; i++)
+		fprintf(stderr, " %s", _mii_bench[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(
+		int argc,
+		const char * argv[])
+{
+	int repeat = 3;
+	const char *only = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--repeat") && i < argc - 1) {
+			repeat = atoi(argv[++i]);
+			if (repeat < 1)
+				repeat = 1;
+			if (repeat > 16)
+				repeat = 16;
+		} else if (!strcmp(argv[i], "--only") && i < argc - 1) {
+			only = argv[++i];
+		} else {
+			_mii_bench_usage(argv[0]);
+			exit(!!strcmp(argv[i], "-h") && !!strcmp(argv[i], "--help"));
+		}
+	}
+	/* The emulator is chatty, keep stdout for the JSON */
+	fflush(stdout);
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"pack_p\": %d,\n", MII_65C02_PACK_P);
+	fprintf(out, "  \"threaded\": %d,\n", MII_65C02_THREADED);
+	fprintf(out, "  \"repeat\": %d,\n", repeat);
+	fprintf(out, "  \"workloads\": [");
+	int count = 0, errors = 0;
+	for (int i = 0; _mii_bench[i].name; i++) {
+		const mii_bench_t *b = &_mii_bench[i];
+		if (only && strcmp(only, b->name))
+			continue;
+		mii_bench_result_t r = { .best = -1 };
+		int res = 0;
+		for (int ri = 0; ri < repeat && res == 0; ri++) {
+			double elapsed = 0;
+			res = b->kind == MII_BENCH_CPU ?
+						_mii_bench_run_cpu(b, &r, &elapsed) :
+						_mii_bench_run_machine(b, &r, &elapsed);
+			r.runs[ri] = elapsed;
+			if (r.best < 0 || elapsed < r.best)
+				r.best = elapsed;
+		}
+		if (res != 0) {
+			fprintf(stderr, "%s: workload %s failed\n", argv[0], b->name);
+			errors++;
+			continue;
+		}
+		fprintf(out, "%s\n    { \"name\": \"%s\", \"kind\": \"%s\", "
+				"\"cycles\": %lu, \"pc\": \"%04x\",\n",
+				count++ ? "," : "", b->name,
+				b->kind == MII_BENCH_CPU ? "cpu" : "machine",
+				(unsigned long)r.cycles, r.pc);
+		fprintf(out, "      \"seconds\": %.6f, \"mhz\": %.3f, "
+				"\"ns_per_cycle\": %.3f,\n",
+				r.best, r.best > 0 ? r.cycles / r.best / 1e6 : 0,
+				r.cycles ? r.best * 1e9 / r.cycles : 0);
+		fprintf(out, "      \"runs\": [");
+		for (int ri = 0; ri < repeat; ri++)
+			fprintf(out, "%s%.6f", ri ? ", " : "", r.runs[ri]);
+		fprintf(out, "] }");
+		fflush(out);
+	}
+	fprintf(out, "\n  ]\n}\n");
+	fclose(out);
+	return errors ? 1 : 0;
+}
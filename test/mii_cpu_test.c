@@ -51,6 +51,68 @@ _run_one_dump_state(
 }
 
 
+/*
+ * FNV-1a hash of every bus access, and of the P register at each opcode
+ * fetch. Two builds of the core (packed and lazy flags) have to end up with
+ * the same hash for the big tests, which means they are cycle for cycle
+ * identical.
+ */
+static uint32_t _trace_hash;
+
+static void
+_trace_access(
+	mii_cpu_t *cpu,
+	mii_cpu_state_t s)
+{
+	uint8_t p = 0;
+	if (s.sync)
+		MII_GET_P(cpu, p);
+	uint8_t b[5] = { s.addr, s.addr >> 8, s.data, s.w | (s.sync << 1), p };
+	for (int i = 0; i < 5; i++)
+		_trace_hash = (_trace_hash ^ b[i]) * 16777619;
+}
+
+#if MII_65C02_DIRECT_ACCESS
+static mii_cpu_state_t
+_run_one_access(
+	mii_cpu_t *cpu,
+	mii_cpu_state_t s)
+{
+	if (s.w)	cpu->ram[s.addr] = s.data;
+	else 		s.data = cpu->ram[s.addr];
+	_trace_access(cpu, s);
+	return s;
+}
+#endif
+
+/*
+ * Run the CPU for one 'step'; with the protothread core, that is one cycle,
+ * with the direct access core, that is one whole instruction. Either way,
+ * s.sync is set when the next opcode is about to be fetched, so the tests can
+ * check the state at that point, regardless of the core.
+ */
+static mii_cpu_state_t
+_run_one_step(
+	mii_cpu_t *cpu,
+	mii_cpu_state_t s)
+{
+#if MII_65C02_DIRECT_ACCESS
+	cpu->access = _run_one_access;
+	cpu->instruction_run = 0;
+	s = mii_cpu_run(cpu, s);
+	s.sync = 1;
+	s.w = 0;
+	s.addr = cpu->PC;
+	s.data = cpu->ram[cpu->PC];
+#else
+	s = mii_cpu_run(cpu, s);
+	if (s.w)	cpu->ram[s.addr] = s.data;
+	else 		s.data = cpu->ram[s.addr];
+	_trace_access(cpu, s);
+#endif
+	return s;
+}
+
 static int
 _run_one_test(
 	const char *prog,
@@ -77,16 +139,14 @@ _run_one_test(
 	if (verbose) {
 	//	cpu.debug = _run_one_dump_state;
 	}
-	cpu.P._R = 1;
+	MII_SET_P(&cpu, 1 << B_X);
   	cpu.S = 0xFF;
 	cpu.PC = p.org;
 	cpu.A = 0x01;
 	int count = 1000;
 	int error = 1;
 	do {
-		s = mii_cpu_run(&cpu, s);
-		if (s.w)	ram[s.addr] = s.data;
-		else 		s.data = ram[s.addr];
+		s = _run_one_step(&cpu, s);
 		if (verbose)
 			_run_one_dump_state(&cpu, s, NULL);
 		if (s.sync && !s.w && s.data == 0x00) {
@@ -145,16 +205,14 @@ _run_this_one(
 	mii_cpu_state_t s = {0};
 	verbose += p.verbose;
 	cpu.ram = ram;
-	cpu.P._R = 1;
+	MII_SET_P(&cpu, 1 << B_X);
 	expected_flags |= (1 << B_X);
   	cpu.S = 0xFF;
 	cpu.PC = p.org;
 	cpu.A = 0x01;
 	int count = 1000;
 	do {
-		s = mii_cpu_run(&cpu, s);
-		if (s.w)	ram[s.addr] = s.data;
-		else 		s.data = ram[s.addr];
+		s = _run_one_step(&cpu, s);
 		if (verbose)
 			_run_one_dump_state(&cpu, s, NULL);
 		if (s.sync && !s.w && s.data == 0x00) {
@@ -348,7 +406,7 @@ int main()
 		0x2D, C, 0);
 	_run_this("ADC ($12) SED",
 		indirect("SED", 0x75, 0x25, "ADC ($12)"),
-		0x00, V | C | D, 0);
+		0x00, Z | V | C | D, 0);
 	_run_this("AND ($12)",
 		indirect("", 0x3F, 0xFC, "AND ($12)"),
 		0x3C, 0, 0);
@@ -455,7 +513,7 @@ int main()
 	_run_this("SED ADC 10", doSED_ADC(0x10, 0), 0x10, D, 0);
 	_run_this("SED ADC 1D", doSED_ADC(0x1D, 0), 0x23, D, 0);
 	_run_this("SED ADC 99", doSED_ADC(0x99, 0), 0x99, N | D, 0);
-	_run_this("SED ADC 99", doSED_ADC(0x99, 1), 0x00, C | D, 0);
+	_run_this("SED ADC 99", doSED_ADC(0x99, 1), 0x00, Z | C | D, 0);
 	_run_this("SED ADC BD", doSED_ADC(0xBD, 0), 0x23, C | D, 0);
 	_run_this("SED ADC FF", doSED_ADC(0xFF, 0), 0x65, C | D , 0);
 
@@ -467,18 +525,18 @@ int main()
 	_run_this("SED ADC 0,BD", doSED_ADC(0, 0xBD), 0x23, C | D, 0);
 	_run_this("SED ADC 0,FF", doSED_ADC(0, 0xFF), 0x65, C | D, 0);
 
-	_run_this("SED ADC 99,1", doSED_ADC(0x99, 1), 0x0, C | D, 0);
+	_run_this("SED ADC 99,1", doSED_ADC(0x99, 1), 0x0, Z | C | D, 0);
 	_run_this("SED ADC 35,35", doSED_ADC(0x35, 0x35), 0x70, D, 0);
 	_run_this("SED ADC 45,45", doSED_ADC(0x45, 0x45), 0x90, N | V | D, 0);
-	_run_this("SED ADC 50,50", doSED_ADC(0x50, 0x50), 0x0, V | C | D, 0);
+	_run_this("SED ADC 50,50", doSED_ADC(0x50, 0x50), 0x0, Z | V | C | D, 0);
 	_run_this("SED ADC 99,99", doSED_ADC(0x99, 0x99), 0x98, N | V | C | D, 0);
 	_run_this("SED ADC B1,C1", doSED_ADC(0xB1, 0xC1), 0xD2, N | V | C | D, 0);
 
 	// create an emulator, load the binary file 6502_functional_test.bin at $0000
 	// and run it until we hit a BRK
 	const char *bigtest[] = {
-	//	"test/asm/6502_functional_test.bin",
-	//	"test/asm/65C02_extended_opcodes_test.bin",
+		"test/asm/6502_functional_test.bin",
+		"test/asm/65C02_extended_opcodes_test.bin",
 		NULL,
 	};
 	for (int ti = 0; bigtest[ti]; ti++) {
@@ -495,18 +553,17 @@ int main()
 		mii_cpu_state_t s = {0};
 		cpu.ram = ram;
 //		cpu.debug = _run_one_dump_state;
-		cpu.P._R = 1;
+		MII_SET_P(&cpu, 1 << B_X);
 		cpu.P.I = 1;
 		cpu.S = 0xFF;
 		cpu.PC = 0x400;
 		cpu.A = 0x00;
+		_trace_hash = 2166136261;
 		int count = 100000000;
 		int same_pc_count = 0;
 		uint16_t prev_pc = 0;
 		do {
-			s = mii_cpu_run(&cpu, s);
-			if (s.w)	ram[s.addr] = s.data;
-			else 		s.data = ram[s.addr];
+			s = _run_one_step(&cpu, s);
 			if (s.sync && !s.w) {
 				if (cpu.PC == prev_pc) {
 					same_pc_count++;
@@ -531,6 +588,8 @@ int main()
 		//		_run_one_dump_state(&cpu, s, NULL);
 		} while (count--);
 		printf("TEST run with %d spare\n", count);
+		printf("TEST %s: %lu cycles, trace %08x\n", bigtest[ti],
+				(unsigned long)cpu.total_cycle, _trace_hash);
 		_run_one_dump_state(&cpu, s, NULL);
 		if (!count) {
 			printf("TEST %s: FAIL (out of _run_this cycles!)\n",
@@ -0,0 +1,450 @@
+/*
+ * mii_headless.c
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * Headless 'turbo' runner. This configures a machine using the normal
+ * mii_argv_parse() arguments, then runs it as fast as the host allows, with
+ * no wall clock regulation at all, using mii_run_cycles(). The run is
+ * bounded by a cycle and/or frame budget, and can stop early on an 'exit
+ * condition' (PC reached, memory matching a value). A keyboard script can be 'typed' into the
+ * machine, one key every time the previous one has been consumed.
+ *
+ * This is meant for batch testing of disk images, ie:
+ *   mii_headless --frames 600 --until-mem 0400=c4 -def -d 6:1 disks/dos33.nib
+ *
+ * The machine state can be saved when the run stops, and restored before it
+ * starts, so a long boot sequence only has to be run once, ie:
+ *   mii_headless --frames 600 --save-snapshot boot.snap -d 6:1 disks/dos33.nib
+ *   mii_headless --load-snapshot boot.snap --frames 60 -d 6:1 disks/dos33.nib
+ *
+ * The screen can be checked against 'golden' frame digests (see
+ * mii_video_set_hash()). --hash-save writes the digest of every frame, as
+ * '<frame> <digest>' lines; the ones worth checking are kept in a golden
+ * file, that --hash-check compares the run with, ie:
+ *   mii_headless --frames 120 --hash-save boot.hash -def
+ *   mii_headless --frames 120 --hash-check boot.golden -def
+ * Frames are numbered from the start of the run, the first one is 1.
+ *
+ * Exit status is 0 if an exit condition was met (or if there was none, and
+ * the budget ran out), 2 if the budget ran out before any exit condition
+ * was met, 3 if a frame didn't match its digest, 1 for errors.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "mii.h"
+#include "mii_sw.h"
+#include "mii_snapshot.h"
+#include "mii_capture.h"
+
+// so mii_mish_cmd can access the global mii_t
+mii_t g_mii;
+
+#define MII_HL_MEM_MAX	8
+
+typedef struct mii_hl_golden_t {
+	uint32_t		frame;
+	uint64_t		hash;
+	bool			checked;
+} mii_hl_golden_t;
+
+typedef struct mii_headless_t {
+	uint64_t 		cycles;		// cycle budget, 0 = none
+	uint32_t 		frames;		// frame budget, 0 = none
+	int 			quiet;
+	const char *	snap_load;	// snapshot to restore before running
+	const char *	snap_save;	// snapshot to save when stopping
+	struct {
+		char *		buffer;		// keys left to 'type', converted
+		uint32_t	index;
+		uint32_t	delay;		// frames to wait before the first key
+	}				keys;
+	int 			pc;			// PC exit condition, -1 = none
+	int 			mem_count;
+	struct {
+		uint16_t	addr;
+		uint8_t		value;
+	}				mem[MII_HL_MEM_MAX];
+	struct {
+		const char *	check;	// golden file
+		FILE *			save;
+		mii_hl_golden_t * golden;
+		uint32_t		count;
+		uint32_t		start, last;	// frame sequence numbers
+		uint32_t		errors;
+	}				hash;
+} mii_headless_t;
+
+static void
+_mii_hl_usage(
+		const char *progname)
+{
+	printf("Usage: %s [headless options] [mii options]\n", progname);
+	printf("Headless options:\n");
+	printf("  --cycles <count>\tStop after <count> CPU cycles\n");
+	printf("  --frames <count>\tStop after <count> video frames\n");
+	printf("  --keys <string>\tType <string> on the keyboard, C escapes\n");
+	printf("\t\tare recognized, \\n is converted to Return\n");
+	printf("  --key-delay <frames>\tWait <frames> before typing\n");
+	printf("  --until-pc <addr>\tStop when PC reaches (hex) <addr>\n");
+	printf("  --until-mem <addr>=<value>\tStop when (hex) <addr> reads\n");
+	printf("\t\t(hex) <value>. Checked every frame, can be repeated,\n");
+	printf("\t\tall of them have to match\n");
+	printf("  --load-snapshot <file>\tRestore <file> before running\n");
+	printf("  --save-snapshot <file>\tSave the machine state to <file>\n");
+	printf("\t\twhen stopping\n");
+	printf("  --hash-save <file>\tWrite the digest of each frame\n");
+	printf("\t\tto <file>\n");
+	printf("  --hash-check <file>\tCompare the frames listed in\n");
+	printf("\t\t<file> with their digest\n");
+	printf("  -q, --quiet\tDon't print the summary\n");
+	printf("Use --help to list the mii options\n");
+}
+
+/* Convert the C escapes, and newlines to Apple II 'Return' */
+static char *
+_mii_hl_unescape(
+		const char *s)
+{
+	char *res = calloc(1, strlen(s) + 1);
+	char *d = res;
+	while (*s) {
+		char c = *s++;
+		if (c == '\\' && *s) {
+			c = *s++;
+			switch (c) {
+				case 'n':
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'e': c = 0x1b; break;
+				case 'x': {	// \xHH, two digits max
+					char hex[3] = {};
+					for (int i = 0; i < 2 && isxdigit(*s); i++)
+						hex[i] = *s++;
+					c = strtol(hex, NULL, 16);
+				}	break;
+			}
+		} else if (c == '\n')
+			c = '\r';
+		*d++ = c;
+	}
+	*d = 0;
+	return res;
+}
+
+/*
+ * Extract our own options from argv, copy the remaining ones to 'out'
+ * for mii_argv_parse(). Returns the new argc, or -1 on errors.
+ */
+static int
+_mii_hl_parse(
+		mii_headless_t *hl,
+		int argc,
+		const char *argv[],
+		const char *out[])
+{
+	int outc = 0;
+	out[outc++] = argv[0];
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *val = i < argc - 1 ? argv[i + 1] : NULL;
+
+		if (!strcmp(arg, "--cycles") && val) {
+			hl->cycles = strtoull(val, NULL, 0);
+			i++;
+		} else if (!strcmp(arg, "--frames") && val) {
+			hl->frames = strtoul(val, NULL, 0);
+			i++;
+		} else if (!strcmp(arg, "--keys") && val) {
+			free(hl->keys.buffer);
+			hl->keys.buffer = _mii_hl_unescape(val);
+			hl->keys.index = 0;
+			i++;
+		} else if (!strcmp(arg, "--key-delay") && val) {
+			hl->keys.delay = strtoul(val, NULL, 0);
+			i++;
+		} else if (!strcmp(arg, "--until-pc") && val) {
+			hl->pc = strtol(val, NULL, 16) & 0xffff;
+			i++;
+		} else if (!strcmp(arg, "--until-mem") && val) {
+			unsigned int addr, value;
+			if (sscanf(val, "%x=%x", &addr, &value) != 2) {
+				printf("%s: invalid memory condition %s\n", argv[0], val);
+				return -1;
+			}
+			if (hl->mem_count == MII_HL_MEM_MAX) {
+				printf("%s: too many memory conditions\n", argv[0]);
+				return -1;
+			}
+			hl->mem[hl->mem_count].addr = addr;
+			hl->mem[hl->mem_count].value = value;
+			hl->mem_count++;
+			i++;
+		} else if (!strcmp(arg, "--load-snapshot") && val) {
+			hl->snap_load = val;
+			i++;
+		} else if (!strcmp(arg, "--save-snapshot") && val) {
+			hl->snap_save = val;
+			i++;
+		} else if (!strcmp(arg, "--hash-save") && val) {
+			if (hl->hash.save)
+				fclose(hl->hash.save);
+			hl->hash.save = fopen(val, "w");
+			if (!hl->hash.save) {
+				perror(val);
+				return -1;
+			}
+			i++;
+		} else if (!strcmp(arg, "--hash-check") && val) {
+			hl->hash.check = val;
+			i++;
+		} else if (!strcmp(arg, "-q") || !strcmp(arg, "--quiet")) {
+			hl->quiet = 1;
+		} else if (!strcmp(arg, "--headless-help")) {
+			_mii_hl_usage(argv[0]);
+			exit(0);
+		} else
+			out[outc++] = arg;
+	}
+	out[outc] = NULL;
+	return outc;
+}
+
+static bool
+_mii_hl_mem_match(
+		mii_t *mii,
+		mii_headless_t *hl)
+{
+	if (!hl->mem_count)
+		return false;
+	for (int i = 0; i < hl->mem_count; i++)
+		if (mii_read_one(mii, hl->mem[i].addr) != hl->mem[i].value)
+			return false;
+	return true;
+}
+
+/* 'type' the next key of the script, if the previous one was consumed */
+static void
+_mii_hl_keys(
+		mii_t *mii,
+		mii_headless_t *hl)
+{
+	if (!hl->keys.buffer || mii->video.frame_count < hl->keys.delay)
+		return;
+	if (hl->keys.buffer[hl->keys.index] == 0) {
+		free(hl->keys.buffer);
+		hl->keys.buffer = NULL;
+		return;
+	}
+	mii_bank_t * sw = &mii->bank[MII_BANK_SW];
+	if (!(mii_bank_peek(sw, SWAKD) & 0x80))
+		mii_keypress(mii, hl->keys.buffer[hl->keys.index++]);
+}
+
+/* Load the '<frame> <digest>' lines of the golden file, '#' are comments */
+static int
+_mii_hl_golden_load(
+		mii_headless_t *hl)
+{
+	FILE *f = fopen(hl->hash.check, "r");
+	if (!f) {
+		perror(hl->hash.check);
+		return -1;
+	}
+	char line[256];
+	int ln = 0;
+	while (fgets(line, sizeof(line), f)) {
+		ln++;
+		char *s = line;
+		while (isspace(*s))
+			s++;
+		if (!*s || *s == '#')
+			continue;
+		unsigned long frame;
+		unsigned long long hash;
+		if (sscanf(s, "%lu %llx", &frame, &hash) != 2) {
+			printf("%s:%d: invalid line\n", hl->hash.check, ln);
+			fclose(f);
+			return -1;
+		}
+		hl->hash.golden = realloc(hl->hash.golden,
+				(hl->hash.count + 1) * sizeof(*hl->hash.golden));
+		hl->hash.golden[hl->hash.count++] = (mii_hl_golden_t) {
+				.frame = frame, .hash = hash };
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Called after every stop, check the frame published since, if any */
+static void
+_mii_hl_hash(
+		mii_t *mii,
+		mii_headless_t *hl)
+{
+	uint32_t seq;
+
+	mii_video_sync(mii);
+	uint64_t hash = mii_video_get_hash(mii, &seq);
+	if (seq == hl->hash.last)
+		return;
+	hl->hash.last = seq;
+	uint32_t frame = seq - hl->hash.start;
+	if (hl->hash.save)
+		fprintf(hl->hash.save, "%u %016llx\n",
+				frame, (unsigned long long)hash);
+	for (uint32_t i = 0; i < hl->hash.count; i++) {
+		mii_hl_golden_t *g = &hl->hash.golden[i];
+		if (g->frame != frame)
+			continue;
+		g->checked = true;
+		if (g->hash != hash) {
+			printf("mii: frame %u digest %016llx, expected %016llx\n",
+					frame, (unsigned long long)hash,
+					(unsigned long long)g->hash);
+			hl->hash.errors++;
+		}
+	}
+}
+
+static double
+_mii_hl_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main(
+		int argc,
+		const char * argv[])
+{
+	mii_t *mii = &g_mii;
+	mii_headless_t hl = { .pc = -1 };
+	const char *mii_argv[argc + 1];
+
+	int mii_argc = _mii_hl_parse(&hl, argc, argv, mii_argv);
+	if (mii_argc < 0) {
+		_mii_hl_usage(argv[0]);
+		exit(1);
+	}
+	if (!hl.cycles && !hl.frames) {
+		printf("%s: needs a --cycles or --frames budget\n", argv[0]);
+		_mii_hl_usage(argv[0]);
+		exit(1);
+	}
+	mii_init(mii);
+	int idx = 1;
+	uint32_t flags = MII_INIT_DEFAULT | MII_INIT_SILENT;
+	int r = mii_argv_parse(mii, mii_argc, mii_argv, &idx, &flags);
+	if (r == 0) {
+		printf("mii: Invalid argument %s, skipped\n", mii_argv[idx]);
+	} else if (r == -1)
+		exit(1);
+	mii->audio.drv = NULL;
+	mii_prepare(mii, flags);
+	mii_reset(mii, true);
+	if (hl.snap_load) {
+		mii_snapshot_t *snap = mii_snapshot_read(hl.snap_load);
+		int res = snap ? mii_snapshot_restore(mii, snap) : -1;
+		mii_snapshot_free(snap);
+		if (res) {
+			printf("%s: can't restore %s\n", argv[0], hl.snap_load);
+			exit(1);
+		}
+	}
+
+	if (hl.hash.check && _mii_hl_golden_load(&hl))
+		exit(1);
+	if (hl.hash.check || hl.hash.save) {
+		mii_video_set_hash(mii, true);
+		mii_video_get_hash(mii, &hl.hash.start);
+		hl.hash.last = hl.hash.start;
+	}
+	if (hl.pc >= 0) {
+		mii->debug.bp[0].addr = hl.pc;
+		mii->debug.bp[0].kind = MII_BP_PC;
+		mii->debug.bp[0].size = 1;
+		mii->debug.bp_map |= 1 << 0;
+	}
+	const char * reason = "budget";
+	int status = (hl.pc >= 0 || hl.mem_count) ? 2 : 0;
+	double start = _mii_hl_time();
+	uint64_t start_cycle = mii->cpu.total_cycle;
+	uint32_t start_frame = mii->video.frame_count;
+
+	mii->state = MII_RUNNING;
+	do {
+		uint64_t budget = UINT64_MAX;
+		if (hl.cycles)
+			budget = hl.cycles - (mii->cpu.total_cycle - start_cycle);
+		int res = mii_run_cycles(mii, budget, MII_RUN_STOP_FRAME);
+		if (hl.hash.check || hl.hash.save)
+			_mii_hl_hash(mii, &hl);
+		if (res == MII_RUN_BREAKPOINT && hl.pc >= 0 &&
+				(mii->debug.bp[0].kind & MII_BP_HIT)) {
+			reason = "pc";
+			status = 0;
+			break;
+		}
+		if (res == MII_RUN_BREAKPOINT || res == MII_RUN_STOPPED) {
+			reason = "stopped";
+			break;
+		}
+		if (res != MII_RUN_FRAME)
+			continue;
+		if (_mii_hl_mem_match(mii, &hl)) {
+			reason = "mem";
+			status = 0;
+			break;
+		}
+		_mii_hl_keys(mii, &hl);
+	} while (mii->state != MII_TERMINATE &&
+			(!hl.cycles ||
+				mii->cpu.total_cycle - start_cycle < hl.cycles) &&
+			(!hl.frames ||
+				mii->video.frame_count - start_frame < hl.frames));
+
+	double elapsed = _mii_hl_time() - start;
+	uint64_t cycles = mii->cpu.total_cycle - start_cycle;
+	if (!hl.quiet) {
+		printf("mii: stopped on %s PC:%04x, %u frames, %lu cycles "
+				"in %.3fs (%.2f MHz)\n",
+				reason, mii->cpu.PC, mii->video.frame_count - start_frame,
+				(unsigned long)cycles, elapsed,
+				elapsed > 0 ? (cycles / elapsed) / 1e6 : 0);
+	}
+	for (uint32_t i = 0; i < hl.hash.count; i++) {
+		if (hl.hash.golden[i].checked)
+			continue;
+		printf("mii: frame %u was never reached\n", hl.hash.golden[i].frame);
+		hl.hash.errors++;
+	}
+	if (hl.hash.errors) {
+		printf("mii: %u frame digest(s) didn't match\n", hl.hash.errors);
+		status = 3;
+	}
+	if (hl.hash.save)
+		fclose(hl.hash.save);
+	free(hl.hash.golden);
+	if (mii_capture_stop(mii)) {
+		printf("mii: the capture is missing frames or audio\n");
+		status = 1;
+	}
+	if (hl.snap_save) {
+		mii_snapshot_t *snap = mii_snapshot_save(mii, NULL, 0);
+		if (mii_snapshot_write(snap, hl.snap_save))
+			status = 1;
+		mii_snapshot_free(snap);
+	}
+	free(hl.keys.buffer);
+	mii_dispose(mii);
+	return status;
+}
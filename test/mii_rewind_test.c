@@ -0,0 +1,128 @@
+/*
+ * mii_rewind_test.c
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * Rewind round trip. This boots DOS 3.3 with the rewind buffer enabled,
+ * takes a full snapshot at some frame, runs some more frames, and rewinds
+ * back to it; the machine state then has to match that snapshot, chunk for
+ * chunk. This goes through the whole XOR+RLE mii_snapshot_delta()/apply()
+ * chain, and mii_snapshot_clone()/restore().
+ *
+ * The rewind snapshots are taken inside mii_run_until(), the one it's
+ * compared with isn't, so this also checks the run budget timer isn't
+ * recorded.
+ *
+ *   make rewind_test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mii.h"
+#include "mii_snapshot.h"
+#include "mii_rewind.h"
+
+// so mii_mish_cmd can access the global mii_t
+mii_t g_mii;
+
+#define WARMUP_FRAMES	120
+#define REWIND_FRAMES	30
+
+static int
+_mii_rewind_test_frames(
+		mii_t *mii,
+		int frames)
+{
+	while (frames) {
+		int res = mii_run_until(mii, UINT64_MAX, MII_RUN_STOP_FRAME);
+		if (res == MII_RUN_FRAME)
+			frames--;
+		else if (res != MII_RUN_BUDGET)
+			return -1;
+	}
+	return 0;
+}
+
+/* Returns the number of chunks that differ, and lists them */
+static int
+_mii_rewind_test_compare(
+		const char *what,
+		const mii_snapshot_t *a,
+		const mii_snapshot_t *b)
+{
+	int diff = 0;
+	if (a->cycle != b->cycle) {
+		printf("%s: cycle %llu, expected %llu\n", what,
+				(unsigned long long)b->cycle, (unsigned long long)a->cycle);
+		diff++;
+	}
+	if (a->count != b->count) {
+		printf("%s: %u chunks, expected %u\n", what, b->count, a->count);
+		return diff + 1;
+	}
+	for (uint32_t i = 0; i < a->count; i++) {
+		const mii_snap_chunk_t *ca = &a->chunk[i];
+		const mii_snap_chunk_t *cb = mii_snap_find(b, ca->tag, ca->id);
+		int same = cb && cb->size == ca->size && cb->flags == ca->flags;
+		if (same && (ca->flags & MII_SNAP_PAGES)) {
+			for (uint32_t p = 0; p < ca->size / 256 && same; p++)
+				same = ca->page[p] == cb->page[p] ||
+						!memcmp(ca->page[p]->data, cb->page[p]->data, 256);
+		} else if (same)
+			same = !memcmp(ca->data, cb->data, ca->size);
+		if (!same) {
+			printf("%s: chunk %.4s:%d differs\n", what,
+					(const char *)&ca->tag, ca->id);
+			diff++;
+		}
+	}
+	return diff;
+}
+
+int main(
+		int argc,
+		const char * argv[])
+{
+	mii_t *mii = &g_mii;
+	const char *args[] = {
+		"mii_rewind_test", "-def", "-d", "6:1", "disks/dos33master.nib", NULL };
+	int idx = 1;
+	uint32_t flags = MII_INIT_DEFAULT | MII_INIT_SILENT;
+
+	mii_init(mii);
+	if (mii_argv_parse(mii, 5, args, &idx, &flags) != 1) {
+		fprintf(stderr, "%s: can't set up the machine\n", argv[0]);
+		return 1;
+	}
+	mii->audio.drv = NULL;
+	mii_prepare(mii, flags);
+	mii_reset(mii, true);
+	mii_rewind_init(mii, 2);
+
+	int errors = 0;
+	if (_mii_rewind_test_frames(mii, WARMUP_FRAMES) < 0) {
+		fprintf(stderr, "%s: machine stopped\n", argv[0]);
+		return 1;
+	}
+	mii_snapshot_t *then = mii_snapshot_save(mii, NULL, 0);
+	_mii_rewind_test_frames(mii, REWIND_FRAMES);
+
+	int res = mii_rewind_back(mii, REWIND_FRAMES);
+	if (res != REWIND_FRAMES) {
+		printf("rewind: went back %d frames, expected %d\n",
+				res, REWIND_FRAMES);
+		errors++;
+	}
+	mii_snapshot_t *now = mii_snapshot_save(mii, NULL, 0);
+	errors += _mii_rewind_test_compare("rewind", then, now);
+	printf("  REWIND %d frames to cycle %llu: %s\n", REWIND_FRAMES,
+			(unsigned long long)now->cycle, errors ? "FAIL" : "OK");
+	mii_snapshot_free(now);
+	mii_snapshot_free(then);
+	mii_dispose(mii);
+	return errors ? 1 : 0;
+}
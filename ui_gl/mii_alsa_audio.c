@@ -0,0 +1,268 @@
+/*
+ * mii_alsa_audio.c
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * Direct ALSA driver. It has its own (realtime if allowed) thread that
+ * waits for the device, and mixes the sources straight into the mmap'd
+ * device buffer, one period at a time. There is no intermediate buffer,
+ * so the latency is just the device buffer, periods * period_size frames,
+ * plus the sink's FIFO target (see --audio-latency).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mii.h"
+#include "mii_alsa_audio.h"
+
+#ifdef HAS_ALSA
+#include <alsa/asoundlib.h>
+
+#define MII_ALSA_PERIODS		3
+#define MII_ALSA_PERIOD_SIZE	256
+
+typedef struct mii_alsa_audio_t {
+	mii_audio_sink_t *	sink;
+	snd_pcm_t *			pcm;
+	snd_pcm_uframes_t	period_size, buffer_size;
+	pthread_t			thread;
+	bool				running;
+	volatile int		quit;
+} mii_alsa_audio_t;
+
+static mii_alsa_audio_t _alsa = {};
+
+static int
+_mii_alsa_setup(
+		mii_alsa_audio_t *a)
+{
+	mii_audio_sink_t *sink = a->sink;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	unsigned int rate = MII_AUDIO_FREQ;
+	unsigned int periods = sink->periods ? sink->periods : MII_ALSA_PERIODS;
+	int err;
+
+	a->period_size = sink->period_size ?
+							sink->period_size : MII_ALSA_PERIOD_SIZE;
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(a->pcm, hw);
+	if ((err = snd_pcm_hw_params_set_access(a->pcm, hw,
+					SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+			(err = snd_pcm_hw_params_set_format(a->pcm, hw,
+					SND_PCM_FORMAT_FLOAT)) < 0 ||
+			(err = snd_pcm_hw_params_set_channels(a->pcm, hw,
+					MII_AUDIO_CHANNELS)) < 0 ||
+			(err = snd_pcm_hw_params_set_rate_near(a->pcm, hw,
+					&rate, NULL)) < 0 ||
+			(err = snd_pcm_hw_params_set_period_size_near(a->pcm, hw,
+					&a->period_size, NULL)) < 0 ||
+			(err = snd_pcm_hw_params_set_periods_near(a->pcm, hw,
+					&periods, NULL)) < 0 ||
+			(err = snd_pcm_hw_params(a->pcm, hw)) < 0) {
+		printf("%s: %s: hw params: %s\n", __func__,
+				sink->device, snd_strerror(err));
+		return -1;
+	}
+	// the sources are all at MII_AUDIO_FREQ, there is no resampling
+	if (rate != MII_AUDIO_FREQ) {
+		printf("%s: %s: %uHz not supported, use 'plughw:'\n", __func__,
+				sink->device, MII_AUDIO_FREQ);
+		return -1;
+	}
+	snd_pcm_hw_params_get_period_size(hw, &a->period_size, NULL);
+	snd_pcm_hw_params_get_buffer_size(hw, &a->buffer_size);
+	/* wake up for each period, and start once the whole buffer is full,
+	 * the thread fills it on the first go */
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(a->pcm, sw);
+	if ((err = snd_pcm_sw_params_set_avail_min(a->pcm, sw,
+					a->period_size)) < 0 ||
+			(err = snd_pcm_sw_params_set_start_threshold(a->pcm, sw,
+					a->buffer_size)) < 0 ||
+			(err = snd_pcm_sw_params(a->pcm, sw)) < 0) {
+		printf("%s: %s: sw params: %s\n", __func__,
+				sink->device, snd_strerror(err));
+		return -1;
+	}
+	// report what we actually got, the mish 'audio' command shows it too
+	sink->periods = a->buffer_size / a->period_size;
+	sink->period_size = a->period_size;
+	sink->device_ms = a->buffer_size * 1000.0f / rate;
+	printf("%s: %s %ux%u frames, %.1fms (+%.0fms FIFO)\n", __func__,
+			sink->device, sink->periods, sink->period_size,
+			sink->device_ms, sink->latency_ms);
+	return 0;
+}
+
+/* Underrun (or suspend), restart the stream; the next pass refills the
+ * buffer, and it restarts on its own once it's full */
+static int
+_mii_alsa_recover(
+		mii_alsa_audio_t *a,
+		int err)
+{
+	if (err == -EPIPE || err == -ESTRPIPE)
+		a->sink->xruns++;
+	err = snd_pcm_recover(a->pcm, err, 1);
+	if (err < 0)
+		printf("%s: %s\n", __func__, snd_strerror(err));
+	return err;
+}
+
+static int
+_mii_alsa_period(
+		mii_alsa_audio_t *a)
+{
+	mii_audio_sink_t *sink = a->sink;
+	snd_pcm_uframes_t size = a->period_size;
+
+	sink->period = a->period_size;
+	mii_audio_run(sink);
+	// the mmap area can wrap in the middle of a period
+	while (size) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, frames = size;
+		int err = snd_pcm_mmap_begin(a->pcm, &areas, &offset, &frames);
+		if (err < 0)
+			return err;
+		// interleaved, the first channel's area is the whole frame
+		float *out = (float*)((uint8_t*)areas[0].addr +
+							(areas[0].first / 8) + (offset * areas[0].step / 8));
+		mii_audio_mix(sink, out, frames, MII_AUDIO_CHANNELS);
+		snd_pcm_sframes_t done = snd_pcm_mmap_commit(a->pcm, offset, frames);
+		if (done < 0)
+			return done;
+		if ((snd_pcm_uframes_t)done != frames)
+			return -EPIPE;
+		size -= frames;
+	}
+	return 0;
+}
+
+static void *
+_mii_alsa_thread(
+		void *param)
+{
+	mii_alsa_audio_t *a = param;
+	struct sched_param sp = {
+		.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1,
+	};
+	// needs rtprio (or CAP_SYS_NICE), it's fine without it
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+		printf("%s: no realtime priority\n", __func__);
+	while (!a->quit) {
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(a->pcm);
+		int err = 0;
+		if (avail < 0)
+			err = avail;
+		else if ((snd_pcm_uframes_t)avail < a->period_size) {
+			err = snd_pcm_wait(a->pcm, 100);
+			if (err >= 0)
+				continue;
+		} else
+			err = _mii_alsa_period(a);
+		if (err < 0 && _mii_alsa_recover(a, err) < 0)
+			break;
+	}
+	return NULL;
+}
+
+static void
+mii_alsa_audio_stop(
+		mii_audio_sink_t *sink)
+{
+	mii_alsa_audio_t *a = &_alsa;
+	if (!a->pcm)
+		return;
+	if (a->running) {
+		a->quit = 1;
+		pthread_join(a->thread, NULL);
+		a->running = false;
+	}
+	snd_pcm_drop(a->pcm);
+	snd_pcm_close(a->pcm);
+	a->pcm = NULL;
+	printf("%s: %s xruns: %u\n", __func__, sink->device, sink->xruns);
+}
+
+/* The device is already open and prepared, see mii_alsa_audio_init() */
+static void
+mii_alsa_audio_start(
+		mii_audio_sink_t *sink)
+{
+	mii_alsa_audio_t *a = &_alsa;
+
+	if (!a->pcm || a->running)
+		return;
+	a->quit = 0;
+	if (pthread_create(&a->thread, NULL, _mii_alsa_thread, a)) {
+		perror(__func__);
+		return;
+	}
+	a->running = true;
+}
+
+static void
+mii_alsa_audio_write(
+		mii_audio_sink_t *sink,
+		mii_audio_source_t *source)
+{
+}
+
+static const struct mii_audio_driver_t mii_alsa_audio_driver = {
+	.start = mii_alsa_audio_start,
+	.stop = mii_alsa_audio_stop,
+	.write = mii_alsa_audio_write,
+};
+
+int
+mii_alsa_audio_init(
+		mii_t *mii)
+{
+	mii_audio_sink_t *sink = &mii->audio;
+	mii_alsa_audio_t *a = &_alsa;
+	int err;
+
+	mii_alsa_audio_stop(sink);
+	*a = (mii_alsa_audio_t) { .sink = sink };
+	if ((err = snd_pcm_open(&a->pcm, sink->device,
+					SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+		printf("%s: %s: %s\n", __func__, sink->device, snd_strerror(err));
+		a->pcm = NULL;
+		sink->device = NULL;
+		return -1;
+	}
+	if (_mii_alsa_setup(a) < 0 ||
+			(err = snd_pcm_prepare(a->pcm)) < 0) {
+		if (err < 0)
+			printf("%s: %s: %s\n", __func__, sink->device,
+					snd_strerror(err));
+		snd_pcm_close(a->pcm);
+		a->pcm = NULL;
+		sink->device = NULL;
+		return -1;
+	}
+	mii_audio_set_driver(sink, &mii_alsa_audio_driver);
+	return 0;
+}
+
+#else
+
+int
+mii_alsa_audio_init(
+		mii_t *mii)
+{
+	printf("%s: ALSA support not compiled in\n", __func__);
+	mii->audio.device = NULL;
+	return -1;
+}
+
+#endif
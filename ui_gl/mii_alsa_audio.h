@@ -0,0 +1,20 @@
+/*
+ * mii_alsa_audio.h
+ *
+ * Copyright (C) 2024 Michel Pollet <buserror@gmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#include "mii.h"
+
+/*
+ * Plays directly on the ALSA device mii->audio.device, with
+ * mii->audio.periods of mii->audio.period_size frames. The device is opened
+ * and configured here; returns 0, or -1 if that fails (or ALSA support isn't
+ * compiled in), then mii->audio.device is cleared and the driver isn't set.
+ */
+int
+mii_alsa_audio_init(
+		mii_t *mii);
@@ -29,6 +29,7 @@
 #include "mii_mui_gl.h"
 #include "miigl_counter.h"
 #include "mii_sokol_audio.h"
+#include "mii_alsa_audio.h"
 #define MII_ICON64_DEFINE
 #include "mii_icon64.h"
 
@@ -714,6 +715,22 @@ _mii_ui_load_config(
 
 // I want at least the 'silent' flags to be 'sticky'
 uint32_t g_startup_flags = 0;
+// same for the audio device, mii_init() clears it
+static struct {
+	const char *	device;
+	uint			periods, period_size;
+} g_audio_device = {};
+
+static void
+_mii_ui_audio_init(
+	mii_t * mii )
+{
+	mii->audio.device = g_audio_device.device;
+	mii->audio.periods = g_audio_device.periods;
+	mii->audio.period_size = g_audio_device.period_size;
+	if (!mii->audio.device || mii_alsa_audio_init(mii) < 0)
+		mii_sokol_audio_init(mii);
+}
 
 void
 mii_x11_reload_config(
@@ -737,7 +754,7 @@ mii_x11_reload_config(
 	if (g_startup_flags & MII_INIT_SILENT)
 		mii->audio.drv = NULL;
 	else
-		mii_sokol_audio_init(mii);
+		_mii_ui_audio_init(mii);
 	mii_prepare(mii, flags);
 	mii_reset(mii, true);
 	mii_mui_gl_prepare_textures(&ui->video);
@@ -799,8 +816,11 @@ main(
 			printf("mii: Invalid argument %s, skipped\n", argv[idx]);
 		} else if (r == -1)
 			exit(1);
+		g_audio_device.device = mii->audio.device;
+		g_audio_device.periods = mii->audio.periods;
+		g_audio_device.period_size = mii->audio.period_size;
 		if (!(flags & MII_INIT_SILENT))
-			mii_sokol_audio_init(mii);
+			_mii_ui_audio_init(mii);
 		else
 			printf("Audio disabled\n");
 		mii_prepare(mii, flags);
@@ -57,7 +57,6 @@ typedef struct mii_mui_t {
 	mii_mui_v_array_t		video_mesh;
 	int_array_t 			video_indices;
 	c2_rect_t				video_frame; // current video frame
-	uint32_t 				video_drawn_seed;
 	float					mui_alpha;
 	bool	 				mui_visible;
 	void *					transision_state;
@@ -67,6 +66,13 @@ typedef struct mii_mui_t {
 		c2_rect_t 				from, to;
 	} 						transition;
 	unsigned int			tex_id[MII_PIXEL_LAYERS];
+	// indexed video output, the shader applies the palette and scanlines
+	struct {
+		unsigned int 			program;	// 0 if the shader failed
+		unsigned int 			tex, palette;
+		uint32_t 				palette_seq;	// palette uploaded, from the frames
+		uint8_t 				indexed;	// last frame uploaded was indexed
+	}						video_index;
 	union {
 		struct {
 			mui_drawable_t		mii;
@@ -27,6 +27,95 @@
 #include "mii_mui_gl.h"
 #include "mii_floppy.h"
 
+/*
+ * Indexed video; 'index' is the 560x192 mii_video_t.index_pixels, 'palette'
+ * the 64 colors of mii_video_t.palette. This does the same as the CPU side;
+ * every odd line is the C_SCANLINE_MASK'ed version of the color (that's the
+ * palette second half), and the result is filtered like a GL_LINEAR 560x384
+ * texture would be.
+ */
+static const char * _video_index_vs =
+	"void main() {\n"
+	"	gl_Position = ftransform();\n"
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	"}\n";
+static const char * _video_index_fs =
+	"uniform sampler2D index;\n"
+	"uniform sampler2D palette;\n"
+	"const vec2 size = vec2(560.0, 384.0);\n"
+	"vec4 pixel(vec2 p) {\n"
+	"	p = clamp(p, vec2(0.0), size - 1.0);\n"
+	"	float i = texture2D(index, vec2((p.x + 0.5) / size.x,\n"
+	"				(floor(p.y / 2.0) + 0.5) / (size.y / 2.0))).r * 255.0;\n"
+	"	if (mod(p.y, 2.0) >= 1.0 && i < 32.0)\n"
+	"		i += 32.0;\n"
+	"	return texture2D(palette, vec2((i + 0.5) / 64.0, 0.5));\n"
+	"}\n"
+	"void main() {\n"
+	"	vec2 p = gl_TexCoord[0].st * size - 0.5;\n"
+	"	vec2 f = fract(p);\n"
+	"	p = floor(p);\n"
+	"	gl_FragColor = mix(\n"
+	"			mix(pixel(p), pixel(p + vec2(1.0, 0.0)), f.x),\n"
+	"			mix(pixel(p + vec2(0.0, 1.0)), pixel(p + vec2(1.0, 1.0)), f.x),\n"
+	"			f.y);\n"
+	"}\n";
+
+static GLuint
+_mii_gl_shader(
+		GLenum kind,
+		const char * source)
+{
+	GLuint sh = glCreateShader(kind);
+	glShaderSource(sh, 1, &source, NULL);
+	glCompileShader(sh);
+	GLint ok = 0;
+	glGetShaderiv(sh, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		char log[512];
+		glGetShaderInfoLog(sh, sizeof(log), NULL, log);
+		printf("%s: %s\n", __func__, log);
+		glDeleteShader(sh);
+		return 0;
+	}
+	return sh;
+}
+
+static void
+_mii_gl_video_index_init(
+		mii_mui_t *ui)
+{
+	GLuint vs = _mii_gl_shader(GL_VERTEX_SHADER, _video_index_vs);
+	GLuint fs = _mii_gl_shader(GL_FRAGMENT_SHADER, _video_index_fs);
+	ui->video_index.program = 0;
+	if (vs && fs) {
+		GLuint prog = glCreateProgram();
+		glAttachShader(prog, vs);
+		glAttachShader(prog, fs);
+		glLinkProgram(prog);
+		GLint ok = 0;
+		glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+		if (ok) {
+			glUseProgram(prog);
+			glUniform1i(glGetUniformLocation(prog, "index"), 0);
+			glUniform1i(glGetUniformLocation(prog, "palette"), 1);
+			glUseProgram(0);
+			ui->video_index.program = prog;
+		} else {
+			printf("%s: link failed\n", __func__);
+			glDeleteProgram(prog);
+		}
+	}
+	if (vs)
+		glDeleteShader(vs);
+	if (fs)
+		glDeleteShader(fs);
+	GLuint tex[2];
+	glGenTextures(2, tex);
+	ui->video_index.tex = tex[0];
+	ui->video_index.palette = tex[1];
+}
+
 void
 mii_mui_gl_init(
 		mii_mui_t *ui)
@@ -39,6 +128,7 @@ mii_mui_gl_init(
 		ui->pixels.v[i].texture.id = tex[i];
 		ui->tex_id[i] = tex[i];
 	}
+	_mii_gl_video_index_init(ui);
 	mii_mui_gl_prepare_textures(ui);
 }
 
@@ -115,6 +205,25 @@ mii_mui_gl_prepare_textures(
 			dr->texture.size.y, 0, dr->texture.kind,
 			GL_UNSIGNED_BYTE, //GL_UNSIGNED_INT_8_8_8_8_REV,
 			dr->pix.pixels);
+	/* Indexed video textures, these can't be filtered by GL, the shader
+	 * does it after applying the palette */
+	glBindTexture(GL_TEXTURE_2D, ui->video_index.tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE8,
+			MII_VIDEO_WIDTH, MII_VIDEO_HEIGHT / 2, 0, GL_LUMINANCE,
+			GL_UNSIGNED_BYTE, mii->video.index_pixels);
+	glBindTexture(GL_TEXTURE_2D, ui->video_index.palette);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	// filled from the first frame, see mii_video_frame_t.palette
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 64, 1, 0, GL_RGBA,
+			GL_UNSIGNED_BYTE, NULL);
+	ui->video_index.palette_seq = 0;
 #if 0
 	{
 		printf("Creating video mesh: %d vertices %d indices\n",
@@ -302,6 +411,29 @@ _mii_decay_heatmap(
 }
 
 
+/* Upload the runs of changed video lines, each is 'rows' texture rows */
+static void
+_mii_gl_video_upload(
+		const uint64_t lines[192 / 64],
+		int rows,
+		unsigned int format,
+		uint8_t *pixels,
+		uint32_t row_bytes)
+{
+	for (int l = 0; l < 192; l++) {
+		if (!(lines[l / 64] & (1ULL << (l & 63))))
+			continue;
+		int e = l + 1;
+		while (e < 192 && (lines[e / 64] & (1ULL << (e & 63))))
+			e++;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, l * rows,
+				MII_VIDEO_WIDTH, (e - l) * rows, format,
+				GL_UNSIGNED_BYTE, //GL_UNSIGNED_INT_8_8_8_8_REV,
+				pixels + (l * rows * row_bytes));
+		l = e;
+	}
+}
+
 bool
 mii_mui_gl_run(
 		mii_mui_t *ui)
@@ -340,21 +472,36 @@ mii_mui_gl_run(
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 		pixman_region32_clear(&mui->redraw);
 	}
-	uint32_t current_seed = mii->video.frame_seed;
-	if (current_seed != ui->video_drawn_seed) {
+	if (mii->video.indexed && !ui->video_index.program) {
+		printf("%s: no shader for the indexed video\n", __func__);
+		mii_video_set_indexed(mii, false);
+	}
+	// only upload the lines that changed since the last frame we got
+	mii_video_frame_t * frame = mii_video_get_frame(mii);
+	/* The palette comes with the frame, mii_video_set_mode() can be
+	 * rewriting mii->video.palette meanwhile */
+	if (frame && frame->indexed &&
+			ui->video_index.palette_seq != frame->palette_seq) {
+		draw = true;
+		ui->video_index.palette_seq = frame->palette_seq;
+		glBindTexture(GL_TEXTURE_2D, ui->video_index.palette);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 64, 1,
+				GL_RGBA, GL_UNSIGNED_BYTE, frame->palette);
+	}
+	if (frame && (frame->lines[0] | frame->lines[1] | frame->lines[2])) {
 	//	miigl_counter_tick(&ui->videoc, miigl_get_time());
 		draw = true;
-		ui->video_drawn_seed = current_seed;
-		// update the whole texture
-		mui_drawable_t * dr = &ui->pixels.mii;
-		glBindTexture(GL_TEXTURE_2D, dr->texture.id);
-	//	glPixelStorei(GL_UNPACK_ROW_LENGTH, dr->pix.row_bytes / 4);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
-				dr->pix.size.x, dr->pix.size.y,
-				dr->texture.kind,
-				GL_UNSIGNED_BYTE, //GL_UNSIGNED_INT_8_8_8_8_REV,
-				dr->pix.pixels);
-	//	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		ui->video_index.indexed = frame->indexed;
+		if (frame->indexed) {
+			glBindTexture(GL_TEXTURE_2D, ui->video_index.tex);
+			_mii_gl_video_upload(frame->lines, 1, GL_LUMINANCE,
+					frame->index_pixels, MII_VIDEO_WIDTH);
+		} else {
+			mui_drawable_t * dr = &ui->pixels.mii;
+			glBindTexture(GL_TEXTURE_2D, dr->texture.id);
+			_mii_gl_video_upload(frame->lines, 2, dr->texture.kind,
+					(uint8_t*)frame->pixels, dr->pix.row_bytes);
+		}
 	}
 #if MII_VIDEO_DEBUG_HEAPMAP
 	if (ui->mii.state == MII_RUNNING) {
@@ -449,6 +596,24 @@ glRect(
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 }
 
+/* Switch to the indexed video shader and textures, if it is in use */
+static void
+_mii_gl_video_index_use(
+		mii_mui_t *ui,
+		bool on)
+{
+	if (!ui->video_index.indexed || !ui->video_index.program)
+		return;
+	if (on) {
+		glUseProgram(ui->video_index.program);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, ui->video_index.palette);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, ui->video_index.tex);
+	} else
+		glUseProgram(0);
+}
+
 void
 mii_mui_gl_render(
 		mii_mui_t *ui)
@@ -485,6 +650,7 @@ mii_mui_gl_render(
 	glBindTexture(GL_TEXTURE_2D, dr->texture.id);
 	if (ui->video_mesh.count == 0) {
 		c2_rect_t r = ui->video_frame;
+		_mii_gl_video_index_use(ui, true);
 		glRect(&r);
 	} else {
 		c2_rect_t r = ui->video_frame;
@@ -495,6 +661,7 @@ mii_mui_gl_render(
 		glRect(&r);
 		glColor4f(1.0f, 1.0f, 1.0f, 1.0);
 		glEnable(GL_TEXTURE_2D);
+		_mii_gl_video_index_use(ui, true);
 #if 0
 		glPushMatrix();
 		glTranslatef(r.l, r.t, 0);
@@ -521,6 +688,7 @@ mii_mui_gl_render(
 		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 #endif
 	}
+	_mii_gl_video_index_use(ui, false);
 #if MII_VIDEO_DEBUG_HEAPMAP
 	/* draw video heatmap */
 	dr = &ui->pixels.video_heapmap;
@@ -16,6 +16,7 @@
 #define MII_MUI_MENUS_C
 #include "mii_mui_menus.h"
 #include "mii_mui_settings.h"
+#include "mii_rewind.h"
 
 
 struct mii_x11_t;
@@ -287,6 +288,9 @@ mii_menubar_action(
 					};
 					mii_th_fifo_write(mii_thread_get_fifo(&ui->mii), sig);
 				}	break;
+				case FCC('r','w','n','d'):
+					mii_rewind_request(mii, 5 * MII_REWIND_FPS);
+					break;
 				case FCC('a','u','d','0'):
 					mii->audio.muted = !mii->audio.muted;
 					ui->config.audio_muted = mii->audio.muted;
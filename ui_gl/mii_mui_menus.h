@@ -103,6 +103,10 @@ mui_menu_item_t m_machine_menu[] = {
 			.uid = FCC('r','e','s','t'),
 			.key_equ = MUI_KEY_EQU(MUI_MODIFIER_RCTRL, MUI_KEY_F12),
 			.kcombo = MUI_GLYPH_CONTROL MUI_GLYPH_F12 },
+	{ .title = "Rewind 5 Seconds",	// needs --rewind
+			.uid = FCC('r','w','n','d'),
+			.key_equ = MUI_KEY_EQU(MUI_MODIFIER_RCTRL, MUI_KEY_F9),
+			.kcombo = MUI_GLYPH_CONTROL MUI_GLYPH_F9 },
 	{ .title = "-", },
 	{ .title = "Configure Slots…",
 			.uid = FCC('s','l','o','t') },
@@ -53,33 +53,6 @@ mii_sokol_audio_write(
 //	mii_audio_frame_t *frame = mii_audio_buffer_write_ptr(fifo);
 }
 
-/* This is very pedestrian, but it helps with the compiler explorer to
- * see what gets vectorized in here -- as it turns out, -O3 seems to do
- * a slightly better job at it than trying to use the generic gcc vectoring
- * extensions. So I keep the scalar code instead */
-unsigned int
-_mix_sample_buffer(
-		const float volume,
-		unsigned int num_frames,
-        const float src[num_frames],
-		float    dst[num_frames])
-{
-    #define fmin -1.0f
-    #define fmax 1.0f
-    while (num_frames) {
-        float s = *src;
-        float d = *dst;
-        float m = s * volume;
-        float a = d + m;
-        d = a > fmax ? fmax : a < fmin ? fmin : a;
-        *dst = d;
-        dst++;
-        src++;
-        num_frames--;
-    }
-	return num_frames;
-}
-
 static void __attribute__((unused))
 _sokol_stream_cb(
 		float *  buffer,
@@ -89,41 +62,10 @@ _sokol_stream_cb(
 {
 	mii_audio_sink_t *sink = user_data;
 
+	sink->period = num_frames;
 	mii_audio_run(sink);
-
-	mii_audio_source_t *s;
-	// audio buffer is not zeroed.
-	const uint num_samples = num_frames * num_channels;
-	memset(buffer, 0, num_samples * sizeof(float));
-	uint count = 0;
-	float inter[num_samples];
-	SLIST_FOREACH(s, &sink->source, self) {
-		mii_audio_frame_t *f = &s->fifo;
-		uint avail = mii_audio_frame_get_read_size(f);
-		if (avail > num_samples)
-			avail = num_samples;
-		uint dst;
-		if (sink->muted) {	// just advance read pointer
-			mii_audio_frame_read_offset(f, avail);
-		} else {
-			/*
-			 * Wait for a full buffer of audio available before we start
-			 * taking it, otherwise we'd be padding the end of the frame
-			 * with zeroes, creating horrible click.
-			 * Once the engine is started, we're OK to take whatever is
-			 * available, as we'll be padding the end of the frame with
-			 * the last sample we read, which is a lot less noticeable.
-			 */
-			if ((s->last_read == 0 && avail >= num_samples) ||
-						((s->last_read > 0 && avail > 0))) {
-				dst = mii_audio_frame_read_count(f, avail, inter);
-				count += dst;
-				_mix_sample_buffer(s->vol_multiplier, dst, inter, buffer);
-				s->last_read = dst;
-			} else
-				s->last_read = 0;
-		}
-	}
+	// audio buffer is not zeroed, the mixer writes all of it
+	mii_audio_mix(sink, buffer, num_frames, num_channels);
 }
 #ifdef MINIAUDIO
 static void
@@ -133,7 +75,8 @@ _ma_stream_cb(
 		const void* pInput,
 		ma_uint32 frameCount)
 {
-	_sokol_stream_cb(pOutput, frameCount, 1, pDevice->pUserData);
+	_sokol_stream_cb(pOutput, frameCount, MII_AUDIO_CHANNELS,
+			pDevice->pUserData);
 }
 #endif
 
@@ -167,7 +110,7 @@ mii_sokol_audio_start(
 	saudio_setup(&(saudio_desc){
 		.stream_userdata_cb = _sokol_stream_cb,
 		.user_data = sink,
-		.num_channels = 1,
+		.num_channels = MII_AUDIO_CHANNELS,
 		.sample_rate = 44100,
 		.buffer_frames = 1024,
 	//	.logger.func = slog_func,
@@ -178,7 +121,7 @@ mii_sokol_audio_start(
 #ifdef MINIAUDIO
 	ma_device_config config = ma_device_config_init(ma_device_type_playback);
 	config.playback.format   = ma_format_f32;
-	config.playback.channels = 1;
+	config.playback.channels = MII_AUDIO_CHANNELS;
 	config.sampleRate        = 44100;
 	config.dataCallback      = _ma_stream_cb;
 	config.pUserData         = sink;
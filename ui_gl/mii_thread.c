@@ -70,7 +70,6 @@ mii_thread_cpu_regulator(
 	}
 	mii_thread_set_fps(timerfd, default_fps);
 	mii->state = MII_RUNNING;
-	uint32_t last_frame = mii->video.frame_count;
 
 //	miigl_counter_t frame_counter = {};
 	uint8_t * 	paste_buffer = NULL;
@@ -114,14 +113,13 @@ mii_thread_cpu_regulator(
 				}	break;
 			}
 		}
-		if (mii->state != MII_STOPPED)
-			mii_run(mii);
 		bool sleep = false;
 		switch (mii->state) {
 			case MII_STOPPED:
 				sleep = true;
 				break;
 			case MII_STEP:
+				mii_run(mii);
 				sleep = true;
 				if (running) {
 					running--;
@@ -134,9 +132,12 @@ mii_thread_cpu_regulator(
 				}
 				break;
 			case MII_RUNNING: {
-				uint32_t fi = mii->video.frame_count;
-				sleep = fi != last_frame;
-				last_frame = fi;
+				/* run a tick worth of cycles, or up to the end of the frame,
+				 * breakpoints etc will change the state, and we'll sleep
+				 * next time around */
+				uint64_t budget = (1000000.0 * mii->speed) / default_fps;
+				int r = mii_run_cycles(mii, budget, MII_RUN_STOP_FRAME);
+				sleep = r == MII_RUN_FRAME || r == MII_RUN_BUDGET;
 			}	break;
 			case MII_TERMINATE:
 				running = 0;